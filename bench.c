@@ -0,0 +1,481 @@
+// bench.c - Microbenchmarks for the web server's hot paths on fixed inputs
+// web-server.c is compiled in with its main renamed, so every function is measured exactly as it ships
+#define main web_server_main
+#include "web-server.c"
+#undef main
+#include <netinet/tcp.h>
+
+#define BENCH_REPEATS 7                 // runs per benchmark; the median is reported
+#define BENCH_MAX_THREADS 8
+#define LEGACY_BUFFER_SIZE 4096         // the old per-request method, path and body buffers
+#define BENCH_E2E_PORT 18090            // loopback port of the end-to-end epoll loop; io_uring uses the next
+
+// One benchmark: setup runs once, run does a fixed number of iterations so results compare across commits
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*run)(long iterations, int threads);
+    long iterations;
+    int threads;                        // for benchmarks that run on several threads at once
+} bench_t;
+
+// A typical long-poll from the page, with the headers a browser sends
+const char bench_get_request[] =
+    "GET /messages/wait?room=lobby&since=1234 HTTP/1.1\r\n"
+    "Host: 192.168.1.20:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://192.168.1.20:8080/?room=lobby\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// A message post as the page's form sends it
+const char bench_form[] =
+    "username=Alice+Smith&message=Hello%2C+world%21+Are+we+still+meeting+at+3%3A30%3F+"
+    "%F0%9F%98%80+Bring+the+slides+%26+the+%3Cb%3Enew%3C%2Fb%3E+numbers.";
+
+const char bench_message[] = "Are we still meeting at 3:30? Bring the slides & the <b>new</b> numbers.";
+
+event_loop_t bench_loop;               // owns the pool and arena bench_conn draws from
+http_conn_t bench_conn;
+char bench_body[1024];
+chat_room_t *bench_room;
+rendered_history_t *bench_old;
+volatile long bench_sink;               // keeps results alive so nothing is optimized away
+cpu_set_t bench_cpus;                   // CPUs the process may use, before main pins itself
+event_loop_t bench_e2e_loops[2];        // loopback servers for the end-to-end benchmarks, epoll and io_uring
+int bench_e2e_fd = -1;
+char bench_e2e_response[16 * 1024];
+
+// A small keep-alive request the loop answers without touching a room
+const char bench_e2e_request[] = "GET /messages?room=bench-e2e&since=0 HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+// What one posting thread does
+typedef struct {
+    long iterations;
+    int index;
+} post_share_t;
+
+// Give the connection its pooled input buffer, as the first read does
+void setup_parse() {
+    conn_hold_input(&bench_conn);
+}
+
+// Parse one GET request with browser headers
+void run_parse_get(long iterations, int threads) {
+    size_t len = sizeof(bench_get_request) - 1;
+    for (long i = 0; i < iterations; i++) {
+        memcpy(bench_conn.in_buf, bench_get_request, len);
+        bench_conn.in_len = len;
+        memset(bench_conn.req, 0, sizeof(http_request_t));
+        bench_sink += parse_request(&bench_conn);
+    }
+}
+
+// Method and path by sscanf and the body copied out, as requests were parsed before parse_request
+void legacy_parse_http_request(const char* request, char* method, char* path, char* post_data) {
+    sscanf(request, "%s %s", method, path);
+    
+    // Extract POST data if present
+    const char* content_start = strstr(request, "\r\n\r\n");
+    if (content_start) {
+        strcpy(post_data, content_start + 4);
+    } else {
+        post_data[0] = '\0';
+    }
+}
+
+// Old header lookup: scan line by line from the request start for name, NULL if absent
+const char* legacy_find_header(const char* start, const char* end, const char* name) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(start, "\r\n");
+    
+    while (line && line + 2 + name_len < end) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+// The same GET through the old path: completeness and Content-Length by string search, sscanf for the
+// request line, the query split off the path and the Connection header looked up for keep-alive
+void run_parse_get_legacy(long iterations, int threads) {
+    static char buffer[LEGACY_BUFFER_SIZE];
+    char method[16], path[256], post_data[LEGACY_BUFFER_SIZE];
+    size_t len = sizeof(bench_get_request) - 1;
+    for (long i = 0; i < iterations; i++) {
+        memcpy(buffer, bench_get_request, len + 1);
+        const char *header_end = strstr(buffer, "\r\n\r\n");
+        const char *content_length = legacy_find_header(buffer, header_end + 2, "Content-Length");
+        legacy_parse_http_request(buffer, method, path, post_data);
+        char *query = strchr(path, '?');
+        if (query) {
+            *query++ = '\0';
+        }
+        const char *connection = legacy_find_header(buffer, header_end + 2, "Connection");
+        bench_sink += (content_length != NULL) + (connection != NULL) + path[1] + (query ? query[0] : 0);
+    }
+}
+
+// Split and decode the fields of one posted form
+void run_form_decode(long iterations, int threads) {
+    char form[sizeof(bench_form)];
+    for (long i = 0; i < iterations; i++) {
+        char *cursor = form, *name, *value;
+        memcpy(form, bench_form, sizeof(form));
+        while (next_form_field(&cursor, form + sizeof(form) - 1, &name, &value)) {
+            bench_sink += value[0];
+        }
+    }
+}
+
+// The byte-at-a-time decoder the server used before next_form_field, kept as its baseline
+void legacy_url_decode(char* dst, const char* src) {
+    char a, b;
+    while (*src) {
+        if ((*src == '%') && ((a = src[1]) && (b = src[2])) && (isxdigit(a) && isxdigit(b))) {
+            if (a >= 'a') a -= 'a'-'A';
+            if (a >= 'A') a -= ('A' - 10);
+            else a -= '0';
+            if (b >= 'a') b -= 'a'-'A';
+            if (b >= 'A') b -= ('A' - 10);
+            else b -= '0';
+            *dst++ = 16*a+b;
+            src+=3;
+        } else if (*src == '+') {
+            *dst++ = ' ';
+            src++;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+}
+
+// The same form split with strtok and decoded by legacy_url_decode into fixed fields, as posts used to be
+void run_form_decode_legacy(long iterations, int threads) {
+    char form[sizeof(bench_form)];
+    for (long i = 0; i < iterations; i++) {
+        char username[64] = "", message[256] = "";
+        memcpy(form, bench_form, sizeof(form));
+        char *token = strtok(form, "&");
+        while (token != NULL) {
+            if (strncmp(token, "username=", 9) == 0) {
+                legacy_url_decode(username, token + 9);
+            } else if (strncmp(token, "message=", 8) == 0) {
+                legacy_url_decode(message, token + 8);
+            }
+            token = strtok(NULL, "&");
+        }
+        bench_sink += username[0] + message[0];
+    }
+}
+
+// Fill the render room's whole history window
+void setup_render() {
+    bench_room = find_room("bench-render", 12, ROOM_POST);
+    for (int i = 0; i < history_capacity; i++) {
+        add_message_to_history(bench_room, "Alice", bench_message);
+    }
+}
+
+// Render a full history window from scratch
+void run_render_full(long iterations, int threads) {
+    for (long i = 0; i < iterations; i++) {
+        rendered_history_t *rendered = render_chat_history(bench_room, NULL);
+        bench_sink += rendered->len;
+        release_rendered_history(rendered);
+    }
+}
+
+// Keep a render of the window, then post once so each run re-renders one new message
+void setup_render_incremental() {
+    setup_render();
+    bench_old = render_chat_history(bench_room, NULL);
+    add_message_to_history(bench_room, "Bob", bench_message);
+}
+
+// Render the window reusing the previous render, as the first read after a post does
+void run_render_incremental(long iterations, int threads) {
+    for (long i = 0; i < iterations; i++) {
+        rendered_history_t *rendered = render_chat_history(bench_room, bench_old);
+        bench_sink += rendered->len;
+        release_rendered_history(rendered);
+    }
+}
+
+// A keep-alive connection with no socket; responses are queued and then retired
+void setup_response() {
+    memset(bench_body, 'x', sizeof(bench_body) - 1);
+    bench_conn.keep_alive = 1;
+    bench_conn.fd = -1;
+}
+
+// The response connection plus a full rendered history to reference
+void setup_response_shared() {
+    setup_response();
+    setup_render();
+}
+
+// Assemble a 1 KiB response into the connection's output buffer
+void run_response_copy(long iterations, int threads) {
+    for (long i = 0; i < iterations; i++) {
+        send_http_response(&bench_conn, "200 OK", "text/html", bench_body);
+        bench_sink += bench_conn.out_pending;
+        retire_output(&bench_conn, bench_conn.out_pending);
+        arena_reset(&bench_loop);
+    }
+}
+
+// Assemble a response whose body is a reference to the rendered history
+void run_response_shared(long iterations, int threads) {
+    rendered_history_t *history = get_rendered_history(bench_room);
+    for (long i = 0; i < iterations; i++) {
+        atomic_fetch_add(&history->refs, 1);
+        body_part_t part = { history->html, history->len, 1, history };
+        send_http_response_parts(&bench_conn, "200 OK", "text/html", "X-Last-Seq: 100\r\n", &part, 1);
+        bench_sink += bench_conn.out_pending;
+        retire_output(&bench_conn, bench_conn.out_pending);
+        arena_reset(&bench_loop);
+    }
+    release_rendered_history(history);
+}
+
+// Serialize the full history window for /api/messages, as JSON or binary records
+void run_api(long iterations, int binary) {
+    for (long i = 0; i < iterations; i++) {
+        send_api_messages(&bench_conn, bench_room, 0, binary);
+        bench_sink += bench_conn.out_pending;
+        retire_output(&bench_conn, bench_conn.out_pending);
+        arena_reset(&bench_loop);
+    }
+}
+
+// The history window as JSON
+void run_api_json(long iterations, int threads) {
+    run_api(iterations, 0);
+}
+
+// The history window as binary records
+void run_api_binary(long iterations, int threads) {
+    run_api(iterations, 1);
+}
+
+// Room every posting thread shares
+void setup_post() {
+    bench_room = find_room("bench-post", 10, ROOM_POST);
+}
+
+// Posting thread: its share of the iterations, pinned to its own CPU out of the ones the process had
+void *post_thread(void *arg) {
+    post_share_t *share = arg;
+    pthread_setaffinity_np(pthread_self(), sizeof(bench_cpus), &bench_cpus);
+    pin_to_cpu(share->index);
+    for (long i = 0; i < share->iterations; i++) {
+        add_message_to_history(bench_room, "Alice", bench_message);
+    }
+    return NULL;
+}
+
+// Post from several threads into one room at once; reported per post across all threads
+void run_posts(long iterations, int threads) {
+    pthread_t tids[BENCH_MAX_THREADS];
+    post_share_t shares[BENCH_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        shares[i].iterations = iterations / threads;
+        shares[i].index = i;
+        pthread_create(&tids[i], NULL, post_thread, &shares[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+// Server side of an end-to-end benchmark, on the second CPU so the client keeps the first
+void *e2e_loop_thread(void *arg) {
+    pthread_setaffinity_np(pthread_self(), sizeof(bench_cpus), &bench_cpus);
+    pin_to_cpu(1);
+    run_event_loop(arg);
+    return NULL;
+}
+
+// Start the loopback server loop for one backend; it runs until the process exits
+void setup_e2e(int uring) {
+    static int assets_ready;
+    event_loop_t *loop = &bench_e2e_loops[uring];
+    pthread_t tid;
+    if (!assets_ready && init_static_assets() < 0) {
+        exit(1);
+    }
+    assets_ready = 1;
+    loop->index = 1 + uring;
+    if (init_event_loop(loop, BENCH_E2E_PORT + uring, 0) < 0) {
+        exit(1);
+    }
+    if (uring && init_uring(loop) < 0) {
+        printf("io_uring is not available here; e2e_io_uring runs on epoll\n");
+    }
+    pthread_create(&tid, NULL, e2e_loop_thread, loop);
+    pthread_detach(tid);
+    if (bench_e2e_fd >= 0) {
+        close(bench_e2e_fd);
+        bench_e2e_fd = -1;
+    }
+}
+
+// epoll loop on loopback
+void setup_e2e_epoll() {
+    setup_e2e(0);
+}
+
+// io_uring loop on loopback
+void setup_e2e_uring() {
+    setup_e2e(1);
+}
+
+// Open the benchmark's client connection, blocking
+void e2e_connect(int uring) {
+    struct sockaddr_in addr = { 0 };
+    int one = 1;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_E2E_PORT + uring);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bench_e2e_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bench_e2e_fd < 0 || connect(bench_e2e_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Could not connect to the end-to-end loop: %s\n", strerror(errno));
+        exit(1);
+    }
+    setsockopt(bench_e2e_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// One request at a time over loopback: send, read the whole response, reconnect when the server closes.
+// Every round trip goes through the backend's accept, read, write and wakeup path.
+void run_e2e(long iterations, int uring) {
+    size_t request_len = sizeof(bench_e2e_request) - 1;
+    for (long i = 0; i < iterations; i++) {
+        if (bench_e2e_fd < 0) {
+            e2e_connect(uring);
+        }
+        if (write_fully(bench_e2e_fd, bench_e2e_request, request_len) < 0) {
+            exit(1);
+        }
+        
+        size_t have = 0, need = 0;
+        while (need == 0 || have < need) {
+            ssize_t n = recv(bench_e2e_fd, bench_e2e_response + have, sizeof(bench_e2e_response) - 1 - have, 0);
+            if (n <= 0) {
+                printf("End-to-end connection failed\n");
+                exit(1);
+            }
+            have += n;
+            bench_e2e_response[have] = '\0';
+            char *end = strstr(bench_e2e_response, "\r\n\r\n");
+            char *length = strstr(bench_e2e_response, "Content-Length:");
+            if (need == 0 && end && length) {
+                need = end + 4 - bench_e2e_response + strtoul(length + 15, NULL, 10);
+            }
+        }
+        bench_sink += have;
+        if (strstr(bench_e2e_response, "Connection: close")) {
+            close(bench_e2e_fd);
+            bench_e2e_fd = -1;
+        }
+    }
+}
+
+// Request round trips against the epoll loop
+void run_e2e_epoll(long iterations, int threads) {
+    run_e2e(iterations, 0);
+}
+
+// Request round trips against the io_uring loop
+void run_e2e_uring(long iterations, int threads) {
+    run_e2e(iterations, 1);
+}
+
+bench_t benches[] = {
+    { "parse_get", setup_parse, run_parse_get, 2000000, 1 },
+    { "parse_get_legacy", NULL, run_parse_get_legacy, 2000000, 1 },
+    { "form_decode", NULL, run_form_decode, 2000000, 1 },
+    { "form_decode_legacy", NULL, run_form_decode_legacy, 2000000, 1 },
+    { "render_full", setup_render, run_render_full, 20000, 1 },
+    { "render_incremental", setup_render_incremental, run_render_incremental, 200000, 1 },
+    { "response_copy", setup_response, run_response_copy, 2000000, 1 },
+    { "response_shared", setup_response_shared, run_response_shared, 2000000, 1 },
+    { "api_json", setup_response_shared, run_api_json, 20000, 1 },
+    { "api_binary", setup_response_shared, run_api_binary, 20000, 1 },
+    { "post_1_thread", setup_post, run_posts, 1000000, 1 },
+    { "post_2_threads", setup_post, run_posts, 1000000, 2 },
+    { "post_4_threads", setup_post, run_posts, 1000000, 4 },
+    { "post_8_threads", setup_post, run_posts, 1000000, 8 },
+    { "e2e_epoll", setup_e2e_epoll, run_e2e_epoll, 20000, 1 },
+    { "e2e_io_uring", setup_e2e_uring, run_e2e_uring, 20000, 1 },
+};
+
+// Order doubles for the median
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    int repeats = BENCH_REPEATS;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repeats") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && filter == NULL) {
+            filter = argv[i];
+        } else {
+            printf("Usage: %s [--repeats <runs>] [name filter]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (repeats < 1 || repeats > 101) {
+        printf("Repeats must be between 1 and 101\n");
+        return -1;
+    }
+    
+    // Same state the server sets up before its loops start
+    for (int i = 0; i < ROOM_SHARDS; i++) {
+        pthread_mutex_init(&room_shards[i].mutex, NULL);
+    }
+    bench_conn.loop = &bench_loop;
+    sched_getaffinity(0, sizeof(bench_cpus), &bench_cpus);
+    pin_to_cpu(0);
+    
+    printf("%-20s %10s %12s %12s %14s\n", "benchmark", "iterations", "median ns/op", "min ns/op", "median ops/s");
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        bench_t *bench = &benches[b];
+        double ns[101];
+        if (filter && strstr(bench->name, filter) == NULL) {
+            continue;
+        }
+        if (bench->setup) {
+            bench->setup();
+        }
+        
+        // One untimed pass warms caches and the allocator
+        bench->run(bench->iterations / 10 + 1, bench->threads);
+        for (int r = 0; r < repeats; r++) {
+            uint64_t start = metrics_now();
+            bench->run(bench->iterations, bench->threads);
+            ns[r] = (double)(metrics_now() - start) / bench->iterations;
+        }
+        qsort(ns, repeats, sizeof(double), compare_doubles);
+        printf("%-20s %10ld %12.1f %12.1f %14.0f\n", bench->name, bench->iterations,
+               ns[repeats / 2], ns[0], 1e9 / ns[repeats / 2]);
+        fflush(stdout);
+    }
+    return 0;
+}
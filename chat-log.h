@@ -0,0 +1,739 @@
+// chat-log.h - Segmented message log with a sparse per-room index, shared by chat-server.c and web-server.c
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<stddef.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<stdatomic.h>
+#include<time.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<zlib.h>
+
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)  // default bytes appended before the log rolls, see --log-segment
+#define LOG_MAX_PENDING (8 * 1024 * 1024)    // queued log bytes beyond which posts are refused
+#define LOG_READ_CHUNK (64 * 1024)
+#define LOG_SNAPSHOT_BUFFER (256 * 1024)
+#define LOG_MAX_ROOM 31
+#define LOG_PAGE 64                          // messages per index entry and per page read back; one bit each in a uint64_t
+#define LOG_CACHE_PAGES 256                  // default pages a cache keeps in memory, see --history-cache
+#define LOG_CACHE_BUCKETS 1024
+
+// On-disk record for one message; records are padded to 8 bytes so recovery reads headers straight from an mmap
+typedef struct {
+    uint32_t len;               // whole record, padding included
+    uint32_t crc;               // crc32 of everything after this field, padding excluded
+    uint64_t seq;
+    int64_t posted;             // Unix time of the original post
+    uint16_t message_len;
+    uint8_t room_len;
+    uint8_t username_len;
+    uint32_t reserved;
+} log_record_t;
+
+// Longest record a server writes, given its own name and text limits; sizes its encode buffers
+#define LOG_RECORD_SIZE(username, message) \
+    ((sizeof(log_record_t) + LOG_MAX_ROOM + (username) + (message) + 7) & ~(size_t)7)
+
+// Sparse index entry: where the record opening one page of a room sits in the log
+typedef struct {
+    uint64_t seq;
+    uint32_t segment;
+    uint32_t reserved;
+    uint64_t offset;
+} log_index_entry_t;
+
+// A room's position in its index file; each server keeps one per room, and only the log writer touches it
+typedef struct {
+    unsigned long indexed_seq;      // newest page start in the room's index file
+    int loaded;                     // indexed_seq has been read back from the file
+} log_room_index_t;
+
+// Records being written to the start of a new segment; a failed write sticks and ends the snapshot
+typedef struct {
+    int fd;
+    size_t used;
+    size_t max_record;
+    long total;
+    int failed;
+    char *buf;                      // LOG_SNAPSHOT_BUFFER bytes, 8-byte aligned
+} log_snapshot_t;
+
+// Append-only history log split into numbered segments. Posts only queue encoded records;
+// one writer thread writes and syncs them, so every post made during an fdatasync shares the next one.
+// The server owning the log fills in the field limits and hooks before open_chat_log.
+typedef struct {
+    const char *dir;            // NULL when persistence is off
+    int fd;                     // tail segment, opened for append; owned by the writer once it runs
+    atomic_uint segment;        // number of the tail segment; history reads stop there
+    size_t segment_len;
+    size_t snapshot_len;        // bytes at the start of the tail segment that restate older history
+    size_t segment_limit;       // appended bytes after which the next batch starts a new segment
+    size_t max_username;        // longest name and text a record may carry; recovery rejects anything longer
+    size_t max_message;
+    int (*valid_room)(const char *name, size_t len);
+    int (*restore)(const log_record_t *rec);            // recovery: put a record back; 1 when it was kept
+    void (*snapshot)(log_snapshot_t *snap);             // roll: log_snapshot_add every room's retained history
+    log_room_index_t *(*room_index)(const char *name, size_t len);  // writer: NULL for a room it cannot find
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;       // pending has records
+    pthread_cond_t drained;     // the writer stopped after the last batch
+    int running;                // the writer thread has started
+    int stopping;               // shutdown wants everything queued on disk
+    int stopped;                // the writer synced the last batch and takes no more
+    int failed;                 // stopped because a batch could not be written or synced
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    unsigned long records;
+    unsigned long batches;
+    unsigned long refused;      // posts turned away because the queue was full or could not grow
+} chat_log_t;
+
+#define CHAT_LOG_INITIALIZER(username, message) { \
+    .fd = -1, \
+    .segment_limit = LOG_SEGMENT_SIZE, \
+    .max_username = (username), \
+    .max_message = (message), \
+    .mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .ready = PTHREAD_COND_INITIALIZER, \
+    .drained = PTHREAD_COND_INITIALIZER \
+}
+
+// One cached page of older history; the page itself is whatever the owning server renders from the log
+typedef struct log_cached_page {
+    const void *room;
+    unsigned long number;           // covers sequences number * LOG_PAGE + 1 onwards
+    void *page;
+    struct log_cached_page *hash_next;
+    struct log_cached_page *lru_prev;   // toward the most recently used page
+    struct log_cached_page *lru_next;
+} log_cached_page_t;
+
+// Bounded LRU cache of pages read from the log. Pages are reference counted by their owner:
+// the cache holds one reference, and every page it hands out carries another.
+typedef struct {
+    pthread_mutex_t mutex;
+    log_cached_page_t *buckets[LOG_CACHE_BUCKETS];
+    log_cached_page_t *lru_head;    // most recently used
+    log_cached_page_t *lru_tail;
+    int count;
+    int limit;
+    unsigned long hits;
+    unsigned long misses;
+    void (*retain)(void *page);
+    void (*release)(void *page);
+} log_page_cache_t;
+
+#define LOG_CACHE_INITIALIZER(retain_page, release_page) { \
+    .mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .limit = LOG_CACHE_PAGES, \
+    .retain = (retain_page), \
+    .release = (release_page) \
+}
+
+// Encode a record at out, which must be 8-byte aligned, without its crc; returns the padded length
+static inline size_t log_encode_fields(char *out, const char *room, size_t room_len, unsigned long seq, time_t posted,
+                                       const char *username, size_t username_len,
+                                       const char *message, size_t message_len) {
+    log_record_t *rec = (log_record_t*)out;
+    size_t body = sizeof(log_record_t) + room_len + username_len + message_len;
+    size_t len = (body + 7) & ~(size_t)7;
+    
+    rec->len = len;
+    rec->seq = seq;
+    rec->posted = posted;
+    rec->message_len = message_len;
+    rec->room_len = room_len;
+    rec->username_len = username_len;
+    rec->reserved = 0;
+    
+    char *p = out + sizeof(log_record_t);
+    memcpy(p, room, room_len);
+    memcpy(p + room_len, username, username_len);
+    memcpy(p + room_len + username_len, message, message_len);
+    memset(out + body, 0, len - body);
+    return len;
+}
+
+// Checksum a record once its sequence number is in place
+static inline void log_seal_record(char *out) {
+    log_record_t *rec = (log_record_t*)out;
+    size_t body = sizeof(log_record_t) + rec->room_len + rec->username_len + rec->message_len;
+    rec->crc = crc32(0, (const Bytef*)&rec->seq, body - offsetof(log_record_t, seq));
+}
+
+// Check one record in a mapped segment or a read chunk; returns its length, or 0 where the valid records end
+static inline size_t check_log_record(const chat_log_t *lg, const char *map, size_t offset, size_t size) {
+    if(size - offset < sizeof(log_record_t)) {
+        return 0;
+    }
+    const log_record_t *rec = (const log_record_t*)(map + offset);
+    size_t body = sizeof(log_record_t) + rec->room_len + rec->username_len + rec->message_len;
+    if(rec->len % 8 != 0 || rec->len < body || rec->len > size - offset ||
+       rec->seq == 0 || rec->username_len > lg->max_username || rec->message_len > lg->max_message ||
+       !lg->valid_room(map + offset + sizeof(log_record_t), rec->room_len)) {
+        return 0;
+    }
+    if(rec->crc != crc32(0, (const Bytef*)&rec->seq, body - offsetof(log_record_t, seq))) {
+        return 0;
+    }
+    return rec->len;
+}
+
+// Queue a record encoded without its sequence number for the log writer, numbering and sealing it there.
+// Called under the room's lock so each room's records stay in order, so it never waits:
+// returns -1 when the writer is too far behind, the queue cannot grow or the log has shut down.
+static inline int log_append(chat_log_t *lg, const char *record, size_t len, unsigned long seq) {
+    const char *why = NULL;
+    pthread_mutex_lock(&lg->mutex);
+    if(lg->failed) {
+        why = "the log stopped after a failed write";
+    } else if(lg->stopped) {
+        why = "the log has shut down";
+    } else if(lg->pending_len >= LOG_MAX_PENDING) {
+        why = "the writer is too far behind";
+    } else if(lg->pending_cap - lg->pending_len < len) {
+        size_t cap = lg->pending_cap ? lg->pending_cap * 2 : 64 * 1024;
+        char *grown = realloc(lg->pending, cap);
+        if(grown == NULL) {
+            why = "the queue could not grow";
+        } else {
+            lg->pending = grown;
+            lg->pending_cap = cap;
+        }
+    }
+    if(why) {
+        unsigned long refused = ++lg->refused;
+        pthread_mutex_unlock(&lg->mutex);
+        printf("Chat log refused a post (%lu so far): %s\n", refused, why);
+        return -1;
+    }
+    
+    char *out = lg->pending + lg->pending_len;
+    memcpy(out, record, len);
+    ((log_record_t*)out)->seq = seq;
+    log_seal_record(out);
+    lg->pending_len += len;
+    lg->records++;
+    pthread_cond_signal(&lg->ready);
+    pthread_mutex_unlock(&lg->mutex);
+    return 0;
+}
+
+// Write a whole buffer to a file descriptor
+static inline int write_fully(int fd, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Make a new file in the log directory durable by syncing the directory itself
+static inline void sync_log_dir(const chat_log_t *lg) {
+    int dir_fd = open(lg->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Add one retained message to a snapshot, writing the buffer out whenever the next record might not fit
+static inline void log_snapshot_add(log_snapshot_t *snap, const char *room, size_t room_len, unsigned long seq,
+                                    time_t posted, const char *username, size_t username_len,
+                                    const char *message, size_t message_len) {
+    if(snap->failed) {
+        return;
+    }
+    if(LOG_SNAPSHOT_BUFFER - snap->used < snap->max_record) {
+        if(write_fully(snap->fd, snap->buf, snap->used) < 0) {
+            snap->failed = 1;
+            return;
+        }
+        snap->total += snap->used;
+        snap->used = 0;
+    }
+    char *out = snap->buf + snap->used;
+    snap->used += log_encode_fields(out, room, room_len, seq, posted, username, username_len, message, message_len);
+    log_seal_record(out);
+}
+
+// Start the next segment with a snapshot of every room's retained history, so recovery
+// never needs more than the tail segment. Records in flight may appear in both; recovery skips repeats.
+static inline void roll_log_segment(chat_log_t *lg) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%010u.log", lg->dir, lg->segment + 1);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        printf("Could not start log segment %s: %s\n", path, strerror(errno));
+        return;
+    }
+    
+    log_snapshot_t snap = { .fd = fd, .max_record = LOG_RECORD_SIZE(lg->max_username, lg->max_message) };
+    snap.buf = aligned_alloc(8, LOG_SNAPSHOT_BUFFER);
+    if(snap.buf) {
+        lg->snapshot(&snap);
+        snap.failed |= write_fully(fd, snap.buf, snap.used) < 0;
+        free(snap.buf);
+    }
+    if(snap.buf == NULL || snap.failed || fdatasync(fd) < 0) {
+        // Keep appending to the current segment rather than leave a tail that lacks history
+        printf("Could not write log snapshot: %s\n", snap.buf ? strerror(errno) : "out of memory");
+        close(fd);
+        unlink(path);
+        return;
+    }
+    sync_log_dir(lg);
+    
+    close(lg->fd);
+    lg->fd = fd;
+    lg->segment++;
+    lg->segment_len = snap.total + snap.used;
+    lg->snapshot_len = lg->segment_len;
+}
+
+// Open the log directory and hand every record of the tail segment to the restore hook,
+// so startup time follows the segment size, not the length of the whole history
+static inline int open_chat_log(chat_log_t *lg, const char *dir) {
+    lg->dir = dir;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if((mkdir(dir, 0755) < 0 && errno != EEXIST) || (mkdir(path, 0755) < 0 && errno != EEXIST)) {
+        printf("Could not create log directory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    // The tail is the highest-numbered segment
+    DIR *listing = opendir(dir);
+    if(listing == NULL) {
+        printf("Could not open log directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct dirent *entry;
+    while((entry = readdir(listing)) != NULL) {
+        char *end;
+        unsigned long number = strtoul(entry->d_name, &end, 10);
+        if(end != entry->d_name && strcmp(end, ".log") == 0 && number > lg->segment) {
+            lg->segment = number;
+        }
+    }
+    closedir(listing);
+    if(lg->segment == 0) {
+        lg->segment = 1;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%010u.log", dir, lg->segment);
+    lg->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if(lg->fd < 0 || fstat(lg->fd, &st) < 0) {
+        printf("Could not open log segment %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    size_t size = st.st_size;
+    size_t offset = 0;
+    unsigned long restored = 0;
+    if(size > 0) {
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, lg->fd, 0);
+        if(map == MAP_FAILED) {
+            printf("Could not map log segment %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        size_t len;
+        while((len = check_log_record(lg, map, offset, size)) > 0) {
+            restored += lg->restore((const log_record_t*)(map + offset));
+            offset += len;
+        }
+        munmap(map, size);
+    }
+    
+    // A crash mid-write leaves a torn record at the end; cut it off before appending
+    if(offset < size) {
+        printf("Discarding %zu bytes of incomplete log records in %s\n", size - offset, path);
+        if(ftruncate(lg->fd, offset) < 0) {
+            printf("Could not truncate %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    lg->segment_len = offset;
+    printf("Recovered %lu messages from %s\n", restored, path);
+    return 0;
+}
+
+// Path of a room's sparse index: one entry for the record that opens each page
+static inline void room_index_path(const chat_log_t *lg, const char *room, size_t room_len, char *path, size_t size) {
+    snprintf(path, size, "%s/index/%.*s.idx", lg->dir, (int)room_len, room);
+}
+
+// Sequence of the last entry in a room's index file, 0 when it has none
+static inline unsigned long last_index_seq(const chat_log_t *lg, const char *room, size_t room_len) {
+    char path[512];
+    log_index_entry_t entry;
+    room_index_path(lg, room, room_len, path, sizeof(path));
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    unsigned long seq = 0;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(entry) &&
+       pread(fd, &entry, sizeof(entry), st.st_size / sizeof(entry) * sizeof(entry) - sizeof(entry)) == sizeof(entry)) {
+        seq = entry.seq;
+    }
+    close(fd);
+    return seq;
+}
+
+// Index the records of a batch that open a page; runs on the writer thread once the batch is synced
+static inline void index_log_batch(chat_log_t *lg, const char *batch, size_t len, unsigned segment, size_t base) {
+    size_t pos = 0;
+    size_t rec_len;
+    while((rec_len = check_log_record(lg, batch, pos, len)) > 0) {
+        const log_record_t *rec = (const log_record_t*)(batch + pos);
+        const char *room = (const char*)(rec + 1);
+        log_room_index_t *index;
+        if((rec->seq - 1) % LOG_PAGE == 0 && (index = lg->room_index(room, rec->room_len)) != NULL) {
+            if(!index->loaded) {
+                index->indexed_seq = last_index_seq(lg, room, rec->room_len);
+                index->loaded = 1;
+            }
+            if(rec->seq > index->indexed_seq) {
+                char path[512];
+                log_index_entry_t entry = { rec->seq, segment, 0, base + pos };
+                room_index_path(lg, room, rec->room_len, path, sizeof(path));
+                int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if(fd >= 0) {
+                    if(write_fully(fd, (const char*)&entry, sizeof(entry)) == 0) {
+                        index->indexed_seq = rec->seq;
+                    }
+                    close(fd);
+                }
+            }
+        }
+        pos += rec_len;
+    }
+}
+
+// Where to start reading for seq: the last index entry at or before it, found by binary search
+// over the room's index file. Without one the scan starts at the beginning of the log.
+// Returns 1 when a later entry exists, with *end_segment and *end_offset set to where it points.
+static inline int find_index_entry(const chat_log_t *lg, const char *room, unsigned long seq,
+                                   unsigned *segment, uint64_t *offset, unsigned *end_segment, uint64_t *end_offset) {
+    char path[512];
+    *segment = 1;
+    *offset = 0;
+    room_index_path(lg, room, strlen(room), path, sizeof(path));
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0) {
+        return 0;
+    }
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+    
+    log_index_entry_t entry;
+    long count = st.st_size / sizeof(log_index_entry_t);
+    long lo = 0;
+    long hi = count - 1;
+    while(lo <= hi) {
+        long mid = lo + (hi - lo) / 2;
+        if(pread(fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry)) {
+            break;
+        }
+        if(entry.seq <= seq) {
+            *segment = entry.segment;
+            *offset = entry.offset;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    
+    int bounded = 0;
+    if(lo < count && pread(fd, &entry, sizeof(entry), lo * sizeof(entry)) == sizeof(entry) && entry.seq > seq) {
+        *end_segment = entry.segment;
+        *end_offset = entry.offset;
+        bounded = 1;
+    }
+    close(fd);
+    return bounded;
+}
+
+// Read one page of a room's records out of the log: sequences number * LOG_PAGE + 1 onwards, each handed
+// to found once. Returns 1 once the log can add nothing more to the page, which is when it may be cached:
+// every message was found, or the room's records have moved past it and the missing ones are gone for good.
+// Returns 0 when a later read might find more, and -1 when the read buffer cannot be allocated.
+static inline int log_read_page(chat_log_t *lg, const char *room, unsigned long number,
+                                void (*found)(const log_record_t *rec, void *arg), void *arg) {
+    unsigned long first = number * LOG_PAGE + 1;
+    unsigned long last = first + LOG_PAGE - 1;
+    size_t room_len = strlen(room);
+    uint64_t seen = 0;
+    int count = 0, done = 0, passed = 0, failed = 0;
+    char *buf = malloc(LOG_READ_CHUNK);
+    if(buf == NULL) {
+        return -1;
+    }
+    
+    // Other rooms' records are interleaved; read forward until the page is whole or the room moves past it.
+    // The next page's index entry, when there is one, bounds the scan: that record is synced and all of
+    // this page was written before it, so whatever the scan cannot find there is gone for good.
+    unsigned segment, end_segment = 0;
+    uint64_t offset, end_offset = 0;
+    unsigned tail = atomic_load(&lg->segment);
+    int bounded = find_index_entry(lg, room, first, &segment, &offset, &end_segment, &end_offset);
+    if(bounded) {
+        tail = end_segment;
+        passed = 1;
+    }
+    for(; segment <= tail && !done; segment++, offset = 0) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%010u.log", lg->dir, segment);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            failed = 1;
+            continue;
+        }
+        while(!done) {
+            ssize_t n = pread(fd, buf, LOG_READ_CHUNK, offset);
+            if(n <= 0) {
+                failed |= n < 0;
+                break;
+            }
+            size_t pos = 0;
+            size_t len;
+            while(!done && (len = check_log_record(lg, buf, pos, n)) > 0) {
+                const log_record_t *rec = (const log_record_t*)(buf + pos);
+                if(bounded && segment == end_segment && offset + pos >= end_offset) {
+                    done = 1;
+                } else if(rec->room_len == room_len && memcmp(rec + 1, room, room_len) == 0) {
+                    // A snapshot restates records the segment before it already holds; each counts once
+                    if(rec->seq > last) {
+                        done = passed = 1;
+                    } else if(rec->seq >= first && !(seen & 1ULL << (rec->seq - first))) {
+                        seen |= 1ULL << (rec->seq - first);
+                        found(rec, arg);
+                        done = ++count == LOG_PAGE;
+                    }
+                }
+                pos += len;
+            }
+            // A record cut by the chunk is read again from its start; none at all means the segment ended
+            if(pos == 0) {
+                break;
+            }
+            offset += pos;
+        }
+        close(fd);
+    }
+    free(buf);
+    return count == LOG_PAGE || (passed && !failed);
+}
+
+// Log writer: whatever was queued while the previous batch was syncing goes out in one write and one fdatasync
+static inline void *log_writer_thread(void *arg) {
+    chat_log_t *lg = (chat_log_t*)arg;
+    char *spare = NULL;
+    size_t spare_cap = 0;
+    
+    pthread_mutex_lock(&lg->mutex);
+    while(1) {
+        while(lg->pending_len == 0) {
+            if(lg->stopping) {
+                lg->stopped = 1;
+                pthread_cond_broadcast(&lg->drained);
+                pthread_mutex_unlock(&lg->mutex);
+                free(spare);
+                return NULL;
+            }
+            pthread_cond_wait(&lg->ready, &lg->mutex);
+        }
+        
+        // Swap buffers so posters keep appending while this batch is on its way to disk
+        char *batch = lg->pending;
+        size_t len = lg->pending_len;
+        size_t cap = lg->pending_cap;
+        lg->pending = spare;
+        lg->pending_len = 0;
+        lg->pending_cap = spare_cap;
+        lg->batches++;
+        pthread_mutex_unlock(&lg->mutex);
+        
+        if(lg->segment_len - lg->snapshot_len >= lg->segment_limit) {
+            roll_log_segment(lg);
+        }
+        if(write_fully(lg->fd, batch, len) < 0 || fdatasync(lg->fd) < 0) {
+            // Cut off whatever part of the batch reached the file so no torn record sits in front of
+            // later appends, and refuse posts from here on rather than acknowledge ones that may be lost
+            printf("Chat log write failed, refusing further posts: %s\n", strerror(errno));
+            if(ftruncate(lg->fd, lg->segment_len) < 0) {
+                printf("Could not truncate the log segment: %s\n", strerror(errno));
+            }
+            pthread_mutex_lock(&lg->mutex);
+            lg->failed = 1;
+            lg->stopped = 1;
+            lg->pending_len = 0;
+            pthread_cond_broadcast(&lg->drained);
+            pthread_mutex_unlock(&lg->mutex);
+            free(batch);
+            free(spare);
+            return NULL;
+        }
+        index_log_batch(lg, batch, len, lg->segment, lg->segment_len);
+        lg->segment_len += len;
+        spare = batch;
+        spare_cap = cap;
+        
+        pthread_mutex_lock(&lg->mutex);
+    }
+    return NULL;
+}
+
+// Hand the tail segment to a new writer thread; recovery must be done, as posts may follow at once
+static inline int start_chat_log(chat_log_t *lg) {
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, log_writer_thread, lg) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    pthread_mutex_lock(&lg->mutex);
+    lg->running = 1;
+    pthread_mutex_unlock(&lg->mutex);
+    return 0;
+}
+
+// Have the log writer sync every record already queued, then keep new ones out until the process exits
+static inline void drain_chat_log(chat_log_t *lg) {
+    pthread_mutex_lock(&lg->mutex);
+    if(!lg->running) {
+        // Still recovering, or no log at all; nothing has been posted yet
+        pthread_mutex_unlock(&lg->mutex);
+        return;
+    }
+    lg->stopping = 1;
+    pthread_cond_signal(&lg->ready);
+    while(!lg->stopped) {
+        pthread_cond_wait(&lg->drained, &lg->mutex);
+    }
+    pthread_mutex_unlock(&lg->mutex);
+}
+
+// Hash bucket of a cached page
+static inline unsigned long log_cache_bucket(const void *room, unsigned long number) {
+    return ((uintptr_t)room / 64 * 31 + number) % LOG_CACHE_BUCKETS;
+}
+
+// Unlink a page from the LRU list; caller holds cache->mutex
+static inline void log_cache_unlink(log_page_cache_t *cache, log_cached_page_t *entry) {
+    if(entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if(entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+// Make a page the most recently used; caller holds cache->mutex
+static inline void log_cache_push_front(log_page_cache_t *cache, log_cached_page_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if(cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+// Find a cached page and mark it most recently used; caller holds cache->mutex
+static inline log_cached_page_t *log_cache_lookup(log_page_cache_t *cache, const void *room, unsigned long number) {
+    for(log_cached_page_t *entry = cache->buckets[log_cache_bucket(room, number)]; entry; entry = entry->hash_next) {
+        if(entry->room == room && entry->number == number) {
+            log_cache_unlink(cache, entry);
+            log_cache_push_front(cache, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Take a reference to a cached page, counting a hit; NULL when it has to be read from the log
+static inline void *log_cache_find(log_page_cache_t *cache, const void *room, unsigned long number) {
+    void *page = NULL;
+    pthread_mutex_lock(&cache->mutex);
+    log_cached_page_t *entry = log_cache_lookup(cache, room, number);
+    if(entry) {
+        cache->hits++;
+        cache->retain(entry->page);
+        page = entry->page;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return page;
+}
+
+// Count a page that had to be read from the log
+static inline void log_cache_miss(log_page_cache_t *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->misses++;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Cache a page read from the log unless another reader cached it meanwhile; the caller keeps its reference
+static inline void log_cache_insert(log_page_cache_t *cache, const void *room, unsigned long number, void *page) {
+    log_cached_page_t *entry;
+    pthread_mutex_lock(&cache->mutex);
+    if(log_cache_lookup(cache, room, number) || (entry = malloc(sizeof(log_cached_page_t))) == NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+    entry->room = room;
+    entry->number = number;
+    entry->page = page;
+    cache->retain(page);
+    entry->hash_next = cache->buckets[log_cache_bucket(room, number)];
+    cache->buckets[log_cache_bucket(room, number)] = entry;
+    log_cache_push_front(cache, entry);
+    cache->count++;
+    
+    // Evict least recently used pages; readers still using one keep it alive through their reference
+    while(cache->count > cache->limit) {
+        log_cached_page_t *victim = cache->lru_tail;
+        log_cached_page_t **link = &cache->buckets[log_cache_bucket(victim->room, victim->number)];
+        while(*link != victim) {
+            link = &(*link)->hash_next;
+        }
+        *link = victim->hash_next;
+        log_cache_unlink(cache, victim);
+        cache->release(victim->page);
+        free(victim);
+        cache->count--;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+#endif
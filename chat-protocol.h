@@ -0,0 +1,141 @@
+// chat-protocol.h - Length-prefixed frames shared by chat-server.c and client.c
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include<stdint.h>
+#include<string.h>
+
+// A frame is a 4-byte big-endian body length, a type byte and a name length byte,
+// followed by the name and then the text; neither is NUL-terminated
+#define CHAT_FRAME_HEADER 6
+#define CHAT_MAX_NAME 31
+#define CHAT_MAX_TEXT 1024
+#define CHAT_MAX_SEQ 21               // "<seq> " in front of the text of a room message
+#define CHAT_MAX_FRAME (CHAT_FRAME_HEADER + CHAT_MAX_NAME + CHAT_MAX_SEQ + CHAT_MAX_TEXT)
+#define CHAT_DECODER_SIZE 2048        // one whole frame plus the start of the next
+
+// Frame types and what the name and text carry in each direction
+enum {
+    CHAT_JOIN = 1,      // client: name = its own name, text = "[<room> [<since> <epoch>]]"; server: name = who joined.
+                        // A since from the server's current epoch resumes the room after that sequence
+                        // number: only newer messages are replayed, behind a CHAT_HISTORY header
+    CHAT_MESSAGE,       // client: text; server: name = sender, text = "<seq> <text>" for the room's sequence
+    CHAT_LEAVE,         // client: nothing; server: name = who left, text = why
+    CHAT_DM,            // client: name = recipient; server: name = sender, empty for the server console
+    CHAT_SERVER,        // server only: text broadcast from the server console
+    CHAT_ROOM,          // client: name = room to move to; server: name = room the client is now in,
+                        // text = "<newest seq> <epoch>", the epoch changing whenever the server restarts
+    CHAT_HISTORY        // client: text = "<before> <limit>"; server: name = room, text = "<first> <last>",
+                        // followed by those messages (0 0 when there are none)
+};
+
+// A decoded frame; name and text point into the decoder until its next chat_decoder_room()
+typedef struct {
+    int type;
+    const char *name;
+    size_t name_len;
+    const char *text;
+    size_t text_len;
+} chat_frame_t;
+
+// Per-connection receive buffer that frames are cut from as bytes arrive
+typedef struct {
+    char data[CHAT_DECODER_SIZE];
+    size_t start;                   // first byte not yet decoded
+    size_t end;                     // one past the last byte received
+} chat_decoder_t;
+
+// Write one frame to out, which must hold CHAT_FRAME_HEADER + name_len + text_len bytes.
+// Returns the frame size.
+static inline size_t chat_encode(char *out, int type, const char *name, size_t name_len,
+                                 const char *text, size_t text_len) {
+    uint32_t body = name_len + text_len;
+    out[0] = body >> 24;
+    out[1] = body >> 16;
+    out[2] = body >> 8;
+    out[3] = body;
+    out[4] = type;
+    out[5] = name_len;
+    memcpy(out + CHAT_FRAME_HEADER, name, name_len);
+    memcpy(out + CHAT_FRAME_HEADER + name_len, text, text_len);
+    return CHAT_FRAME_HEADER + body;
+}
+
+// Write a room message frame whose text is prefixed with its sequence number;
+// out must hold CHAT_FRAME_HEADER + CHAT_MAX_SEQ + name_len + text_len bytes. Returns the frame size.
+static inline size_t chat_encode_seq(char *out, int type, const char *name, size_t name_len,
+                                     unsigned long seq, const char *text, size_t text_len) {
+    char digits[CHAT_MAX_SEQ];
+    size_t n = sizeof(digits);
+    digits[--n] = ' ';
+    do {
+        digits[--n] = '0' + seq % 10;
+        seq /= 10;
+    } while(seq > 0);
+    
+    size_t prefix = sizeof(digits) - n;
+    size_t len = chat_encode(out, type, name, name_len, digits + n, prefix);
+    uint32_t body = name_len + prefix + text_len;
+    out[0] = body >> 24;
+    out[1] = body >> 16;
+    out[2] = body >> 8;
+    out[3] = body;
+    memcpy(out + len, text, text_len);
+    return len + text_len;
+}
+
+// Split the "<seq> " prefix off a room message's text; returns the sequence number, 0 when there is none
+static inline unsigned long chat_frame_seq(chat_frame_t *frame) {
+    unsigned long seq = 0;
+    size_t i = 0;
+    while(i < frame->text_len && frame->text[i] >= '0' && frame->text[i] <= '9') {
+        seq = seq * 10 + (frame->text[i++] - '0');
+    }
+    if(i == 0 || i == frame->text_len || frame->text[i] != ' ') {
+        return 0;
+    }
+    frame->text += i + 1;
+    frame->text_len -= i + 1;
+    return seq;
+}
+
+// Move undecoded bytes to the front and return where the next recv() should land
+static inline char *chat_decoder_room(chat_decoder_t *dec, size_t *room) {
+    if(dec->start > 0) {
+        memmove(dec->data, dec->data + dec->start, dec->end - dec->start);
+        dec->end -= dec->start;
+        dec->start = 0;
+    }
+    *room = CHAT_DECODER_SIZE - dec->end;
+    return dec->data + dec->end;
+}
+
+// Cut the next frame from the buffer.
+// Returns 1 for a frame, 0 when more bytes are needed, -1 when the stream is malformed.
+static inline int chat_decode(chat_decoder_t *dec, chat_frame_t *frame) {
+    size_t avail = dec->end - dec->start;
+    if(avail < CHAT_FRAME_HEADER) {
+        return 0;
+    }
+    
+    const unsigned char *p = (const unsigned char*)dec->data + dec->start;
+    uint32_t body = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    size_t name_len = p[5];
+    if(body > CHAT_MAX_NAME + CHAT_MAX_SEQ + CHAT_MAX_TEXT || name_len > CHAT_MAX_NAME || name_len > body ||
+        p[4] < CHAT_JOIN || p[4] > CHAT_HISTORY) {
+        return -1;
+    }
+    if(avail < CHAT_FRAME_HEADER + body) {
+        return 0;
+    }
+    
+    frame->type = p[4];
+    frame->name = (const char*)p + CHAT_FRAME_HEADER;
+    frame->name_len = name_len;
+    frame->text = frame->name + name_len;
+    frame->text_len = body - name_len;
+    dec->start += CHAT_FRAME_HEADER + body;
+    return 1;
+}
+
+#endif
@@ -1,4 +1,5 @@
-// chat_server.c - Multi-client chat server using threads
+// chat_server.c - Multi-client chat server using event loops
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<unistd.h>
@@ -8,175 +9,1431 @@
 #include<string.h>
 #include<pthread.h>
 #include<arpa/inet.h>
+#include<sched.h>
+#include<errno.h>
+#include<stdint.h>
+#include<stdatomic.h>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<sys/uio.h>
+#include<sys/resource.h>
+#include<signal.h>
+#include"chat-protocol.h"
+#include"metrics.h"
+#include"registry.h"
+#include"chat-log.h"
 
-#define MAX_CLIENTS 10
+#define MAX_CLIENTS 100000             // default registry limit, see --max-clients
 #define BUFFER_SIZE 1024
+#define MAX_WORKERS 64
+#define MAX_EVENTS 64
+#define MAX_IOVECS 64
+#define MAX_READS_PER_EVENT 16        // bounds how long one fast sender can hold its loop
+#define HIGH_WATER_MARK (256 * 1024)  // default per-client queue limit, see --high-water
+#define MAX_ROOMS 1024                // default room limit, see --max-rooms
+#define ROOM_HISTORY 50               // default messages replayed on entering a room, see --room-history
+#define MAX_HISTORY_LIMIT 200         // most messages one CHAT_HISTORY request returns
+#define ROOM_SHARDS 16                // lock stripes of the room directory
+#define ROOM_BUCKETS 64               // hash buckets per stripe
+#define DEFAULT_ROOM "lobby"
+#define CLIENT_SLAB 64                // clients carved from one allocation
+#define MAX_METRIC_THREADS 128        // threads with their own metrics slot; any beyond share the last
 
-// Structure to store client information
+// What to do with a client whose outbound queue passes the high-water mark
+enum {
+    LAG_DISCONNECT,
+    LAG_DROP
+};
+
+// Immutable, ref-counted encoded frame; one copy is shared by every recipient's queue
+typedef struct {
+    atomic_int refs;
+    size_t len;
+    time_t posted;                  // room messages only, for their log record
+    char data[];
+} chat_msg_t;
+
+struct client;
+struct room;
+
+// Free pooled receive buffer, linked through its first bytes
+typedef struct pool_item {
+    struct pool_item *next;
+} pool_item_t;
+
+// Event loop owning a listener and every client accepted on it
 typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;                    // eventfd signalled when clients of this loop have new output
+    int index;
+    int pinned;
+    pthread_mutex_t dirty_mutex;
+    struct client *dirty;           // clients with queued output or a pending disconnect
+    struct client *backlog;         // clients with unread input left by the read budget; loop-owned
+    struct client *free_clients;    // slab-allocated clients waiting for reuse, linked through backlog_next
+    pool_item_t *free_decoders;     // receive buffers no client is holding
+} chat_loop_t;
+
+// Structure to store client information; an idle client holds no receive buffer
+typedef struct client {
     int socket_fd;
     struct sockaddr_in address;
     int id;
-    char name[32];
+    char name[CHAT_MAX_NAME + 1];
+    int named;                      // set by the client's first frame, which must be CHAT_JOIN
+    struct room *room;              // changed only by the client's own loop
+    int room_index;                 // position in room->members, guarded by room->mutex
+    chat_loop_t *loop;
+    chat_decoder_t *decoder;        // loop-owned and pooled; held only while it has bytes
+    
+    // Any thread may queue output; only the owning loop writes it to the socket
+    pthread_mutex_t out_mutex;
+    chat_msg_t **queue;
+    int queue_head;
+    int queue_count;
+    int queue_cap;
+    size_t head_sent;               // bytes of queue[queue_head] already written
+    size_t queued_bytes;
+    unsigned long dropped;
+    int kicked;                     // went over the high-water mark under LAG_DISCONNECT
+    
+    int dirty;                      // on loop->dirty, guarded by loop->dirty_mutex
+    struct client *dirty_next;
+    int backlogged;                 // on loop->backlog
+    struct client *backlog_next;
 } client_t;
 
-client_t *clients[MAX_CLIENTS];
+// A named room; broadcasts only walk its members, so their cost follows the room's size
+typedef struct room {
+    char name[CHAT_MAX_NAME + 1];
+    pthread_mutex_t mutex;          // guards members and history
+    client_t **members;
+    int member_count;
+    int member_cap;
+    chat_msg_t **history;           // ring of the last room_history chat messages
+    int history_head;
+    int history_count;
+    unsigned long last_seq;         // sequence number of the room's newest chat message
+    log_room_index_t index;         // log writer only
+    struct room *next;              // next room in the same directory bucket
+} room_t;
+
+// Timed operations and locks, reported by /stats
+enum {
+    TIME_ACCEPT,
+    TIME_PARSE,
+    TIME_RENDER,
+    TIME_SEND,
+    TIME_BROADCAST,
+    TIME_ROOM_WAIT,
+    TIME_CLIENTS_WAIT,
+    TIME_ROOM_HOLD,
+    TIME_CLIENTS_HOLD,
+    TIMINGS
+};
+
+// One thread's counters; only that thread writes them, /stats sums every slot
+typedef struct {
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t closed;
+    _Atomic uint64_t frames;
+    metrics_histogram_t timings[TIMINGS];
+} __attribute__((aligned(64))) thread_metrics_t;
+
+// One lock stripe of the room directory; lookups in different stripes never contend
+typedef struct {
+    pthread_mutex_t mutex;
+    room_t *buckets[ROOM_BUCKETS];
+} room_shard_t;
+
+client_registry_t registry = REGISTRY_INITIALIZER(MAX_CLIENTS);
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-int client_count = 0;
-
-// Add client to the array
-void add_client(client_t *cl) {
-    pthread_mutex_lock(&clients_mutex);
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        if(!clients[i]) {
-            clients[i] = cl;
-            client_count++;
-            break;
-        }
+thread_metrics_t thread_metrics[MAX_METRIC_THREADS];
+atomic_int metric_threads;
+__thread thread_metrics_t *my_metrics;
+chat_loop_t loops[MAX_WORKERS];
+size_t high_water_mark = HIGH_WATER_MARK;
+int lag_policy = LAG_DISCONNECT;
+room_shard_t room_shards[ROOM_SHARDS];
+atomic_int room_count;
+int max_rooms = MAX_ROOMS;
+int room_history = ROOM_HISTORY;
+unsigned long server_epoch;         // names this run; without a log, room sequence numbers start over with it
+chat_log_t chat_log = CHAT_LOG_INITIALIZER(CHAT_MAX_NAME, CHAT_MAX_NAME + CHAT_MAX_SEQ + CHAT_MAX_TEXT);  // off without --log-dir
+
+// Metrics slot of the calling thread, claimed on first use
+thread_metrics_t *metrics() {
+    if(my_metrics == NULL) {
+        int index = atomic_fetch_add(&metric_threads, 1);
+        my_metrics = &thread_metrics[index < MAX_METRIC_THREADS ? index : MAX_METRIC_THREADS - 1];
+    }
+    return my_metrics;
+}
+
+// The calling thread's histogram for one timed operation or lock
+metrics_histogram_t *timing(int which) {
+    return &metrics()->timings[which];
+}
+
+// Add client to the registry and give it a fresh id; returns -1 when it is full
+int add_client(client_t *cl) {
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    int id = registry_add(&registry, cl);
+    if(id > 0) {
+        cl->id = id;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+    return id > 0 ? 0 : -1;
 }
 
-// Remove client from the array
+// Look up a client by id; caller holds clients_mutex
+client_t *find_client(int id) {
+    return registry_find(&registry, id);
+}
+
+// Remove client from the registry
 void remove_client(int id) {
-    pthread_mutex_lock(&clients_mutex);
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        if(clients[i]) {
-            if(clients[i]->id == id) {
-                clients[i] = NULL;
-                client_count--;
-                break;
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    registry_remove(&registry, id);
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+}
+
+// Encode one frame into a new message holding one reference
+chat_msg_t *create_message(int type, const char *name, size_t name_len, const char *text, size_t text_len) {
+    uint64_t start = metrics_now();
+    chat_msg_t *msg = malloc(sizeof(chat_msg_t) + CHAT_FRAME_HEADER + name_len + text_len);
+    if(msg == NULL) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    msg->posted = 0;
+    msg->len = chat_encode(msg->data, type, name, name_len, text, text_len);
+    metrics_since(timing(TIME_RENDER), start);
+    return msg;
+}
+
+// Drop one reference; the last one frees the message
+void release_message(chat_msg_t *msg) {
+    if(msg && atomic_fetch_sub(&msg->refs, 1) == 1) {
+        free(msg);
+    }
+}
+
+// Put a client on its loop's dirty list; returns 1 when the loop needs waking
+int mark_dirty(client_t *cl) {
+    int wake = 0;
+    pthread_mutex_lock(&cl->loop->dirty_mutex);
+    if(!cl->dirty) {
+        wake = cl->loop->dirty == NULL;
+        cl->dirty = 1;
+        cl->dirty_next = cl->loop->dirty;
+        cl->loop->dirty = cl;
+    }
+    pthread_mutex_unlock(&cl->loop->dirty_mutex);
+    return wake;
+}
+
+// Queue a shared message for one client without touching its socket.
+// Returns 1 when the client's loop must be woken.
+int queue_message(client_t *cl, chat_msg_t *msg) {
+    pthread_mutex_lock(&cl->out_mutex);
+    if(cl->kicked) {
+        pthread_mutex_unlock(&cl->out_mutex);
+        return 0;
+    }
+    
+    if(cl->queued_bytes + msg->len > high_water_mark) {
+        // A laggard either misses messages or gets disconnected; it never holds up the room
+        if(lag_policy == LAG_DROP) {
+            cl->dropped++;
+            pthread_mutex_unlock(&cl->out_mutex);
+            return 0;
+        }
+        cl->kicked = 1;
+        pthread_mutex_unlock(&cl->out_mutex);
+        return mark_dirty(cl);
+    }
+    
+    if(cl->queue_count == cl->queue_cap) {
+        int new_cap = cl->queue_cap ? cl->queue_cap * 2 : 16;
+        chat_msg_t **grown = malloc(new_cap * sizeof(chat_msg_t*));
+        if(grown == NULL) {
+            pthread_mutex_unlock(&cl->out_mutex);
+            return 0;
+        }
+        for(int i = 0; i < cl->queue_count; i++) {
+            grown[i] = cl->queue[(cl->queue_head + i) % cl->queue_cap];
+        }
+        free(cl->queue);
+        cl->queue = grown;
+        cl->queue_head = 0;
+        cl->queue_cap = new_cap;
+    }
+    atomic_fetch_add(&msg->refs, 1);
+    cl->queue[(cl->queue_head + cl->queue_count) % cl->queue_cap] = msg;
+    cl->queue_count++;
+    cl->queued_bytes += msg->len;
+    pthread_mutex_unlock(&cl->out_mutex);
+    return mark_dirty(cl);
+}
+
+// Signal loops whose clients got new output; one eventfd write per loop per message
+void wake_loops(uint64_t loop_mask) {
+    for(int i = 0; loop_mask; i++, loop_mask >>= 1) {
+        uint64_t one = 1;
+        if((loop_mask & 1) && write(loops[i].wake_fd, &one, sizeof(one)) < 0) {
+            // Counter already pending; the loop will wake anyway
+        }
+    }
+}
+
+// Queue one frame for every client but the sender (-1 for none)
+void broadcast_message(int type, const char *name, const char *text, size_t text_len, int sender_id) {
+    uint64_t start = metrics_now();
+    chat_msg_t *msg = create_message(type, name, strlen(name), text, text_len);
+    uint64_t wake = 0;
+    if(msg == NULL) {
+        return;
+    }
+    
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    for(int i = 0; i < registry.count; i++) {
+        client_t *cl = registry.dense[i];
+        if(cl->id != sender_id && queue_message(cl, msg)) {
+            wake |= 1ULL << cl->loop->index;
+        }
+    }
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+    
+    wake_loops(wake);
+    release_message(msg);
+    metrics_since(timing(TIME_BROADCAST), start);
+}
+
+// Send message to all clients (including from server)
+void server_broadcast(const char *text) {
+    broadcast_message(CHAT_SERVER, "", text, strlen(text), -1);
+}
+
+// Send a frame to specific client; returns -1 when there is no such client
+int send_to_client(int type, const char *name, const char *text, size_t text_len, int client_id) {
+    chat_msg_t *msg = create_message(type, name, strlen(name), text, text_len);
+    uint64_t wake = 0;
+    int found = 0;
+    if(msg == NULL) {
+        return -1;
+    }
+    
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    client_t *cl = find_client(client_id);
+    if(cl) {
+        found = 1;
+        if(queue_message(cl, msg)) {
+            wake |= 1ULL << cl->loop->index;
+        }
+    }
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+    
+    wake_loops(wake);
+    release_message(msg);
+    return found ? 0 : -1;
+}
+
+// Deliver a DM to every client with the given name; names are not indexed, so this walks the registry.
+// Returns the number of recipients.
+int send_direct_message(client_t *from, const char *to, size_t to_len, const char *text, size_t text_len) {
+    chat_msg_t *msg = create_message(CHAT_DM, from->name, strlen(from->name), text, text_len);
+    uint64_t wake = 0;
+    int sent = 0;
+    if(msg == NULL) {
+        return 0;
+    }
+    
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    for(int i = 0; i < registry.count; i++) {
+        client_t *cl = registry.dense[i];
+        if(cl->named && strlen(cl->name) == to_len && memcmp(cl->name, to, to_len) == 0) {
+            sent++;
+            if(queue_message(cl, msg)) {
+                wake |= 1ULL << cl->loop->index;
             }
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+    
+    wake_loops(wake);
+    release_message(msg);
+    return sent;
+}
+
+// FNV-1a hash of a room name; picks the directory shard and bucket
+uint32_t hash_room_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Room names are 1-31 letters, digits, '-' or '_'
+int valid_room_name(const char *name, size_t len) {
+    if(len == 0 || len > CHAT_MAX_NAME) {
+        return 0;
+    }
+    for(size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Look up a room by name, creating it on first use; NULL when the room limit is reached.
+// Rooms live until the server exits, so the pointer stays valid without holding a lock.
+room_t *find_room(const char *name, size_t len) {
+    uint32_t hash = hash_room_name(name, len);
+    room_shard_t *shard = &room_shards[hash % ROOM_SHARDS];
+    room_t **bucket = &shard->buckets[(hash / ROOM_SHARDS) % ROOM_BUCKETS];
+    
+    pthread_mutex_lock(&shard->mutex);
+    for(room_t *room = *bucket; room; room = room->next) {
+        if(strlen(room->name) == len && memcmp(room->name, name, len) == 0) {
+            pthread_mutex_unlock(&shard->mutex);
+            return room;
+        }
+    }
+    
+    room_t *room = NULL;
+    if(atomic_fetch_add(&room_count, 1) < max_rooms) {
+        room = calloc(1, sizeof(room_t));
+        if(room) {
+            room->history = calloc(room_history, sizeof(chat_msg_t*));
+        }
+        if(room && room->history == NULL && room_history > 0) {
+            free(room);
+            room = NULL;
+        }
+    }
+    if(room == NULL) {
+        atomic_fetch_sub(&room_count, 1);
+        pthread_mutex_unlock(&shard->mutex);
+        return NULL;
+    }
+    memcpy(room->name, name, len);
+    pthread_mutex_init(&room->mutex, NULL);
+    room->next = *bucket;
+    *bucket = room;
+    pthread_mutex_unlock(&shard->mutex);
+    return room;
+}
+
+// Encode a room chat message carrying its sequence number, holding one reference
+chat_msg_t *create_sequenced_message(const char *name, size_t name_len, unsigned long seq, time_t posted,
+                                     const char *text, size_t text_len) {
+    uint64_t start = metrics_now();
+    chat_msg_t *msg = malloc(sizeof(chat_msg_t) + CHAT_FRAME_HEADER + CHAT_MAX_SEQ + name_len + text_len);
+    if(msg == NULL) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    msg->posted = posted;
+    msg->len = chat_encode_seq(msg->data, CHAT_MESSAGE, name, name_len, seq, text, text_len);
+    metrics_since(timing(TIME_RENDER), start);
+    return msg;
+}
+
+// Add a chat message to the room's history ring, which takes its own reference; caller holds room->mutex
+void keep_history_message(room_t *room, chat_msg_t *msg) {
+    if(room_history == 0) {
+        return;
+    }
+    int slot = (room->history_head + room->history_count) % room_history;
+    if(room->history_count == room_history) {
+        release_message(room->history[slot]);
+        room->history_head = (room->history_head + 1) % room_history;
+    } else {
+        room->history_count++;
+    }
+    atomic_fetch_add(&msg->refs, 1);
+    room->history[slot] = msg;
+}
+
+// Queue one frame for the room's members but the sender (-1 for none).
+// Chat messages are numbered, queued for the log when there is one and kept in the room's history
+// for whoever enters or resumes next. Returns -1 when the frame could not be built or the log refused it.
+int room_broadcast(room_t *room, int type, const char *name, const char *text, size_t text_len, int sender_id) {
+    char record[LOG_RECORD_SIZE(CHAT_MAX_NAME, CHAT_MAX_NAME + CHAT_MAX_SEQ + CHAT_MAX_TEXT)] __attribute__((aligned(8)));
+    size_t record_len = 0;
+    time_t posted = time(0);
+    uint64_t start = metrics_now();
+    chat_msg_t *msg = NULL;
+    uint64_t wake = 0;
+    if(type != CHAT_MESSAGE && (msg = create_message(type, name, strlen(name), text, text_len)) == NULL) {
+        return -1;
+    }
+    if(type == CHAT_MESSAGE && chat_log.dir) {
+        // Encoded before the lock is taken; log_append only copies it in and numbers it
+        record_len = log_encode_fields(record, room->name, strlen(room->name), 0, posted,
+                                       name, strlen(name), text, text_len);
+    }
+    
+    uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+    if(type == CHAT_MESSAGE) {
+        // Numbered under the lock so sequence order is history, log and delivery order
+        msg = create_sequenced_message(name, strlen(name), room->last_seq + 1, posted, text, text_len);
+        if(msg == NULL || (record_len && log_append(&chat_log, record, record_len, room->last_seq + 1) < 0)) {
+            metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+            release_message(msg);
+            return -1;
+        }
+        room->last_seq++;
+        keep_history_message(room, msg);
+    }
+    for(int i = 0; i < room->member_count; i++) {
+        client_t *cl = room->members[i];
+        if(cl->id != sender_id && queue_message(cl, msg)) {
+            wake |= 1ULL << cl->loop->index;
+        }
+    }
+    metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+    
+    wake_loops(wake);
+    release_message(msg);
+    metrics_since(timing(TIME_BROADCAST), start);
+    return 0;
+}
+
+// Split a room message frame back into its sender and text; returns its sequence number
+unsigned long decode_room_message(const chat_msg_t *msg, chat_frame_t *frame) {
+    frame->type = CHAT_MESSAGE;
+    frame->name = msg->data + CHAT_FRAME_HEADER;
+    frame->name_len = (unsigned char)msg->data[5];
+    frame->text = frame->name + frame->name_len;
+    frame->text_len = msg->len - CHAT_FRAME_HEADER - frame->name_len;
+    return chat_frame_seq(frame);
+}
+
+// Put a recovered record back into its room's history; repeats from a snapshot overlap are skipped.
+// Recovery runs before any loop, so nothing else touches the rooms yet.
+int restore_log_record(const log_record_t *rec) {
+    room_t *room = find_room((const char*)(rec + 1), rec->room_len);
+    if(room == NULL || rec->seq <= room->last_seq) {
+        return 0;
+    }
+    const char *username = (const char*)(rec + 1) + rec->room_len;
+    chat_msg_t *msg = create_sequenced_message(username, rec->username_len, rec->seq, rec->posted,
+                                               username + rec->username_len, rec->message_len);
+    if(msg == NULL) {
+        return 0;
+    }
+    
+    // A gap means what came before is gone for good; the ring starts over so it stays contiguous
+    if(rec->seq != room->last_seq + 1) {
+        for(int i = 0; i < room->history_count; i++) {
+            release_message(room->history[(room->history_head + i) % room_history]);
+        }
+        room->history_head = 0;
+        room->history_count = 0;
+    }
+    keep_history_message(room, msg);
+    room->last_seq = rec->seq;
+    release_message(msg);
+    return 1;
 }
 
-// Send message to all clients except sender
-void broadcast_message(char *message, int sender_id) {
-    pthread_mutex_lock(&clients_mutex);
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        if(clients[i]) {
-            if(clients[i]->id != sender_id) {
-                if(write(clients[i]->socket_fd, message, strlen(message)) < 0) {
-                    printf("Error sending message to client %d\n", clients[i]->id);
+// Restate every room's retained history at the start of a new log segment; runs on the log writer
+void write_log_snapshot(log_snapshot_t *snap) {
+    chat_msg_t **kept = malloc(room_history * sizeof(chat_msg_t*));
+    if(kept == NULL) {
+        snap->failed = 1;
+        return;
+    }
+    
+    for(int s = 0; s < ROOM_SHARDS; s++) {
+        // Rooms are pushed on the front of their bucket and never unlinked or freed, so the chains
+        // behind a copy of the heads can be walked without the lock that find_room needs
+        room_t *heads[ROOM_BUCKETS];
+        pthread_mutex_lock(&room_shards[s].mutex);
+        memcpy(heads, room_shards[s].buckets, sizeof(heads));
+        pthread_mutex_unlock(&room_shards[s].mutex);
+        
+        for(int b = 0; b < ROOM_BUCKETS; b++) {
+            for(room_t *room = heads[b]; room; room = room->next) {
+                // Only references are taken under the room lock; encoding and writing come after
+                uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+                int count = room->history_count;
+                for(int i = 0; i < count; i++) {
+                    kept[i] = room->history[(room->history_head + i) % room_history];
+                    atomic_fetch_add(&kept[i]->refs, 1);
+                }
+                metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+                
+                for(int i = 0; i < count; i++) {
+                    chat_frame_t frame;
+                    unsigned long seq = decode_room_message(kept[i], &frame);
+                    log_snapshot_add(snap, room->name, strlen(room->name), seq, kept[i]->posted,
+                                     frame.name, frame.name_len, frame.text, frame.text_len);
+                    release_message(kept[i]);
                 }
             }
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
+    free(kept);
 }
 
-// Send message to all clients (including from server)
-void server_broadcast(char *message) {
-    pthread_mutex_lock(&clients_mutex);
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        if(clients[i]) {
-            if(write(clients[i]->socket_fd, message, strlen(message)) < 0) {
-                printf("Error sending message to client %d\n", clients[i]->id);
-            }
+// Index cursor of the room a logged record belongs to
+log_room_index_t *room_log_index(const char *name, size_t len) {
+    room_t *room = find_room(name, len);
+    return room ? &room->index : NULL;
+}
+
+// Take a client out of its room's member list; only the client's own loop calls this
+void leave_room(client_t *cl) {
+    room_t *room = cl->room;
+    if(room == NULL) {
+        return;
+    }
+    
+    uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+    client_t *last = room->members[--room->member_count];
+    room->members[cl->room_index] = last;
+    last->room_index = cl->room_index;
+    metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+    cl->room = NULL;
+}
+
+// Add a client to a room, confirm it with a CHAT_ROOM frame and replay the room's history.
+// A client resuming after sequence number since gets only the newer messages, behind a CHAT_HISTORY
+// header "<first> <last>"; a since past the newest message gets everything kept, as a plain join does.
+// Returns -1 when the member list cannot grow.
+int enter_room(client_t *cl, room_t *room, unsigned long since) {
+    char seq[48];
+    char range[48];
+    chat_msg_t *header = NULL;
+    int wake = 0;
+    
+    uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+    if(room->member_count == room->member_cap) {
+        int new_cap = room->member_cap ? room->member_cap * 2 : 16;
+        client_t **grown = realloc(room->members, new_cap * sizeof(client_t*));
+        if(grown == NULL) {
+            metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+            return -1;
         }
+        room->members = grown;
+        room->member_cap = new_cap;
+    }
+    
+    unsigned long oldest = room->last_seq - room->history_count + 1;
+    unsigned long first = oldest;
+    if(since > room->last_seq) {
+        since = 0;
+    }
+    if(since >= oldest) {
+        first = since + 1;
+    }
+    snprintf(seq, sizeof(seq), "%lu %lu", room->last_seq, server_epoch);
+    chat_msg_t *ack = create_message(CHAT_ROOM, room->name, strlen(room->name), seq, strlen(seq));
+    if(since > 0) {
+        snprintf(range, sizeof(range), "%lu %lu", first <= room->last_seq ? first : 0,
+                 first <= room->last_seq ? room->last_seq : 0);
+        header = create_message(CHAT_HISTORY, room->name, strlen(room->name), range, strlen(range));
+    }
+    if(ack == NULL || (since > 0 && header == NULL)) {
+        metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+        release_message(ack);
+        release_message(header);
+        return -1;
+    }
+    cl->room = room;
+    cl->room_index = room->member_count;
+    room->members[room->member_count++] = cl;
+    
+    // Queued under the room lock so no newer room message can overtake the replay
+    wake |= queue_message(cl, ack);
+    if(header) {
+        wake |= queue_message(cl, header);
+    }
+    for(unsigned long s = first; s <= room->last_seq; s++) {
+        wake |= queue_message(cl, room->history[(room->history_head + (int)(s - oldest)) % room_history]);
     }
-    pthread_mutex_unlock(&clients_mutex);
+    metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+    
+    if(wake) {
+        wake_loops(1ULL << cl->loop->index);
+    }
+    release_message(ack);
+    release_message(header);
+    return 0;
 }
 
-// Send message to specific client
-void send_to_client(char *message, int client_id) {
-    pthread_mutex_lock(&clients_mutex);
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        if(clients[i] && clients[i]->id == client_id) {
-            if(write(clients[i]->socket_fd, message, strlen(message)) < 0) {
-                printf("Error sending message to client %d\n", client_id);
+// One page of older history read back from the log: frames ready to queue, NULL where the log has none
+typedef struct {
+    atomic_int refs;
+    chat_msg_t *msgs[LOG_PAGE];
+} history_page_t;
+
+// A CHAT_HISTORY reply waiting for the history thread
+typedef struct history_job {
+    int client_id;
+    room_t *room;
+    unsigned long first;            // oldest sequence asked for, 0 when there is nothing to send
+    unsigned long last;
+    unsigned long log_last;         // newest one the log has to supply, 0 when the ring held them all
+    struct history_job *next;
+    int recent_count;
+    chat_msg_t *recent[];           // the part the ring held, referenced when the request came in
+} history_job_t;
+
+// Replies for the history thread, answered in the order they were asked for
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    history_job_t *head;
+    history_job_t *tail;
+} history_queue_t;
+
+history_queue_t history_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// Reference counting for pages in the history cache
+void retain_history_page(void *page) {
+    atomic_fetch_add(&((history_page_t*)page)->refs, 1);
+}
+
+void release_history_page(void *page) {
+    history_page_t *p = page;
+    if(p && atomic_fetch_sub(&p->refs, 1) == 1) {
+        for(int i = 0; i < LOG_PAGE; i++) {
+            release_message(p->msgs[i]);
+        }
+        free(p);
+    }
+}
+
+// Pages read from the log; only the history thread reads and fills it
+log_page_cache_t history_cache = LOG_CACHE_INITIALIZER(retain_history_page, release_history_page);
+
+// Record found by log_read_page: encode it as the frame the room's members got
+void collect_history_record(const log_record_t *rec, void *arg) {
+    history_page_t *page = arg;
+    const char *username = (const char*)(rec + 1) + rec->room_len;
+    page->msgs[(rec->seq - 1) % LOG_PAGE] = create_sequenced_message(username, rec->username_len, rec->seq,
+                                                                     rec->posted, username + rec->username_len,
+                                                                     rec->message_len);
+}
+
+// Take a reference to a page of a room's history, from the cache or from the log; NULL when out of memory.
+// Reads the disk on a miss, so only the history thread calls it.
+history_page_t *get_history_page(room_t *room, unsigned long number) {
+    history_page_t *page = log_cache_find(&history_cache, room, number);
+    if(page) {
+        return page;
+    }
+    log_cache_miss(&history_cache);
+    
+    page = calloc(1, sizeof(history_page_t));
+    if(page == NULL) {
+        return NULL;
+    }
+    atomic_init(&page->refs, 1);
+    // A page the log may still add to is not cached
+    if(log_read_page(&chat_log, room->name, number, collect_history_record, page) > 0) {
+        log_cache_insert(&history_cache, room, number, page);
+    }
+    return page;
+}
+
+// Hand the reply for first..last to the history thread with references to what the ring still holds;
+// caller holds room->mutex. Returns -1 when the job cannot be allocated.
+int queue_history_job(client_t *cl, room_t *room, unsigned long first, unsigned long last) {
+    unsigned long oldest = room->last_seq - room->history_count + 1;
+    unsigned long ring_first = first > oldest ? first : oldest;
+    int recent = first != 0 && last >= ring_first ? (int)(last - ring_first + 1) : 0;
+    history_job_t *job = malloc(sizeof(history_job_t) + recent * sizeof(chat_msg_t*));
+    if(job == NULL) {
+        return -1;
+    }
+    job->client_id = cl->id;
+    job->room = room;
+    job->first = first;
+    job->last = last;
+    job->log_last = first != 0 && first < oldest ? (last < oldest ? last : oldest - 1) : 0;
+    job->next = NULL;
+    job->recent_count = recent;
+    for(int i = 0; i < recent; i++) {
+        job->recent[i] = room->history[(room->history_head + (int)(ring_first - oldest) + i) % room_history];
+        atomic_fetch_add(&job->recent[i]->refs, 1);
+    }
+    
+    pthread_mutex_lock(&history_queue.mutex);
+    if(history_queue.tail) {
+        history_queue.tail->next = job;
+    } else {
+        history_queue.head = job;
+    }
+    history_queue.tail = job;
+    pthread_cond_signal(&history_queue.ready);
+    pthread_mutex_unlock(&history_queue.mutex);
+    return 0;
+}
+
+// Build and queue one reply. Its frames are queued under the room lock, as room_broadcast queues, so no
+// room message lands between them, and only to a member: leaving takes that lock, so a client found
+// among the members cannot be closed meanwhile. A client that moved on no longer wants the reply.
+void answer_history_job(history_job_t *job) {
+    history_page_t *pages[MAX_HISTORY_LIMIT / LOG_PAGE + 2] = { NULL };
+    chat_msg_t *frames[MAX_HISTORY_LIMIT];
+    int count = 0;
+    unsigned long first_page = 0, page_count = 0;
+    unsigned long sent_first = 0, sent_last = 0;
+    char range[48];
+    room_t *room = job->room;
+    
+    // What the log no longer has is skipped, so the range names what is actually sent
+    if(job->log_last) {
+        first_page = (job->first - 1) / LOG_PAGE;
+        page_count = (job->log_last - 1) / LOG_PAGE - first_page + 1;
+        for(unsigned long i = 0; i < page_count; i++) {
+            pages[i] = get_history_page(room, first_page + i);
+        }
+        for(unsigned long seq = job->first; seq <= job->log_last; seq++) {
+            history_page_t *page = pages[(seq - 1) / LOG_PAGE - first_page];
+            if(page && page->msgs[(seq - 1) % LOG_PAGE]) {
+                frames[count++] = page->msgs[(seq - 1) % LOG_PAGE];
+                sent_first = sent_first ? sent_first : seq;
+                sent_last = seq;
+            }
+        }
+    }
+    for(int i = 0; i < job->recent_count; i++) {
+        frames[count++] = job->recent[i];
+    }
+    if(job->recent_count) {
+        sent_first = sent_first ? sent_first : job->last - job->recent_count + 1;
+        sent_last = job->last;
+    }
+    snprintf(range, sizeof(range), "%lu %lu", sent_first, sent_last);
+    chat_msg_t *header = create_message(CHAT_HISTORY, room->name, strlen(room->name), range, strlen(range));
+    
+    int wake = 0;
+    int loop_index = 0;
+    uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+    for(int i = 0; i < room->member_count && header; i++) {
+        client_t *cl = room->members[i];
+        if(cl->id == job->client_id) {
+            wake |= queue_message(cl, header);
+            for(int j = 0; j < count; j++) {
+                wake |= queue_message(cl, frames[j]);
             }
+            loop_index = cl->loop->index;
             break;
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
+    metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+    
+    if(wake) {
+        wake_loops(1ULL << loop_index);
+    }
+    release_message(header);
+    for(unsigned long i = 0; i < page_count; i++) {
+        release_history_page(pages[i]);
+    }
+    for(int i = 0; i < job->recent_count; i++) {
+        release_message(job->recent[i]);
+    }
+    free(job);
+}
+
+// Answer CHAT_HISTORY requests off the event loops, since a reply may have to read the log
+void *history_thread(void *arg) {
+    while(1) {
+        pthread_mutex_lock(&history_queue.mutex);
+        while(history_queue.head == NULL) {
+            pthread_cond_wait(&history_queue.ready, &history_queue.mutex);
+        }
+        history_job_t *job = history_queue.head;
+        history_queue.head = job->next;
+        if(history_queue.head == NULL) {
+            history_queue.tail = NULL;
+        }
+        pthread_mutex_unlock(&history_queue.mutex);
+        answer_history_job(job);
+    }
+    return NULL;
+}
+
+// Answer a CHAT_HISTORY request "<before> <limit>": a CHAT_HISTORY frame with "<first> <last>" (0 0 when
+// nothing is kept before that point), then up to MAX_HISTORY_LIMIT of those messages oldest first.
+// Without a log the room's ring answers at once. With one, the log holds what the ring has dropped, and
+// every request goes to the history thread so replies still come in the order they were asked for.
+void send_room_history(client_t *cl, const char *text, size_t text_len) {
+    char request[32];
+    char range[48];
+    unsigned long before = 0;
+    int limit = 0;
+    room_t *room = cl->room;
+    int wake = 0;
+    if(room == NULL) {
+        return;
+    }
+    
+    snprintf(request, sizeof(request), "%.*s", (int)text_len, text);
+    sscanf(request, "%lu %d", &before, &limit);
+    if(limit <= 0) {
+        limit = room_history;
+    }
+    if(limit > MAX_HISTORY_LIMIT) {
+        limit = MAX_HISTORY_LIMIT;
+    }
+    
+    uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+    unsigned long oldest = room->last_seq - room->history_count + 1;
+    unsigned long floor = chat_log.dir ? 1 : oldest;
+    unsigned long last = before == 0 || before > room->last_seq ? room->last_seq : before - 1;
+    unsigned long first = last >= (unsigned long)limit && last - limit + 1 > floor ? last - limit + 1 : floor;
+    if(last < first) {
+        first = last = 0;
+    }
+    if(chat_log.dir) {
+        int queued = queue_history_job(cl, room, first, last);
+        metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+        if(queued < 0) {
+            snprintf(range, sizeof(range), "History is unavailable; try again.");
+            send_to_client(CHAT_SERVER, "", range, strlen(range), cl->id);
+        }
+        return;
+    }
+    
+    snprintf(range, sizeof(range), "%lu %lu", first, last);
+    chat_msg_t *header = create_message(CHAT_HISTORY, room->name, strlen(room->name), range, strlen(range));
+    if(header) {
+        wake |= queue_message(cl, header);
+        release_message(header);
+        for(unsigned long seq = first; seq != 0 && seq <= last; seq++) {
+            int index = room->history_head + (int)(seq - oldest);
+            wake |= queue_message(cl, room->history[index % room_history]);
+        }
+    }
+    metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+    
+    if(wake) {
+        wake_loops(1ULL << cl->loop->index);
+    }
+}
+
+// Move a client to the named room, announcing it in both; since is the sequence number a reconnecting
+// client last saw there, 0 for none. Returns -1 and tells the client why on failure.
+int change_room(client_t *cl, const char *name, size_t len, unsigned long since) {
+    char notice[CHAT_MAX_NAME + 64];
+    room_t *room = NULL;
+    
+    if(!valid_room_name(name, len)) {
+        snprintf(notice, sizeof(notice), "Room names are 1-%d letters, digits, '-' or '_'.", CHAT_MAX_NAME);
+    } else if((room = find_room(name, len)) == NULL) {
+        snprintf(notice, sizeof(notice), "No more rooms can be created.");
+    } else if(room == cl->room) {
+        return 0;
+    }
+    if(room == NULL) {
+        send_to_client(CHAT_SERVER, "", notice, strlen(notice), cl->id);
+        return -1;
+    }
+    
+    room_t *old = cl->room;
+    leave_room(cl);
+    if(old) {
+        snprintf(notice, sizeof(notice), "moved to #%s.", room->name);
+        room_broadcast(old, CHAT_LEAVE, cl->name, notice, strlen(notice), cl->id);
+    }
+    if(enter_room(cl, room, since) < 0) {
+        snprintf(notice, sizeof(notice), "Could not enter #%s.", room->name);
+        send_to_client(CHAT_SERVER, "", notice, strlen(notice), cl->id);
+        return -1;
+    }
+    room_broadcast(room, CHAT_JOIN, cl->name, "", 0, cl->id);
+    return 0;
+}
+
+// List every room with its member count and retained history
+void list_rooms() {
+    int total = 0;
+    printf("\n=== Rooms ===\n");
+    for(int s = 0; s < ROOM_SHARDS; s++) {
+        pthread_mutex_lock(&room_shards[s].mutex);
+        for(int b = 0; b < ROOM_BUCKETS; b++) {
+            for(room_t *room = room_shards[s].buckets[b]; room; room = room->next) {
+                uint64_t locked = metrics_lock(&room->mutex, timing(TIME_ROOM_WAIT));
+                printf("#%s: %d members, %d messages kept\n", room->name, room->member_count, room->history_count);
+                metrics_unlock(&room->mutex, timing(TIME_ROOM_HOLD), locked);
+                total++;
+            }
+        }
+        pthread_mutex_unlock(&room_shards[s].mutex);
+    }
+    printf("Total rooms: %d\n", total);
+    printf("=============\n\n");
 }
 
 // List all connected clients
 void list_clients() {
-    pthread_mutex_lock(&clients_mutex);
+    char address[INET_ADDRSTRLEN];
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
     printf("\n=== Connected Clients ===\n");
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        if(clients[i]) {
-            printf("Client %d: %s (%s:%d)\n", 
-                clients[i]->id, 
-                clients[i]->name,
-                inet_ntoa(clients[i]->address.sin_addr),
-                ntohs(clients[i]->address.sin_port));
-        }
+    for(int i = 0; i < registry.count; i++) {
+        client_t *cl = registry.dense[i];
+        pthread_mutex_lock(&cl->out_mutex);
+        printf("Client %d: %s (%s:%d) queued %zu bytes, dropped %lu\n",
+            cl->id,
+            cl->name,
+            inet_ntop(AF_INET, &cl->address.sin_addr, address, sizeof(address)),
+            ntohs(cl->address.sin_port),
+            cl->queued_bytes,
+            cl->dropped);
+        pthread_mutex_unlock(&cl->out_mutex);
     }
-    printf("Total clients: %d\n", client_count);
+    printf("Total clients: %d\n", registry.count);
     printf("========================\n\n");
-    pthread_mutex_unlock(&clients_mutex);
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
 }
 
-// Handle individual client communication
-void *handle_client(void *arg) {
-    char buffer[BUFFER_SIZE];
-    char message[BUFFER_SIZE + 32];
-    int leave_flag = 0;
-    client_t *cli = (client_t*)arg;
+// Print every counter and latency histogram, summed over the threads' slots
+void print_stats() {
+    static const char *timing_names[TIMINGS] = {
+        "accept", "parse", "render", "send", "broadcast",
+        "room wait", "clients wait", "room hold", "clients hold"
+    };
+    uint64_t bytes_in = 0, bytes_out = 0, accepted = 0, closed = 0, frames = 0;
+    metrics_text_t text = { 0 };
+    int threads = atomic_load(&metric_threads);
+    if(threads > MAX_METRIC_THREADS) {
+        threads = MAX_METRIC_THREADS;
+    }
     
-    // Get client name
-    if(recv(cli->socket_fd, cli->name, sizeof(cli->name), 0) <= 0) {
-        strcpy(cli->name, "Anonymous");
+    for(int i = 0; i < threads; i++) {
+        thread_metrics_t *m = &thread_metrics[i];
+        bytes_in += atomic_load_explicit(&m->bytes_in, memory_order_relaxed);
+        bytes_out += atomic_load_explicit(&m->bytes_out, memory_order_relaxed);
+        accepted += atomic_load_explicit(&m->accepted, memory_order_relaxed);
+        closed += atomic_load_explicit(&m->closed, memory_order_relaxed);
+        frames += atomic_load_explicit(&m->frames, memory_order_relaxed);
+    }
+    metrics_printf(&text, "\n=== Stats ===\n");
+    metrics_printf(&text, "Connections: %llu active, %llu accepted\n",
+                   (unsigned long long)(accepted - closed), (unsigned long long)accepted);
+    metrics_printf(&text, "Traffic: %llu bytes in, %llu bytes out, %llu frames received\n",
+                   (unsigned long long)bytes_in, (unsigned long long)bytes_out, (unsigned long long)frames);
+    metrics_printf(&text, "Rooms: %d\n", atomic_load(&room_count));
+    if(chat_log.dir) {
+        pthread_mutex_lock(&chat_log.mutex);
+        metrics_printf(&text, "Log: %lu records in %lu batches, %lu refused%s\n", chat_log.records,
+                       chat_log.batches, chat_log.refused, chat_log.failed ? ", stopped after a failed write" : "");
+        pthread_mutex_unlock(&chat_log.mutex);
+        pthread_mutex_lock(&history_cache.mutex);
+        metrics_printf(&text, "History cache: %lu hits, %lu misses\n", history_cache.hits, history_cache.misses);
+        pthread_mutex_unlock(&history_cache.mutex);
     }
-    cli->name[sizeof(cli->name) - 1] = '\0'; // Ensure null termination
     
-    sprintf(message, "%s has joined the chat!\n", cli->name);
-    printf("%s", message);
-    broadcast_message(message, cli->id);
+    // One snapshot at a time keeps the merge buffer to a single histogram
+    metrics_histogram_t *snapshot = malloc(sizeof(metrics_histogram_t));
+    for(int t = 0; t < TIMINGS && snapshot; t++) {
+        memset(snapshot, 0, sizeof(*snapshot));
+        for(int i = 0; i < threads; i++) {
+            metrics_merge(snapshot, &thread_metrics[i].timings[t]);
+        }
+        metrics_print_summary(&text, timing_names[t], snapshot);
+    }
+    free(snapshot);
+    metrics_printf(&text, "=============\n\n");
     
+    if(text.data) {
+        fputs(text.data, stdout);
+    }
+    free(text.data);
+}
+
+// Write queued messages until the queue is empty or the socket is full; -1 on error
+int flush_client(client_t *cl) {
     while(1) {
-        if(leave_flag) {
-            break;
+        struct iovec iov[MAX_IOVECS];
+        int count = 0;
+        
+        // Snapshot the queue; the messages stay alive because the queue holds their references
+        pthread_mutex_lock(&cl->out_mutex);
+        for(int i = 0; i < cl->queue_count && count < MAX_IOVECS; i++) {
+            chat_msg_t *msg = cl->queue[(cl->queue_head + i) % cl->queue_cap];
+            size_t skip = i == 0 ? cl->head_sent : 0;
+            iov[count].iov_base = msg->data + skip;
+            iov[count].iov_len = msg->len - skip;
+            count++;
+        }
+        pthread_mutex_unlock(&cl->out_mutex);
+        if(count == 0) {
+            return 0;
         }
         
-        int receive = recv(cli->socket_fd, buffer, BUFFER_SIZE, 0);
-        if(receive > 0) {
-            if(receive < BUFFER_SIZE) {
-                buffer[receive] = '\0';
+        struct msghdr hdr = { 0 };
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = count;
+        uint64_t start = metrics_now();
+        ssize_t n = sendmsg(cl->socket_fd, &hdr, MSG_NOSIGNAL);
+        metrics_since(timing(TIME_SEND), start);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
             }
-            
-            // Remove newline
-            buffer[strcspn(buffer, "\n")] = 0;
-            
-            if(strlen(buffer) > 0) {
-                sprintf(message, "%s: %s\n", cli->name, buffer);
-                printf("%s", message);
-                broadcast_message(message, cli->id);
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        metrics_add(&metrics()->bytes_out, n);
+        
+        // Retire what was written; a partial write leaves head_sent inside the head message
+        pthread_mutex_lock(&cl->out_mutex);
+        cl->queued_bytes -= n;
+        while(n > 0) {
+            chat_msg_t *msg = cl->queue[cl->queue_head];
+            size_t left = msg->len - cl->head_sent;
+            if((size_t)n < left) {
+                cl->head_sent += n;
+                break;
             }
-        } else if(receive == 0 || strcmp(buffer, "exit") == 0) {
-            sprintf(message, "%s has left the chat.\n", cli->name);
-            printf("%s", message);
-            broadcast_message(message, cli->id);
-            leave_flag = 1;
+            n -= left;
+            release_message(msg);
+            cl->queue_head = (cl->queue_head + 1) % cl->queue_cap;
+            cl->queue_count--;
+            cl->head_sent = 0;
+        }
+        pthread_mutex_unlock(&cl->out_mutex);
+    }
+}
+
+// Give the client a receive buffer from its loop's pool before reading
+int hold_decoder(client_t *cl) {
+    if(cl->decoder) {
+        return 0;
+    }
+    pool_item_t *item = cl->loop->free_decoders;
+    if(item) {
+        cl->loop->free_decoders = item->next;
+        cl->decoder = (chat_decoder_t*)item;
+    } else if((cl->decoder = malloc(sizeof(chat_decoder_t))) == NULL) {
+        return -1;
+    }
+    cl->decoder->start = 0;
+    cl->decoder->end = 0;
+    return 0;
+}
+
+// Hand the receive buffer back once every byte in it was decoded; a partial frame keeps it
+void drop_decoder(client_t *cl) {
+    if(cl->decoder == NULL || cl->decoder->start != cl->decoder->end) {
+        return;
+    }
+    pool_item_t *item = (pool_item_t*)cl->decoder;
+    item->next = cl->loop->free_decoders;
+    cl->loop->free_decoders = item;
+    cl->decoder = NULL;
+}
+
+// Take a client from the loop's pool, carving a new slab when it is empty; NULL when that fails.
+// The queue array survives reuse, so a recycled client queues without allocating.
+client_t *get_client(chat_loop_t *loop) {
+    if(loop->free_clients == NULL) {
+        client_t *slab = calloc(CLIENT_SLAB, sizeof(client_t));
+        if(slab == NULL) {
+            return NULL;
+        }
+        for(int i = 0; i < CLIENT_SLAB; i++) {
+            slab[i].backlog_next = loop->free_clients;
+            loop->free_clients = &slab[i];
+        }
+    }
+    client_t *cl = loop->free_clients;
+    loop->free_clients = cl->backlog_next;
+    
+    chat_msg_t **queue = cl->queue;
+    int queue_cap = cl->queue_cap;
+    memset(cl, 0, sizeof(client_t));
+    cl->queue = queue;
+    cl->queue_cap = queue_cap;
+    cl->loop = loop;
+    pthread_mutex_init(&cl->out_mutex, NULL);
+    return cl;
+}
+
+// Return a client nobody can reach any more to its loop's pool
+void put_client(client_t *cl) {
+    chat_loop_t *loop = cl->loop;
+    if(cl->decoder) {
+        cl->decoder->start = cl->decoder->end = 0;
+        drop_decoder(cl);
+    }
+    pthread_mutex_destroy(&cl->out_mutex);
+    cl->backlog_next = loop->free_clients;
+    loop->free_clients = cl;
+}
+
+// Announce a departure, drop the client from the registry and return it to the pool
+void close_client(client_t *cl, const char *reason) {
+    room_t *room = cl->room;
+    metrics_add(&metrics()->closed, 1);
+    leave_room(cl);
+    if(cl->named) {
+        printf("%s %s\n", cl->name, reason);
+        if(room) {
+            room_broadcast(room, CHAT_LEAVE, cl->name, reason, strlen(reason), cl->id);
+        }
+    }
+    remove_client(cl->id);
+    
+    // Nobody can queue for it any more; unlink it from the dirty list if a sender put it there
+    pthread_mutex_lock(&cl->loop->dirty_mutex);
+    if(cl->dirty) {
+        client_t **link = &cl->loop->dirty;
+        while(*link != cl) {
+            link = &(*link)->dirty_next;
+        }
+        *link = cl->dirty_next;
+    }
+    pthread_mutex_unlock(&cl->loop->dirty_mutex);
+    if(cl->backlogged) {
+        client_t **link = &cl->loop->backlog;
+        while(*link != cl) {
+            link = &(*link)->backlog_next;
+        }
+        *link = cl->backlog_next;
+    }
+    
+    close(cl->socket_fd);
+    for(int i = 0; i < cl->queue_count; i++) {
+        release_message(cl->queue[(cl->queue_head + i) % cl->queue_cap]);
+    }
+    put_client(cl);
+}
+
+// Act on one frame from a client; returns -1 once the client is gone
+int handle_frame(client_t *cl, chat_frame_t *frame) {
+    char notice[CHAT_MAX_NAME + 32];
+    
+    // Get client name
+    if(!cl->named) {
+        if(frame->type != CHAT_JOIN) {
+            close_client(cl, "was disconnected for a protocol error.");
+            return -1;
+        }
+        uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+        memcpy(cl->name, frame->name, frame->name_len);
+        cl->name[frame->name_len] = '\0';
+        if(cl->name[0] == '\0') {
+            strcpy(cl->name, "Anonymous");
+        }
+        cl->named = 1;
+        metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+        
+        // The join text names the first room and where to resume it; without a room the client starts
+        // in the lobby, and sequence numbers from an earlier run of the server mean nothing now
+        const char *space = memchr(frame->text, ' ', frame->text_len);
+        size_t room_len = space ? (size_t)(space - frame->text) : frame->text_len;
+        unsigned long since = 0, epoch = 0;
+        if(space) {
+            snprintf(notice, sizeof(notice), "%.*s", (int)(frame->text_len - room_len - 1), space + 1);
+            if(sscanf(notice, "%lu %lu", &since, &epoch) != 2 || epoch != server_epoch) {
+                since = 0;
+            }
+        }
+        printf("%s has joined the chat!\n", cl->name);
+        if(room_len == 0 || change_room(cl, frame->text, room_len, since) < 0) {
+            change_room(cl, DEFAULT_ROOM, strlen(DEFAULT_ROOM), 0);
+        }
+        return 0;
+    }
+    
+    if(frame->type == CHAT_MESSAGE) {
+        if(cl->room) {
+            printf("#%s %s: %.*s\n", cl->room->name, cl->name, (int)frame->text_len, frame->text);
+            if(room_broadcast(cl->room, CHAT_MESSAGE, cl->name, frame->text, frame->text_len, cl->id) < 0) {
+                snprintf(notice, sizeof(notice), "Your message was not delivered; try again.");
+                send_to_client(CHAT_SERVER, "", notice, strlen(notice), cl->id);
+            }
+        }
+    }
+    else if(frame->type == CHAT_ROOM) {
+        change_room(cl, frame->name, frame->name_len, 0);
+    }
+    else if(frame->type == CHAT_HISTORY) {
+        send_room_history(cl, frame->text, frame->text_len);
+    }
+    else if(frame->type == CHAT_DM) {
+        if(send_direct_message(cl, frame->name, frame->name_len, frame->text, frame->text_len) == 0) {
+            snprintf(notice, sizeof(notice), "No one named %.*s is here.", (int)frame->name_len, frame->name);
+            send_to_client(CHAT_SERVER, "", notice, strlen(notice), cl->id);
+        }
+    }
+    else if(frame->type == CHAT_LEAVE) {
+        close_client(cl, "has left the chat.");
+        return -1;
+    }
+    else {
+        close_client(cl, "was disconnected for a protocol error.");
+        return -1;
+    }
+    return 0;
+}
+
+// Handle what a client sent, up to the read budget; returns -1 once the client is gone
+int handle_client_input(client_t *cl) {
+    chat_frame_t frame;
+    
+    for(int reads = 0; reads < MAX_READS_PER_EVENT; reads++) {
+        // Never full: after decoding, less than one whole frame is left over
+        size_t room;
+        if(hold_decoder(cl) < 0) {
+            close_client(cl, "has left the chat.");
+            return -1;
+        }
+        char *into = chat_decoder_room(cl->decoder, &room);
+        int receive = recv(cl->socket_fd, into, room, 0);
+        if(receive > 0) {
+            cl->decoder->end += receive;
+            metrics_add(&metrics()->bytes_in, receive);
+        } else if(receive == 0) {
+            close_client(cl, "has left the chat.");
+            return -1;
+        } else if(errno == EINTR) {
+            continue;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            drop_decoder(cl);
+            return 0;
         } else {
-            printf("Error receiving message from %s\n", cli->name);
-            leave_flag = 1;
+            printf("Error receiving message from %s\n", cl->named ? cl->name : "new client");
+            close_client(cl, "has left the chat.");
+            return -1;
+        }
+        
+        // Act on every complete frame; a partial one stays in the decoder for the next read
+        int status;
+        uint64_t start = metrics_now();
+        while((status = chat_decode(cl->decoder, &frame)) > 0) {
+            metrics_since(timing(TIME_PARSE), start);
+            metrics_add(&metrics()->frames, 1);
+            if(handle_frame(cl, &frame) < 0) {
+                return -1;
+            }
+            start = metrics_now();
+        }
+        if(status < 0) {
+            printf("Malformed frame from %s\n", cl->named ? cl->name : "new client");
+            close_client(cl, "was disconnected for a protocol error.");
+            return -1;
         }
     }
     
-    // Clean up
-    close(cli->socket_fd);
-    remove_client(cli->id);
-    free(cli);
-    pthread_detach(pthread_self());
+    // More may be waiting but no new edge will come; let the loop flush, then read again
+    if(!cl->backlogged) {
+        cl->backlogged = 1;
+        cl->backlog_next = cl->loop->backlog;
+        cl->loop->backlog = cl;
+    }
+    drop_decoder(cl);
+    return 0;
+}
+
+// Flush or disconnect every client that senders marked since the last wake
+void service_dirty_clients(chat_loop_t *loop) {
+    uint64_t count;
+    if(read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return;
+    }
     
-    return NULL;
+    while(1) {
+        pthread_mutex_lock(&loop->dirty_mutex);
+        client_t *cl = loop->dirty;
+        if(cl) {
+            loop->dirty = cl->dirty_next;
+            cl->dirty = 0;
+        }
+        pthread_mutex_unlock(&loop->dirty_mutex);
+        if(cl == NULL) {
+            return;
+        }
+        
+        pthread_mutex_lock(&cl->out_mutex);
+        int kicked = cl->kicked;
+        pthread_mutex_unlock(&cl->out_mutex);
+        if(kicked) {
+            close_client(cl, "was disconnected for falling behind.");
+        } else if(flush_client(cl) < 0) {
+            close_client(cl, "has left the chat.");
+        }
+    }
+}
+
+// Accept every pending connection on the loop's listener
+void accept_clients(chat_loop_t *loop) {
+    char address[INET_ADDRSTRLEN];
+    
+    while(1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        uint64_t start = metrics_now();
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr*)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Accept failed.\n");
+            }
+            return;
+        }
+        
+        // Create client structure
+        client_t *cli = get_client(loop);
+        if(cli == NULL) {
+            close(client_fd);
+            continue;
+        }
+        cli->address = client_addr;
+        cli->socket_fd = client_fd;
+        
+        // The registry check, insert and id assignment happen under one lock
+        if(add_client(cli) < 0) {
+            printf("Max clients reached. Connection rejected.\n");
+            close(client_fd);
+            put_client(cli);
+            continue;
+        }
+        metrics_add(&metrics()->accepted, 1);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = cli;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            close_client(cli, "");
+            continue;
+        }
+        metrics_since(timing(TIME_ACCEPT), start);
+        
+        printf("Client connected from %s:%d\n",
+            inet_ntop(AF_INET, &client_addr.sin_addr, address, sizeof(address)),
+            ntohs(client_addr.sin_port));
+    }
 }
 
 // Server command handler thread
 void *server_command_handler(void *arg) {
     char command[BUFFER_SIZE];
-    char message[BUFFER_SIZE];
     
     printf("\n=== Server Commands ===\n");
     printf("/broadcast <message> - Send message to all clients\n");
     printf("/list - List all connected clients\n");
     printf("/send <client_id> <message> - Send message to specific client\n");
+    printf("/rooms - List all rooms\n");
+    printf("/stats - Show traffic counters and latencies\n");
     printf("/help - Show this help\n");
     printf("======================\n\n");
     
@@ -184,20 +1441,26 @@ void *server_command_handler(void *arg) {
         printf("Server> ");
         fflush(stdout);
         
+        // No console (stdin closed or redirected from /dev/null): stop reading instead of spinning
         if(fgets(command, sizeof(command), stdin) == NULL) {
-            continue;
+            break;
         }
         
         command[strcspn(command, "\n")] = 0; // Remove newline
         
         if(strncmp(command, "/broadcast ", 11) == 0) {
-            sprintf(message, "[SERVER]: %s\n", command + 11);
-            server_broadcast(message);
+            server_broadcast(command + 11);
             printf("Message broadcasted to all clients.\n");
         }
         else if(strcmp(command, "/list") == 0) {
             list_clients();
         }
+        else if(strcmp(command, "/rooms") == 0) {
+            list_rooms();
+        }
+        else if(strcmp(command, "/stats") == 0) {
+            print_stats();
+        }
         else if(strncmp(command, "/send ", 6) == 0) {
             int client_id;
             char *msg_start = strchr(command + 6, ' ');
@@ -205,9 +1468,11 @@ void *server_command_handler(void *arg) {
                 *msg_start = '\0';
                 client_id = atoi(command + 6);
                 msg_start++;
-                sprintf(message, "[SERVER to you]: %s\n", msg_start);
-                send_to_client(message, client_id);
-                printf("Message sent to client %d.\n", client_id);
+                if(send_to_client(CHAT_DM, "", msg_start, strlen(msg_start), client_id) < 0) {
+                    printf("No client with id %d.\n", client_id);
+                } else {
+                    printf("Message sent to client %d.\n", client_id);
+                }
             } else {
                 printf("Usage: /send <client_id> <message>\n");
             }
@@ -217,6 +1482,8 @@ void *server_command_handler(void *arg) {
             printf("/broadcast <message> - Send message to all clients\n");
             printf("/list - List all connected clients\n");
             printf("/send <client_id> <message> - Send message to specific client\n");
+            printf("/rooms - List all rooms\n");
+            printf("/stats - Show traffic counters and latencies\n");
             printf("/help - Show this help\n");
             printf("======================\n\n");
         }
@@ -228,89 +1495,315 @@ void *server_command_handler(void *arg) {
     return NULL;
 }
 
-int main() {
-    int Socket_Serv_FD, Socket_Client_FD;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-    pthread_t tid, server_tid;
-    int port = 8080;
-    
-    // Initialize clients array
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        clients[i] = NULL;
-    }
-    
-    printf("Multi-client chat server starting on port %d...\n", port);
+// Open a listening socket; reuse_port lets several loops bind the same port
+int open_listener(int port, int reuse_port) {
+    struct sockaddr_in server_addr;
     
     // Create socket
-    Socket_Serv_FD = socket(AF_INET, SOCK_STREAM, 0);
-    if(Socket_Serv_FD < 0) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0) {
         printf("Socket creation failed.\n");
         return -1;
     }
     
     // Set socket options
     int opt = 1;
-    if(setsockopt(Socket_Serv_FD, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         printf("Setting socket options failed.\n");
         return -1;
     }
+    if(reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        printf("SO_REUSEPORT is not supported.\n");
+        return -1;
+    }
     
     // Bind
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
     
-    if(bind(Socket_Serv_FD, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if(bind(listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         printf("Binding failed.\n");
         return -1;
     }
     
     // Listen
-    if(listen(Socket_Serv_FD, 5) < 0) {
+    if(listen(listen_fd, SOMAXCONN) < 0) {
         printf("Listen failed.\n");
         return -1;
     }
+    return listen_fd;
+}
+
+// Create a loop's listener, epoll set and wake eventfd
+int init_loop(chat_loop_t *loop, int index, int port, int workers) {
+    loop->index = index;
+    loop->pinned = workers > 1;
+    pthread_mutex_init(&loop->dirty_mutex, NULL);
     
-    printf("Server listening for connections...\n");
+    loop->listen_fd = open_listener(port, workers > 1);
+    if(loop->listen_fd < 0) {
+        return -1;
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(loop->epoll_fd < 0 || loop->wake_fd < 0) {
+        printf("Event loop setup failed.\n");
+        return -1;
+    }
     
-    // Start server command handler thread
-    if(pthread_create(&server_tid, NULL, server_command_handler, NULL) != 0) {
-        printf("Error creating server command thread.\n");
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        printf("Event loop setup failed.\n");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->wake_fd;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        printf("Event loop setup failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Lift the soft descriptor limit so the registry limit, not RLIMIT_NOFILE, caps connections
+void raise_fd_limit(int clients) {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return;
+    }
+    
+    rlim_t wanted = (rlim_t)clients + 64;
+    if(limit.rlim_cur >= wanted) {
+        return;
+    }
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < wanted) {
+        printf("Descriptor limit is %lu; fewer than %d clients may connect.\n",
+               (unsigned long)limit.rlim_cur, clients);
+    }
+}
+
+// Pin the calling thread to the index-th CPU this process may run on
+void pin_to_cpu(int index) {
+    cpu_set_t allowed, mask;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    
+    int wanted = index % CPU_COUNT(&allowed);
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &allowed) && wanted-- == 0) {
+            CPU_ZERO(&mask);
+            CPU_SET(cpu, &mask);
+            pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+            return;
+        }
+    }
+}
+
+// Exit on Ctrl+C or SIGTERM through exit(), so atexit work such as writing profile data still runs.
+// Messages already delivered are in the log's pending batch, so it goes to disk first.
+void *shutdown_thread(void *arg) {
+    sigset_t *signals = arg;
+    int sig;
+    if(sigwait(signals, &sig) == 0) {
+        printf("\nShutting down...\n");
+        drain_chat_log(&chat_log);
+        exit(0);
+    }
+    return NULL;
+}
+
+// Route the stop signals to one thread; every thread started later inherits the blocked mask
+int start_shutdown_thread() {
+    static sigset_t signals;
+    pthread_t tid;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if(pthread_create(&tid, NULL, shutdown_thread, &signals) != 0) {
         return -1;
     }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Run one event loop forever: accept, read, and drain outbound queues without blocking
+void *run_loop(void *arg) {
+    chat_loop_t *loop = (chat_loop_t*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    
+    if(loop->pinned) {
+        pin_to_cpu(loop->index);
+    }
     
-    // Accept clients
     while(1) {
-        client_len = sizeof(client_addr);
-        Socket_Client_FD = accept(Socket_Serv_FD, (struct sockaddr*)&client_addr, &client_len);
-        
-        if(Socket_Client_FD < 0) {
-            printf("Accept failed.\n");
-            continue;
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, loop->backlog ? 0 : -1);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            printf("epoll_wait failed.\n");
+            return NULL;
         }
         
-        // Check if max clients reached
-        if(client_count == MAX_CLIENTS) {
-            printf("Max clients reached. Connection rejected.\n");
-            close(Socket_Client_FD);
-            continue;
+        // Dirty clients are serviced after the batch: closing one there cannot leave
+        // a stale pointer in a later event of the same batch
+        int woken = 0;
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr == NULL) {
+                accept_clients(loop);
+            } else if(events[i].data.ptr == &loop->wake_fd) {
+                woken = 1;
+            } else {
+                client_t *cl = events[i].data.ptr;
+                if(handle_client_input(cl) < 0) {
+                    continue;
+                }
+                if((events[i].events & EPOLLOUT) && flush_client(cl) < 0) {
+                    close_client(cl, "has left the chat.");
+                }
+            }
+        }
+        if(woken) {
+            service_dirty_clients(loop);
         }
         
-        // Create client structure
-        client_t *cli = (client_t*)malloc(sizeof(client_t));
-        cli->address = client_addr;
-        cli->socket_fd = Socket_Client_FD;
-        cli->id = Socket_Client_FD; // Using socket fd as unique id
-        
-        // Add client and create thread
-        add_client(cli);
-        pthread_create(&tid, NULL, handle_client, (void*)cli);
-        
-        printf("Client connected from %s:%d\n", 
-            inet_ntoa(client_addr.sin_addr), 
-            ntohs(client_addr.sin_port));
+        // Resume clients that hit the read budget; each may put itself back on a fresh list
+        client_t *cl = loop->backlog;
+        loop->backlog = NULL;
+        while(cl) {
+            client_t *next = cl->backlog_next;
+            cl->backlogged = 0;
+            handle_client_input(cl);
+            cl = next;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t tid, server_tid;
+    int port = 8080;
+    int workers = 1;
+    const char *log_dir = NULL;
+    
+    // Parse command line options
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            registry.limit = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--high-water") == 0 && i + 1 < argc) {
+            high_water_mark = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--lag-policy") == 0 && i + 1 < argc &&
+                  (strcmp(argv[i + 1], "drop") == 0 || strcmp(argv[i + 1], "disconnect") == 0)) {
+            lag_policy = strcmp(argv[++i], "drop") == 0 ? LAG_DROP : LAG_DISCONNECT;
+        } else if(strcmp(argv[i], "--max-rooms") == 0 && i + 1 < argc) {
+            max_rooms = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--room-history") == 0 && i + 1 < argc) {
+            room_history = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if(strcmp(argv[i], "--log-segment") == 0 && i + 1 < argc) {
+            chat_log.segment_limit = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--history-cache") == 0 && i + 1 < argc) {
+            history_cache.limit = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--workers <event loops>] [--max-clients <n>] [--high-water <bytes>] "
+                   "[--lag-policy drop|disconnect] [--max-rooms <n>] [--room-history <messages>] "
+                   "[--log-dir <directory>] [--log-segment <bytes>] [--history-cache <pages>]\n", argv[0]);
+            return -1;
+        }
+    }
+    if(workers <= 0 || workers > MAX_WORKERS) {
+        printf("Workers must be between 1 and %d.\n", MAX_WORKERS);
+        return -1;
+    }
+    if(registry.limit <= 0 || registry.limit > REGISTRY_MAX_SLOTS) {
+        printf("Max clients must be between 1 and %d.\n", REGISTRY_MAX_SLOTS);
+        return -1;
+    }
+    if(high_water_mark < CHAT_MAX_FRAME) {
+        printf("High-water mark must hold at least one frame (%d bytes).\n", CHAT_MAX_FRAME);
+        return -1;
+    }
+    if(max_rooms <= 0 || room_history < 0) {
+        printf("Max rooms must be positive and room history must not be negative.\n");
+        return -1;
+    }
+    if(log_dir && room_history == 0) {
+        // Log snapshots restate the rings, and recovery takes each room's sequence from them
+        printf("A log needs a room history of at least one message.\n");
+        return -1;
+    }
+    if(history_cache.limit < 0) {
+        printf("History cache size must not be negative.\n");
+        return -1;
+    }
+    if(chat_log.segment_limit < 64 * 1024) {
+        printf("Log segments must be at least 65536 bytes.\n");
+        return -1;
+    }
+    for(int i = 0; i < ROOM_SHARDS; i++) {
+        pthread_mutex_init(&room_shards[i].mutex, NULL);
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_REALTIME, &started);
+    server_epoch = (unsigned long)started.tv_sec * 1000 + started.tv_nsec / 1000000;
+    
+    raise_fd_limit(registry.limit);
+    if(start_shutdown_thread() < 0) {
+        printf("Error creating shutdown thread.\n");
+        return -1;
+    }
+    
+    // Recovery fills the rooms before any loop runs; from then on the writer thread owns the tail segment
+    if(log_dir) {
+        chat_log.valid_room = valid_room_name;
+        chat_log.restore = restore_log_record;
+        chat_log.snapshot = write_log_snapshot;
+        chat_log.room_index = room_log_index;
+        if(open_chat_log(&chat_log, log_dir) < 0) {
+            return -1;
+        }
+        if(start_chat_log(&chat_log) < 0 || pthread_create(&tid, NULL, history_thread, NULL) != 0) {
+            printf("Error creating log threads.\n");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    
+    printf("Multi-client chat server starting on port %d...\n", port);
+    
+    // One listener per worker; the kernel spreads new connections across them
+    for(int i = 0; i < workers; i++) {
+        if(init_loop(&loops[i], i, port, workers) < 0) {
+            return -1;
+        }
+    }
+    
+    printf("Server listening for connections...\n");
+    
+    // Start server command handler thread
+    if(pthread_create(&server_tid, NULL, server_command_handler, NULL) != 0) {
+        printf("Error creating server command thread.\n");
+        return -1;
+    }
+    
+    // Start the event loops; this thread runs the first one
+    for(int i = 1; i < workers; i++) {
+        if(pthread_create(&tid, NULL, run_loop, &loops[i]) != 0) {
+            printf("Error creating event loop thread.\n");
+            return -1;
+        }
     }
+    run_loop(&loops[0]);
     
     return 0;
 }
@@ -1,4 +1,5 @@
-// client.c - Simple chat client
+// client.c - Chat client that reconnects and resumes where it left off, and a load generator for both servers
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<unistd.h>
@@ -7,90 +8,1100 @@
 #include<string.h>
 #include<pthread.h>
 #include<arpa/inet.h>
+#include<netinet/tcp.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<sys/epoll.h>
+#include<sys/resource.h>
+#include"chat-protocol.h"
+#include"metrics.h"
 
-#define BUFFER_SIZE 1024
+#define INPUT_SIZE (16 * 1024)     // stdin bytes read at once; every complete line in them is sent together
+#define SEND_BATCH (32 * 1024)     // holds the frames of the longest line INPUT_SIZE allows
+#define MAX_LOAD_THREADS 64
+#define MAX_LOAD_EVENTS 256
+#define LOAD_OUT_SIZE 8192         // unsent bytes a simulated user may have before its sends are skipped
+#define LOAD_TICK_MS 1             // send scheduling granularity
+#define LOAD_DRAIN_NS 1000000000ULL    // time after the last send for deliveries to arrive
+#define RECONNECT_MIN_MS 250       // first reconnect delay, doubled after every failed attempt
+#define RECONNECT_MAX_MS 30000
 
-int socket_fd;
-char name[32];
-
-// Thread to receive messages from server
-void *receive_messages(void *arg) {
-    char message[BUFFER_SIZE];
+// Print one frame from the server
+void print_frame(chat_frame_t *frame) {
+    int name_len = frame->name_len;
+    int text_len = frame->text_len;
     
-    while(1) {
-        int receive = recv(socket_fd, message, BUFFER_SIZE, 0);
-        if(receive > 0) {
-            message[receive] = '\0';
-            printf("%s", message);
-            fflush(stdout);
-        } else if(receive == 0) {
-            printf("Server disconnected.\n");
-            break;
+    if(frame->type == CHAT_JOIN) {
+        printf("%.*s has joined the chat!\n", name_len, frame->name);
+    } else if(frame->type == CHAT_MESSAGE) {
+        printf("%.*s: %.*s\n", name_len, frame->name, text_len, frame->text);
+    } else if(frame->type == CHAT_LEAVE) {
+        printf("%.*s %.*s\n", name_len, frame->name, text_len, frame->text);
+    } else if(frame->type == CHAT_DM && name_len == 0) {
+        printf("[SERVER to you]: %.*s\n", text_len, frame->text);
+    } else if(frame->type == CHAT_DM) {
+        printf("[%.*s to you]: %.*s\n", name_len, frame->name, text_len, frame->text);
+    } else if(frame->type == CHAT_SERVER) {
+        printf("[SERVER]: %.*s\n", text_len, frame->text);
+    } else if(frame->type == CHAT_ROOM) {
+        printf("You are now in #%.*s.\n", name_len, frame->name);
+    } else if(frame->type == CHAT_HISTORY) {
+        char range[32];
+        unsigned long first = 0, last = 0;
+        snprintf(range, sizeof(range), "%.*s", text_len, frame->text);
+        sscanf(range, "%lu %lu", &first, &last);
+        if(first == 0) {
+            printf("--- No earlier messages kept in #%.*s ---\n", name_len, frame->name);
         } else {
-            printf("Error receiving message.\n");
+            printf("--- #%.*s messages %lu-%lu (/history %lu for older) ---\n", name_len, frame->name, first, last, first);
+        }
+    }
+}
+
+// Append the frames for one input line to out; "/dm <name> <text>" becomes a direct message
+// "/join <room>" moves to another room and "/history [before] [limit]" pages back through it. Text longer than one frame is split across several.
+// Returns the new length of out.
+size_t encode_line(char *out, size_t out_len, char *line, size_t len) {
+    int type = CHAT_MESSAGE;
+    char *to = "";
+    size_t to_len = 0;
+    
+    if(len > 6 && strncmp(line, "/join ", 6) == 0) {
+        size_t room_len = len - 6 < CHAT_MAX_NAME ? len - 6 : CHAT_MAX_NAME;
+        return out_len + chat_encode(out + out_len, CHAT_ROOM, line + 6, room_len, "", 0);
+    }
+    
+    if(len >= 8 && strncmp(line, "/history", 8) == 0 && (len == 8 || line[8] == ' ')) {
+        size_t args_len = len - 8 < 32 ? len - 8 : 32;
+        return out_len + chat_encode(out + out_len, CHAT_HISTORY, "", 0, line + 8, args_len);
+    }
+    
+    if(len > 4 && strncmp(line, "/dm ", 4) == 0) {
+        char *space = memchr(line + 4, ' ', len - 4);
+        if(space) {
+            type = CHAT_DM;
+            to = line + 4;
+            to_len = space - to < CHAT_MAX_NAME ? space - to : CHAT_MAX_NAME;
+            len -= space + 1 - line;
+            line = space + 1;
+        }
+    }
+    
+    while(len > 0) {
+        size_t chunk = len < CHAT_MAX_TEXT ? len : CHAT_MAX_TEXT;
+        out_len += chat_encode(out + out_len, type, to, to_len, line, chunk);
+        line += chunk;
+        len -= chunk;
+    }
+    return out_len;
+}
+
+// Let the process hold one descriptor per simulated connection
+void raise_fd_limit(int fds) {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return;
+    }
+    
+    rlim_t wanted = (rlim_t)fds + 64;
+    if(limit.rlim_cur >= wanted) {
+        return;
+    }
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < wanted) {
+        fprintf(stderr, "Descriptor limit is %lu; not every connection may open.\n", (unsigned long)limit.rlim_cur);
+    }
+}
+
+// Load mode: which server the simulated users talk to
+enum {
+    LOAD_TCP,       // chat-server.c frames
+    LOAD_HTTP       // web-server.c POST /send and GET /messages/wait
+};
+
+// One socket of a simulated user, with the bytes it still has to write and a partial HTTP response
+typedef struct {
+    int fd;
+    char out[LOAD_OUT_SIZE];
+    size_t out_len;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+} load_conn_t;
+
+// A simulated user; in HTTP mode chat carries the long-poll and post the message posts
+typedef struct {
+    int id;
+    char room[CHAT_MAX_NAME + 1];
+    load_conn_t chat;
+    load_conn_t post;
+    chat_decoder_t decoder;
+    uint64_t joined_at;             // deliveries of messages sent before this are history replay
+    uint64_t next_send;
+    uint64_t post_started;          // send time of the outstanding POST, 0 when none
+    unsigned long since;            // newest sequence number the long-poll has seen
+} load_user_t;
+
+// One load thread and the users it drives from its epoll loop; counters are its own
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    load_user_t *users;
+    int count;
+    unsigned seed;
+    uint64_t sent;
+    uint64_t skipped;               // sends dropped because the previous one had not gone out
+    uint64_t delivered;
+    uint64_t resets;                // web polls answered with the whole history, left out of delivered
+    uint64_t connects;
+    uint64_t reconnects;            // churned users
+    uint64_t failures;
+    metrics_histogram_t latency;    // send to every receiver's read, the fan-out latency
+    metrics_histogram_t post_latency;
+} load_thread_t;
+
+int load_mode = LOAD_TCP;
+const char *server_host = "127.0.0.1";
+int server_port = 8080;
+int load_users = 1000;
+int load_threads = 4;
+int load_room_size = 50;
+double load_rate = 1;               // messages per second per user
+double load_churn = 0;              // reconnects per second across all users
+double load_duration = 10;
+int load_message_size = 64;
+pthread_barrier_t load_ready;
+
+// Connect to the server, blocking, then switch the socket to non-blocking; -1 on failure
+int load_connect() {
+    struct sockaddr_in addr = { 0 };
+    int one = 1;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    addr.sin_addr.s_addr = inet_addr(server_host);
+    
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Write what the connection has pending; -1 when the socket failed
+int load_flush(load_conn_t *conn) {
+    size_t done = 0;
+    while(done < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + done, conn->out_len - done, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
             break;
         }
+        done += n;
+    }
+    memmove(conn->out, conn->out + done, conn->out_len - done);
+    conn->out_len -= done;
+    return 0;
+}
+
+// Queue bytes behind what the connection has pending and try to write them; -1 when they do not fit
+int load_write(load_conn_t *conn, const char *data, size_t len) {
+    if(conn->out_len + len > sizeof(conn->out)) {
+        return -1;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return load_flush(conn) < 0 ? -1 : 0;
+}
+
+// Open one socket for a user and watch it; tag says which of the user's sockets it is
+int load_open_conn(load_thread_t *t, load_conn_t *conn, int index, int tag) {
+    conn->fd = load_connect();
+    conn->out_len = 0;
+    conn->in_len = 0;
+    if(conn->fd < 0) {
+        t->failures++;
+        return -1;
     }
     
-    return NULL;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = (uint64_t)index << 1 | tag;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+    t->connects++;
+    return 0;
+}
+
+// Close one socket of a user
+void load_close_conn(load_conn_t *conn) {
+    if(conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->out_len = 0;
+    conn->in_len = 0;
+}
+
+// Ask the web server for the room's messages newer than the last ones seen
+int load_poll(load_user_t *u) {
+    char request[256];
+    int len = snprintf(request, sizeof(request),
+                       "GET /messages/wait?room=%s&since=%lu HTTP/1.1\r\nHost: %s\r\n\r\n",
+                       u->room, u->since, server_host);
+    return load_write(&u->chat, request, len);
 }
 
-int main() {
-    struct sockaddr_in server_addr;
-    pthread_t receive_thread;
-    char message[BUFFER_SIZE];
+// Connect a user and join its room: a JOIN frame for chat-server, the first long-poll for the web server
+int load_join(load_thread_t *t, load_user_t *u, int index) {
+    char name[CHAT_MAX_NAME + 1];
+    char frame[CHAT_MAX_FRAME];
+    u->joined_at = metrics_now();
+    u->post_started = 0;
+    u->since = 0;
+    u->decoder.start = u->decoder.end = 0;
     
-    // Create socket
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(socket_fd < 0) {
-        printf("Socket creation failed.\n");
+    if(load_open_conn(t, &u->chat, index, 0) < 0) {
         return -1;
     }
+    if(load_mode == LOAD_TCP) {
+        int len = snprintf(name, sizeof(name), "load%d", u->id);
+        size_t frame_len = chat_encode(frame, CHAT_JOIN, name, len, u->room, strlen(u->room));
+        return load_write(&u->chat, frame, frame_len);
+    }
+    if(load_open_conn(t, &u->post, index, 1) < 0) {
+        load_close_conn(&u->chat);
+        return -1;
+    }
+    return load_poll(u);
+}
+
+// Drop a user's sockets and join again, as a client that went away and came back would
+void load_rejoin(load_thread_t *t, load_user_t *u, int index) {
+    load_close_conn(&u->chat);
+    load_close_conn(&u->post);
+    load_join(t, u, index);
+}
+
+// Post one timestamped message for a user; the text is "LT <send time> <user>" padded to the message size
+void load_send(load_thread_t *t, load_user_t *u, uint64_t now) {
+    char text[CHAT_MAX_TEXT + 1];
+    char request[CHAT_MAX_TEXT + 512];
+    char sep = load_mode == LOAD_TCP ? ' ' : '+';
+    int len = snprintf(text, sizeof(text), "LT%c%llu%c%d%c", sep, (unsigned long long)now, sep, u->id, sep);
+    while(len < load_message_size && len < CHAT_MAX_TEXT) {
+        text[len++] = 'x';
+    }
+    
+    if(load_mode == LOAD_TCP) {
+        size_t frame_len = chat_encode(request, CHAT_MESSAGE, "", 0, text, len);
+        if(u->chat.fd < 0 || load_write(&u->chat, request, frame_len) < 0) {
+            t->skipped++;
+            return;
+        }
+    } else {
+        // One post in flight per user, as a browser would
+        if(u->post.fd < 0 || u->post_started) {
+            t->skipped++;
+            return;
+        }
+        char body[CHAT_MAX_TEXT + 64];
+        int body_len = snprintf(body, sizeof(body), "username=load%d&message=%.*s", u->id, len, text);
+        int request_len = snprintf(request, sizeof(request),
+                                   "POST /send?room=%s HTTP/1.1\r\nHost: %s\r\n"
+                                   "Content-Type: application/x-www-form-urlencoded\r\n"
+                                   "Content-Length: %d\r\n\r\n%s",
+                                   u->room, server_host, body_len, body);
+        if(load_write(&u->post, request, request_len) < 0) {
+            t->skipped++;
+            return;
+        }
+        u->post_started = now;
+    }
+    t->sent++;
+}
+
+// Record the fan-out latency of one delivered message if it carries a load timestamp sent after the join
+void load_record(load_thread_t *t, load_user_t *u, const char *text, size_t len, uint64_t now) {
+    char stamp[32];
+    unsigned long long sent_at;
+    if(len < 4 || memcmp(text, "LT ", 3) != 0) {
+        return;
+    }
+    snprintf(stamp, sizeof(stamp), "%.*s", (int)(len - 3 < sizeof(stamp) - 1 ? len - 3 : sizeof(stamp) - 1), text + 3);
+    if(sscanf(stamp, "%llu", &sent_at) == 1 && sent_at >= u->joined_at && sent_at <= now) {
+        metrics_record(&t->latency, now - sent_at);
+        t->delivered++;
+    }
+}
+
+// Read chat-server frames for a user; -1 when the connection is gone
+int load_read_frames(load_thread_t *t, load_user_t *u) {
+    chat_frame_t frame;
+    while(1) {
+        size_t room;
+        char *into = chat_decoder_room(&u->decoder, &room);
+        ssize_t n = recv(u->chat.fd, into, room, 0);
+        if(n == 0) {
+            return -1;
+        }
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        u->decoder.end += n;
+        
+        uint64_t now = metrics_now();
+        int status;
+        while((status = chat_decode(&u->decoder, &frame)) > 0) {
+            if(frame.type == CHAT_MESSAGE) {
+                chat_frame_seq(&frame);
+                load_record(t, u, frame.text, frame.text_len, now);
+            }
+        }
+        if(status < 0) {
+            return -1;
+        }
+    }
+}
+
+// Value of a response header, or NULL; head is NUL-terminated at its blank line
+const char *load_header(const char *head, const char *name) {
+    const char *line = strstr(head, name);
+    return line ? line + strlen(name) : NULL;
+}
+
+// Act on one complete web server response: a long-poll reply is scanned for timestamps
+// and the next poll goes out, a post reply closes the post's round trip
+int load_response(load_thread_t *t, load_user_t *u, int tag, char *head, char *body, size_t body_len) {
+    uint64_t now = metrics_now();
+    if(strncmp(head, "HTTP/1.1 200", 12) != 0) {
+        t->failures++;
+    }
+    if(tag == 1) {
+        if(u->post_started) {
+            metrics_record(&t->post_latency, now - u->post_started);
+            u->post_started = 0;
+        }
+        return 0;
+    }
     
-    // Set server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8080);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    const char *last_seq = load_header(head, "X-Last-Seq: ");
+    if(last_seq) {
+        u->since = strtoul(last_seq, NULL, 10);
+    }
+    // A reset restates the whole window, messages this user already counted included, and the HTML
+    // carries no sequence numbers to tell them apart; counting none keeps delivered and latency honest
+    const char *reset = load_header(head, "X-History-Reset: ");
+    if(reset && *reset == '1') {
+        t->resets++;
+        return load_poll(u);
+    }
+    const char *marker = "<span class='text'>";
+    size_t marker_len = strlen(marker);
+    char *end = body + body_len;
+    for(char *p = body; (p = memmem(p, end - p, marker, marker_len)) != NULL; ) {
+        p += marker_len;
+        char *close = memchr(p, '<', end - p);
+        load_record(t, u, p, (close ? close : end) - p, now);
+    }
+    return load_poll(u);
+}
+
+// Read web server responses on one of a user's sockets; -1 when the connection is gone
+int load_read_http(load_thread_t *t, load_user_t *u, int tag) {
+    load_conn_t *conn = tag ? &u->post : &u->chat;
+    while(1) {
+        if(conn->in_cap - conn->in_len < 4096) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : 16384;
+            char *grown = realloc(conn->in, cap);
+            if(grown == NULL) {
+                return -1;
+            }
+            conn->in = grown;
+            conn->in_cap = cap;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len - 1, 0);
+        if(n == 0) {
+            return -1;
+        }
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->in_len += n;
+        conn->in[conn->in_len] = '\0';
+        
+        // Handle every complete response; a partial one waits for more bytes
+        while(1) {
+            char *blank = strstr(conn->in, "\r\n\r\n");
+            if(blank == NULL) {
+                break;
+            }
+            *blank = '\0';
+            const char *length = load_header(conn->in, "Content-Length: ");
+            size_t head_len = blank + 4 - conn->in;
+            size_t body_len = length ? strtoul(length, NULL, 10) : 0;
+            if(conn->in_len < head_len + body_len) {
+                *blank = '\r';
+                break;
+            }
+            if(load_response(t, u, tag, conn->in, conn->in + head_len, body_len) < 0) {
+                return -1;
+            }
+            memmove(conn->in, conn->in + head_len + body_len, conn->in_len - head_len - body_len + 1);
+            conn->in_len -= head_len + body_len;
+        }
+    }
+}
+
+// Web server sockets close after a keep-alive limit; reopen the one that went, resuming where it was
+void load_reopen_http(load_thread_t *t, load_user_t *u, int index, int tag) {
+    load_conn_t *conn = tag ? &u->post : &u->chat;
+    load_close_conn(conn);
+    if(tag) {
+        u->post_started = 0;
+    }
+    if(load_open_conn(t, conn, index, tag) == 0 && !tag) {
+        load_poll(u);
+    }
+}
+
+// Drive one thread's users until the run ends: send on schedule, churn, and read everything that arrives
+void *load_thread(void *arg) {
+    load_thread_t *t = arg;
+    struct epoll_event events[MAX_LOAD_EVENTS];
+    double interval = load_rate > 0 ? 1e9 / load_rate : 0;
+    double churn_per_ns = load_churn / load_threads / 1e9;
+    double churn_due = 0;
+    
+    for(int i = 0; i < t->count; i++) {
+        load_join(t, &t->users[i], i);
+    }
+    pthread_barrier_wait(&load_ready);
+    
+    // Spread first sends over one interval so users do not fire in lockstep
+    uint64_t start = metrics_now();
+    uint64_t stop_sending = start + (uint64_t)(load_duration * 1e9);
+    uint64_t stop = stop_sending + LOAD_DRAIN_NS;
+    for(int i = 0; i < t->count; i++) {
+        t->users[i].next_send = start + (uint64_t)(interval * rand_r(&t->seed) / RAND_MAX);
+    }
+    
+    uint64_t last = start;
+    while(1) {
+        uint64_t now = metrics_now();
+        if(now >= stop) {
+            break;
+        }
+        
+        for(int i = 0; i < t->count && interval > 0 && now < stop_sending; i++) {
+            load_user_t *u = &t->users[i];
+            if(now >= u->next_send) {
+                load_send(t, u, now);
+                u->next_send += (uint64_t)interval;
+                if(u->next_send < now) {
+                    u->next_send = now + (uint64_t)interval;
+                }
+            }
+        }
+        
+        churn_due += (now - last) * churn_per_ns;
+        last = now;
+        while(churn_due >= 1 && now < stop_sending) {
+            int i = rand_r(&t->seed) % t->count;
+            load_rejoin(t, &t->users[i], i);
+            t->reconnects++;
+            churn_due -= 1;
+        }
+        
+        int n = epoll_wait(t->epoll_fd, events, MAX_LOAD_EVENTS, LOAD_TICK_MS);
+        for(int e = 0; e < n; e++) {
+            int i = events[e].data.u64 >> 1;
+            int tag = events[e].data.u64 & 1;
+            load_user_t *u = &t->users[i];
+            load_conn_t *conn = tag ? &u->post : &u->chat;
+            if(conn->fd < 0) {
+                continue;
+            }
+            
+            int failed = load_flush(conn) < 0;
+            if(!failed && (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                failed = (load_mode == LOAD_TCP ? load_read_frames(t, u) : load_read_http(t, u, tag)) < 0;
+            }
+            if(failed && load_mode == LOAD_TCP) {
+                t->failures++;
+                load_rejoin(t, u, i);
+            } else if(failed) {
+                load_reopen_http(t, u, i, tag);
+            }
+        }
+    }
     
-    // Connect to server
-    if(connect(socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        printf("Connection failed.\n");
+    for(int i = 0; i < t->count; i++) {
+        load_close_conn(&t->users[i].chat);
+        load_close_conn(&t->users[i].post);
+        free(t->users[i].chat.in);
+        free(t->users[i].post.in);
+    }
+    close(t->epoll_fd);
+    return NULL;
+}
+
+// Print one latency snapshot as a JSON object in microseconds
+void print_latency_json(const char *name, metrics_histogram_t *hist) {
+    uint64_t count = atomic_load(&hist->count);
+    printf("  \"%s\": {\"count\": %llu, \"avg\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+           name, (unsigned long long)count, count ? atomic_load(&hist->sum) / 1e3 / count : 0.0,
+           metrics_quantile(hist, 0.5) / 1e3, metrics_quantile(hist, 0.99) / 1e3,
+           metrics_quantile(hist, 0.999) / 1e3, atomic_load(&hist->max) / 1e3);
+}
+
+// Run the load test and print its results as JSON on stdout; progress goes to stderr
+int run_load() {
+    static load_thread_t threads[MAX_LOAD_THREADS];
+    static metrics_histogram_t latency, post_latency;
+    uint64_t sent = 0, skipped = 0, delivered = 0, resets = 0, connects = 0, reconnects = 0, failures = 0;
+    int rooms = (load_users + load_room_size - 1) / load_room_size;
+    
+    raise_fd_limit(load_mode == LOAD_HTTP ? load_users * 2 : load_users);
+    load_user_t *users = calloc(load_users, sizeof(load_user_t));
+    if(users == NULL) {
+        fprintf(stderr, "Out of memory for %d users.\n", load_users);
         return -1;
     }
+    for(int i = 0; i < load_users; i++) {
+        users[i].id = i;
+        users[i].chat.fd = users[i].post.fd = -1;
+        snprintf(users[i].room, sizeof(users[i].room), "load-%d", i / load_room_size);
+    }
     
-    printf("Connected to chat server!\n");
+    fprintf(stderr, "Connecting %d users in %d rooms to %s:%d from %d threads...\n",
+            load_users, rooms, server_host, server_port, load_threads);
+    pthread_barrier_init(&load_ready, NULL, load_threads + 1);
+    for(int i = 0; i < load_threads; i++) {
+        load_thread_t *t = &threads[i];
+        t->users = users + (size_t)load_users * i / load_threads;
+        t->count = (size_t)load_users * (i + 1) / load_threads - (size_t)load_users * i / load_threads;
+        t->seed = i * 7919 + 1;
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(t->epoll_fd < 0 || pthread_create(&t->thread, NULL, load_thread, t) != 0) {
+            fprintf(stderr, "Could not start load thread %d.\n", i);
+            return -1;
+        }
+    }
+    pthread_barrier_wait(&load_ready);
+    fprintf(stderr, "Running for %.1f seconds...\n", load_duration);
     
-    // Get username
-    printf("Enter your name: ");
-    fgets(name, sizeof(name), stdin);
-    name[strcspn(name, "\n")] = 0; // Remove newline
+    for(int i = 0; i < load_threads; i++) {
+        load_thread_t *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        sent += t->sent;
+        skipped += t->skipped;
+        delivered += t->delivered;
+        resets += t->resets;
+        connects += t->connects;
+        reconnects += t->reconnects;
+        failures += t->failures;
+        metrics_merge(&latency, &t->latency);
+        metrics_merge(&post_latency, &t->post_latency);
+    }
     
-    // Send name to server
-    send(socket_fd, name, strlen(name), 0);
+    printf("{\n");
+    printf("  \"target\": \"%s\",\n  \"server\": \"%s:%d\",\n", load_mode == LOAD_TCP ? "tcp" : "http",
+           server_host, server_port);
+    printf("  \"users\": %d,\n  \"rooms\": %d,\n  \"threads\": %d,\n  \"duration\": %.1f,\n",
+           load_users, rooms, load_threads, load_duration);
+    printf("  \"rate_per_user\": %g,\n  \"churn_per_second\": %g,\n  \"message_size\": %d,\n",
+           load_rate, load_churn, load_message_size);
+    printf("  \"connects\": %llu,\n  \"reconnects\": %llu,\n  \"failures\": %llu,\n",
+           (unsigned long long)connects, (unsigned long long)reconnects, (unsigned long long)failures);
+    printf("  \"sent\": %llu,\n  \"skipped\": %llu,\n  \"delivered\": %llu,\n",
+           (unsigned long long)sent, (unsigned long long)skipped, (unsigned long long)delivered);
+    printf("  \"sent_per_second\": %.1f,\n  \"delivered_per_second\": %.1f,\n",
+           sent / load_duration, delivered / load_duration);
+    if(load_mode == LOAD_HTTP) {
+        printf("  \"history_resets\": %llu,\n", (unsigned long long)resets);
+    }
+    print_latency_json("fanout_latency_us", &latency);
+    if(load_mode == LOAD_HTTP) {
+        printf(",\n");
+        print_latency_json("post_latency_us", &post_latency);
+    }
+    printf("\n}\n");
+    free(users);
+    return 0;
+}
+
+// Interactive client: one server connection, reopened with backoff whenever it drops
+// and rejoined after the last room message seen so only the gap is replayed
+typedef struct {
+    int epoll_fd;
+    int fd;                             // -1 while waiting to reconnect
+    int connecting;                     // the non-blocking connect() has not finished
+    int watching_out;                   // EPOLLOUT is in the socket's interest set
+    int ever_connected;
+    int resuming;                       // a resume JOIN went out; its CHAT_HISTORY header is still due
+    chat_decoder_t decoder;
+    char out[SEND_BATCH + CHAT_MAX_FRAME];  // frames not yet written; whole ones survive a reconnect
+    size_t out_len;
+    size_t out_sent;                    // bytes of out already written
+    char input[INPUT_SIZE];             // stdin bytes not yet making a whole line
+    size_t have;
+    char name[CHAT_MAX_NAME + 1];
+    int named;                          // the first input line, the name, has been read
+    char room[CHAT_MAX_NAME + 1];       // room the server last confirmed, empty before that
+    unsigned long last_seq;             // newest message of that room seen
+    unsigned long epoch;                // server run the sequence numbers belong to
+    int backoff_ms;
+    uint64_t retry_at;                  // when to reconnect while fd is -1
+} chat_client_t;
+
+// Size of the whole frame starting at data
+size_t frame_size(const char *data) {
+    const unsigned char *p = (const unsigned char*)data;
+    return CHAT_FRAME_HEADER + ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+}
+
+// Watch the socket for reads, and for writes while frames wait to go out
+void client_watch(chat_client_t *cl, int op) {
+    struct epoll_event ev;
+    int want_out = cl->connecting || cl->out_sent < cl->out_len;
+    if(op == EPOLL_CTL_MOD && want_out == cl->watching_out) {
+        return;
+    }
+    cl->watching_out = want_out;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+    ev.data.u64 = 1;
+    epoll_ctl(cl->epoll_fd, op, cl->fd, &ev);
+}
+
+// Start a non-blocking connect; a failure right away is handled like a dropped connection
+void client_connect(chat_client_t *cl) {
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    addr.sin_addr.s_addr = inet_addr(server_host);
     
-    printf("Welcome to the chat, %s!\n", name);
-    printf("Type 'exit' to quit.\n\n");
+    cl->retry_at = 0;
+    cl->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(cl->fd < 0) {
+        return;
+    }
+    if(connect(cl->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(cl->fd);
+        cl->fd = -1;
+        return;
+    }
+    cl->connecting = 1;
+    cl->decoder.start = cl->decoder.end = 0;
+    client_watch(cl, EPOLL_CTL_ADD);
+}
+
+// Close the connection and schedule the next attempt after a jittered, doubling delay,
+// so clients dropped together by a restarting server do not all return at once.
+// A frame cut off mid-write is discarded; whole unsent ones go out after the reconnect.
+void client_drop(chat_client_t *cl, const char *why) {
+    if(cl->fd >= 0) {
+        close(cl->fd);
+        cl->fd = -1;
+    }
+    size_t keep = 0;
+    while(keep < cl->out_sent) {
+        keep += frame_size(cl->out + keep);
+    }
+    memmove(cl->out, cl->out + keep, cl->out_len - keep);
+    cl->out_len -= keep;
+    cl->out_sent = 0;
+    cl->connecting = 0;
     
-    // Start receive thread
-    if(pthread_create(&receive_thread, NULL, receive_messages, NULL) != 0) {
-        printf("Error creating receive thread.\n");
+    int delay = cl->backoff_ms / 2 + rand() % (cl->backoff_ms / 2 + 1);
+    cl->retry_at = metrics_now() + (uint64_t)delay * 1000000;
+    cl->backoff_ms = cl->backoff_ms * 2 < RECONNECT_MAX_MS ? cl->backoff_ms * 2 : RECONNECT_MAX_MS;
+    printf("%s Reconnecting in %.1f s...\n", why, delay / 1000.0);
+    fflush(stdout);
+}
+
+// Write what is pending; -1 when the connection failed
+int client_flush(chat_client_t *cl) {
+    while(cl->out_sent < cl->out_len) {
+        ssize_t n = send(cl->fd, cl->out + cl->out_sent, cl->out_len - cl->out_sent, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        cl->out_sent += n;
+    }
+    
+    // Keep the buffer from the first frame not wholly written
+    size_t whole = 0;
+    while(whole < cl->out_len && whole + frame_size(cl->out + whole) <= cl->out_sent) {
+        whole += frame_size(cl->out + whole);
+    }
+    memmove(cl->out, cl->out + whole, cl->out_len - whole);
+    cl->out_len -= whole;
+    cl->out_sent -= whole;
+    client_watch(cl, EPOLL_CTL_MOD);
+    return 0;
+}
+
+// Queue frames behind what is pending, sending them now when connected; -1 when they do not fit
+int client_send(chat_client_t *cl, const char *data, size_t len) {
+    if(cl->out_len + len > SEND_BATCH) {
+        printf("Not sent: too much is still waiting for the server.\n");
         return -1;
     }
+    memcpy(cl->out + cl->out_len, data, len);
+    cl->out_len += len;
+    if(cl->fd >= 0 && !cl->connecting && client_flush(cl) < 0) {
+        client_drop(cl, "Connection lost.");
+    }
+    return 0;
+}
+
+// Put the JOIN in front of anything queued while disconnected; after a reconnect it names the room
+// and the last sequence number seen there, so the server replays only what was missed
+void client_join(chat_client_t *cl) {
+    char text[CHAT_MAX_NAME + 48];
+    char frame[CHAT_MAX_FRAME];
+    int len = 0;
+    if(cl->room[0]) {
+        len = snprintf(text, sizeof(text), "%s %lu %lu", cl->room, cl->last_seq, cl->epoch);
+        cl->resuming = cl->last_seq > 0;
+    }
+    size_t frame_len = chat_encode(frame, CHAT_JOIN, cl->name, strlen(cl->name), text, len);
+    memmove(cl->out + frame_len, cl->out, cl->out_len);
+    memcpy(cl->out, frame, frame_len);
+    cl->out_len += frame_len;
+    if(client_flush(cl) < 0) {
+        client_drop(cl, "Connection lost.");
+    }
+}
+
+// Track and print one frame from the server
+void client_frame(chat_client_t *cl, chat_frame_t *frame) {
+    char text[64];
+    int name_len = frame->name_len;
     
-    // Main loop for sending messages
+    if(frame->type == CHAT_MESSAGE) {
+        unsigned long seq = chat_frame_seq(frame);
+        if(seq > cl->last_seq) {
+            cl->last_seq = seq;
+        }
+    } else if(frame->type == CHAT_ROOM) {
+        // A new room or a restarted server starts the count over; the replay that follows sets it
+        unsigned long seq = 0, epoch = 0;
+        snprintf(text, sizeof(text), "%.*s", (int)frame->text_len, frame->text);
+        sscanf(text, "%lu %lu", &seq, &epoch);
+        int same = strlen(cl->room) == frame->name_len && memcmp(cl->room, frame->name, frame->name_len) == 0;
+        if(!same || epoch != cl->epoch) {
+            cl->last_seq = 0;
+            cl->resuming = 0;
+        }
+        cl->epoch = epoch;
+        cl->backoff_ms = RECONNECT_MIN_MS;
+        snprintf(cl->room, sizeof(cl->room), "%.*s", name_len, frame->name);
+        if(same) {
+            printf("Back in #%s.\n", cl->room);
+            return;
+        }
+    } else if(frame->type == CHAT_HISTORY && cl->resuming) {
+        unsigned long first = 0, last = 0;
+        snprintf(text, sizeof(text), "%.*s", (int)frame->text_len, frame->text);
+        sscanf(text, "%lu %lu", &first, &last);
+        if(first > cl->last_seq + 1) {
+            printf("--- %lu messages in #%s are no longer kept ---\n", first - cl->last_seq - 1, cl->room);
+        }
+        if(first != 0) {
+            printf("--- Missed in #%s while away ---\n", cl->room);
+        }
+        cl->resuming = 0;
+        return;
+    }
+    print_frame(frame);
+}
+
+// Read and print what the server sent; -1 when the connection is gone
+int client_read(chat_client_t *cl) {
+    chat_frame_t frame;
     while(1) {
-        fgets(message, BUFFER_SIZE, stdin);
-        message[strcspn(message, "\n")] = 0; // Remove newline
+        size_t room;
+        char *into = chat_decoder_room(&cl->decoder, &room);
+        ssize_t n = recv(cl->fd, into, room, 0);
+        if(n == 0) {
+            return -1;
+        }
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        cl->decoder.end += n;
+        
+        // Print every complete frame; a partial one waits for the next recv
+        int status;
+        while((status = chat_decode(&cl->decoder, &frame)) > 0) {
+            client_frame(cl, &frame);
+        }
+        fflush(stdout);
+        if(status < 0) {
+            printf("Malformed frame from server.\n");
+            return -1;
+        }
+    }
+}
+
+// Handle readiness of the server socket
+void client_event(chat_client_t *cl, uint32_t events) {
+    if(cl->connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(cl->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if(error != 0) {
+            client_drop(cl, cl->ever_connected ? "Reconnect failed." : "Connection failed.");
+            return;
+        }
+        if(!(events & EPOLLOUT)) {
+            return;
+        }
+        int one = 1;
+        setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        cl->connecting = 0;
+        printf(cl->ever_connected ? "Reconnected to chat server.\n" : "Connected to chat server!\n");
+        fflush(stdout);
+        cl->ever_connected = 1;
+        if(cl->named) {
+            client_join(cl);
+        } else {
+            client_watch(cl, EPOLL_CTL_MOD);
+        }
+        return;
+    }
+    if((events & EPOLLOUT) && client_flush(cl) < 0) {
+        client_drop(cl, "Connection lost.");
+        return;
+    }
+    if((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && client_read(cl) < 0) {
+        client_drop(cl, "Server disconnected.");
+    }
+}
+
+// Turn the complete lines read from stdin into frames; the first line is the name.
+// Stdin is read raw so pasted or piped lines go out in one write. Returns 1 on "exit" or end of input.
+int client_input(chat_client_t *cl) {
+    static char batch[SEND_BATCH];
+    int done = 0;
+    
+    ssize_t n = read(STDIN_FILENO, cl->input + cl->have, sizeof(cl->input) - cl->have);
+    if(n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if(n <= 0) {
+        // End of input: finish an unterminated last line, then stop
+        if(cl->have == 0 || cl->have == sizeof(cl->input)) {
+            return 1;
+        }
+        cl->input[cl->have] = '\n';
+        n = 1;
+        done = 1;
+    }
+    cl->have += n;
+    
+    size_t used = 0;
+    size_t batch_len = 0;
+    while(used < cl->have) {
+        char *line = cl->input + used;
+        char *newline = memchr(line, '\n', cl->have - used);
+        size_t len;
+        if(newline) {
+            len = newline - line;
+        } else if(used == 0 && cl->have == sizeof(cl->input)) {
+            len = cl->have;     // no newline in a full buffer; send what is there
+        } else {
+            break;
+        }
+        used += newline ? len + 1 : len;
+        if(len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
         
-        if(strcmp(message, "exit") == 0) {
+        // Queue first if this line's frames might not fit behind what is batched
+        size_t need = len + (len / CHAT_MAX_TEXT + 1) * (CHAT_FRAME_HEADER + CHAT_MAX_NAME);
+        if(batch_len + need > sizeof(batch)) {
+            client_send(cl, batch, batch_len);
+            batch_len = 0;
+        }
+        
+        // The first line is the name; the JOIN goes out as soon as the connection is up
+        if(!cl->named) {
+            snprintf(cl->name, sizeof(cl->name), "%.*s", (int)len, line);
+            cl->named = 1;
+            
+            printf("Welcome to the chat, %s!\n", cl->name);
+            printf("Type 'exit' to quit, '/dm <name> <message>' for a direct message, "
+                   "'/join <room>' to change rooms, '/history [before] [limit]' for older messages.\n\n");
+            fflush(stdout);
+            if(cl->fd >= 0 && !cl->connecting) {
+                client_join(cl);
+            }
+            continue;
+        }
+        
+        if(len == 4 && strncmp(line, "exit", 4) == 0) {
+            batch_len += chat_encode(batch + batch_len, CHAT_LEAVE, "", 0, "", 0);
+            done = 1;
+            used = cl->have;
             break;
         }
         
-        if(strlen(message) > 0) {
-            send(socket_fd, message, strlen(message), 0);
+        if(len > 0) {
+            batch_len = encode_line(batch, batch_len, line, len);
         }
     }
     
-    close(socket_fd);
+    if(batch_len > 0) {
+        client_send(cl, batch, batch_len);
+    }
+    memmove(cl->input, cl->input + used, cl->have - used);
+    cl->have -= used;
+    return done;
+}
+
+// Run the interactive client until "exit" or end of input, reconnecting whenever the server goes away
+int run_client() {
+    static chat_client_t client;
+    chat_client_t *cl = &client;
+    struct epoll_event events[8];
+    int done = 0;
+    
+    cl->backoff_ms = RECONNECT_MIN_MS;
+    srand(metrics_now() ^ getpid());
+    cl->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(cl->epoll_fd < 0) {
+        printf("Error creating epoll instance.\n");
+        return -1;
+    }
+    
+    // Regular files cannot be watched; they are always readable, so read them every pass
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+    int stdin_watched = epoll_ctl(cl->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    
+    client_connect(cl);
+    if(cl->fd < 0) {
+        client_drop(cl, "Connection failed.");
+    }
+    printf("Enter your name: ");
+    fflush(stdout);
+    
+    // After "exit" or end of input, stay only until what is queued has gone out
+    while(!done || (cl->fd >= 0 && (cl->connecting || cl->out_len > 0))) {
+        int timeout = -1;
+        if(!done && !stdin_watched) {
+            timeout = 0;
+        } else if(cl->fd < 0) {
+            uint64_t now = metrics_now();
+            timeout = cl->retry_at > now ? (int)((cl->retry_at - now + 999999) / 1000000) : 0;
+        }
+        
+        int n = epoll_wait(cl->epoll_fd, events, 8, timeout);
+        if(n < 0 && errno != EINTR) {
+            printf("Error waiting for events.\n");
+            break;
+        }
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.u64 == 0) {
+                if(!done && client_input(cl)) {
+                    done = 1;
+                    epoll_ctl(cl->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                }
+            } else if(cl->fd >= 0) {
+                client_event(cl, events[i].events);
+            }
+        }
+        if(!done && !stdin_watched) {
+            done = client_input(cl);
+        }
+        if(done && cl->fd < 0) {
+            break;
+        }
+        if(cl->fd < 0 && metrics_now() >= cl->retry_at) {
+            client_connect(cl);
+            if(cl->fd < 0) {
+                client_drop(cl, "Reconnect failed.");
+            }
+        }
+    }
+    
+    if(cl->fd >= 0) {
+        close(cl->fd);
+    }
+    close(cl->epoll_fd);
     return 0;
 }
+
+int main(int argc, char *argv[]) {
+    int load = 0;
+    
+    // Parse command line options; --load switches from the interactive client to the load generator
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            server_host = argv[++i];
+        } else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--load") == 0 && i + 1 < argc &&
+                  (strcmp(argv[i + 1], "tcp") == 0 || strcmp(argv[i + 1], "http") == 0)) {
+            load_mode = strcmp(argv[++i], "tcp") == 0 ? LOAD_TCP : LOAD_HTTP;
+            load = 1;
+        } else if(strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+            load_users = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            load_threads = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--room-size") == 0 && i + 1 < argc) {
+            load_room_size = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            load_rate = atof(argv[++i]);
+        } else if(strcmp(argv[i], "--churn") == 0 && i + 1 < argc) {
+            load_churn = atof(argv[++i]);
+        } else if(strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            load_duration = atof(argv[++i]);
+        } else if(strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            load_message_size = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--host <ip>] [--port <port>]\n"
+                   "       %s --load tcp|http [--users <n>] [--threads <n>] [--room-size <users>] "
+                   "[--rate <messages/s per user>] [--churn <reconnects/s>] [--duration <seconds>] "
+                   "[--size <bytes>]\n", argv[0], argv[0]);
+            return -1;
+        }
+    }
+    if(load) {
+        if(load_users < 1 || load_room_size < 1 || load_threads < 1 || load_threads > MAX_LOAD_THREADS ||
+           load_threads > load_users || load_rate < 0 || load_churn < 0 || load_duration <= 0) {
+            printf("Load options out of range: at least one user per thread and room, 1-%d threads.\n",
+                   MAX_LOAD_THREADS);
+            return -1;
+        }
+        return run_load();
+    }
+    
+    return run_client();
+}
@@ -0,0 +1,207 @@
+// metrics.h - Lock-free counters and log-linear latency histograms shared by the servers and client.c
+#ifndef METRICS_H
+#define METRICS_H
+
+#include<stdarg.h>
+#include<stdatomic.h>
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<pthread.h>
+#include<time.h>
+
+// Each power of two is split into METRICS_SUB_BUCKETS linear buckets, so a recorded
+// duration is known to within 1/8 of its value; anything past 2^METRICS_MAX_SHIFT ns lands in the last bucket
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_SHIFT 36                 // about 69 seconds
+#define METRICS_BUCKETS ((METRICS_MAX_SHIFT - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_EXPORT_FROM 10               // smallest exported bucket bound is 2^10 ns, about 1us
+
+// Durations in nanoseconds. Each thread records into its own copy, so the atomics never contend
+// and readers merging them see every bucket as a plain relaxed load.
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+// Growable text buffer the exporters print into
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} metrics_text_t;
+
+// Monotonic clock in nanoseconds
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Bucket holding ns: values below METRICS_SUB_BUCKETS get one each, then 8 per power of two
+static inline int metrics_bucket(uint64_t ns) {
+    if(ns < METRICS_SUB_BUCKETS) {
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns);
+    if(shift > METRICS_MAX_SHIFT) {
+        return METRICS_BUCKETS - 1;
+    }
+    int sub = (ns >> (shift - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (shift - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+// One past the largest value bucket holds
+static inline uint64_t metrics_bucket_limit(int bucket) {
+    if(bucket < METRICS_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+    int shift = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub + 1) << (shift - METRICS_SUB_BITS);
+}
+
+// Bump a counter in the calling thread's slot
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// Record one duration in the calling thread's histogram
+static inline void metrics_record(metrics_histogram_t *hist, uint64_t ns) {
+    atomic_fetch_add_explicit(&hist->buckets[metrics_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, ns, memory_order_relaxed);
+    if(ns > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, ns, memory_order_relaxed);
+    }
+}
+
+// Record the time since start; returns now so consecutive phases can chain
+static inline uint64_t metrics_since(metrics_histogram_t *hist, uint64_t start) {
+    uint64_t now = metrics_now();
+    metrics_record(hist, now - start);
+    return now;
+}
+
+// Lock a mutex, recording how long it took to get; returns when it was taken, for metrics_unlock.
+// An uncontended lock costs one clock read on top of the trylock.
+static inline uint64_t metrics_lock(pthread_mutex_t *mutex, metrics_histogram_t *wait) {
+    uint64_t start = metrics_now();
+    if(pthread_mutex_trylock(mutex) == 0) {
+        metrics_record(wait, 0);
+        return start;
+    }
+    pthread_mutex_lock(mutex);
+    return metrics_since(wait, start);
+}
+
+// Unlock a mutex taken with metrics_lock, recording how long it was held
+static inline void metrics_unlock(pthread_mutex_t *mutex, metrics_histogram_t *hold, uint64_t locked_at) {
+    pthread_mutex_unlock(mutex);
+    metrics_since(hold, locked_at);
+}
+
+// Add one thread's histogram into a snapshot
+static inline void metrics_merge(metrics_histogram_t *into, metrics_histogram_t *from) {
+    for(int i = 0; i < METRICS_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&from->buckets[i], memory_order_relaxed);
+        atomic_store_explicit(&into->buckets[i], atomic_load_explicit(&into->buckets[i], memory_order_relaxed) + n,
+                              memory_order_relaxed);
+    }
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    atomic_store_explicit(&into->count, atomic_load_explicit(&into->count, memory_order_relaxed) +
+                          atomic_load_explicit(&from->count, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&into->sum, atomic_load_explicit(&into->sum, memory_order_relaxed) +
+                          atomic_load_explicit(&from->sum, memory_order_relaxed), memory_order_relaxed);
+    if(max > atomic_load_explicit(&into->max, memory_order_relaxed)) {
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+    }
+}
+
+// Upper bound of the bucket holding quantile q (0..1) of a snapshot; 0 when it is empty
+static inline uint64_t metrics_quantile(metrics_histogram_t *hist, double q) {
+    uint64_t total = 0;
+    for(int i = 0; i < METRICS_BUCKETS; i++) {
+        total += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    }
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    uint64_t seen = 0;
+    for(int i = 0; i < METRICS_BUCKETS && total > 0; i++) {
+        seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        if(seen >= rank && seen > 0) {
+            uint64_t limit = metrics_bucket_limit(i) - 1;
+            uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+            return limit < max ? limit : max;
+        }
+    }
+    return 0;
+}
+
+// Append printf-style text, growing the buffer; a failed allocation truncates the output
+static inline void metrics_printf(metrics_text_t *text, const char *format, ...) {
+    va_list args;
+    while(1) {
+        size_t room = text->cap - text->len;
+        va_start(args, format);
+        int n = vsnprintf(text->data ? text->data + text->len : NULL, room, format, args);
+        va_end(args);
+        if(n < 0) {
+            return;
+        }
+        if((size_t)n < room) {
+            text->len += n;
+            return;
+        }
+        size_t cap = text->cap ? text->cap * 2 : 16384;
+        while(cap - text->len <= (size_t)n) {
+            cap *= 2;
+        }
+        char *grown = realloc(text->data, cap);
+        if(grown == NULL) {
+            return;
+        }
+        text->data = grown;
+        text->cap = cap;
+    }
+}
+
+// Print a snapshot as one labelled series of a Prometheus histogram, in seconds.
+// Buckets are exported at powers of two, which always fall on internal bucket edges.
+static inline void metrics_print_prometheus(metrics_text_t *text, const char *name, const char *labels,
+                                            metrics_histogram_t *hist) {
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for(int shift = METRICS_EXPORT_FROM; shift <= METRICS_MAX_SHIFT; shift++) {
+        uint64_t bound = 1ULL << shift;
+        while(bucket < METRICS_BUCKETS - 1 && metrics_bucket_limit(bucket) <= bound) {
+            cumulative += atomic_load_explicit(&hist->buckets[bucket++], memory_order_relaxed);
+        }
+        metrics_printf(text, "%s_bucket{%s,le=\"%.12g\"} %llu\n", name, labels, bound / 1e9,
+                       (unsigned long long)cumulative);
+    }
+    
+    // Count from the buckets too, so the series stays monotonic while other threads record
+    while(bucket < METRICS_BUCKETS) {
+        cumulative += atomic_load_explicit(&hist->buckets[bucket++], memory_order_relaxed);
+    }
+    metrics_printf(text, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+    metrics_printf(text, "%s_sum{%s} %.9f\n", name, labels,
+                   atomic_load_explicit(&hist->sum, memory_order_relaxed) / 1e9);
+    metrics_printf(text, "%s_count{%s} %llu\n", name, labels, (unsigned long long)cumulative);
+}
+
+// Print a snapshot as one human-readable line of percentiles in microseconds
+static inline void metrics_print_summary(metrics_text_t *text, const char *label, metrics_histogram_t *hist) {
+    uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&hist->sum, memory_order_relaxed);
+    metrics_printf(text, "%-16s %10llu  avg %9.1f  p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+                   label, (unsigned long long)count, count ? sum / 1e3 / count : 0.0,
+                   metrics_quantile(hist, 0.5) / 1e3, metrics_quantile(hist, 0.99) / 1e3,
+                   metrics_quantile(hist, 0.999) / 1e3,
+                   atomic_load_explicit(&hist->max, memory_order_relaxed) / 1e3);
+}
+
+#endif
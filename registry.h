@@ -0,0 +1,131 @@
+// registry.h - Client registry shared by chat-server.c and web-server.c: generation-checked ids, O(1) removal
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include<stdlib.h>
+
+#define REGISTRY_SLOT_BITS 17         // a client id is (generation << REGISTRY_SLOT_BITS) | slot
+#define REGISTRY_MAX_SLOTS (1 << REGISTRY_SLOT_BITS)
+#define REGISTRY_GENERATIONS (1 << (31 - REGISTRY_SLOT_BITS))
+
+// Each server defines its own struct client; the registry only stores pointers to it
+struct client;
+
+// One registry slot; releasing it bumps the generation so the old id stops matching
+typedef struct {
+    struct client *client;          // NULL while the slot is free
+    int generation;
+    int dense_index;                // position of client in dense
+    int next_free;                  // next slot on the free list, -1 at the tail
+} registry_slot_t;
+
+// Connected clients: slots give O(1) lookup by id, dense packs them for iteration.
+// Nothing here locks; every call, and every read of count or dense, is under the owner's mutex.
+typedef struct {
+    registry_slot_t *slots;
+    struct client **dense;          // sized with slots; count never exceeds slot_count
+    int *dense_slot;                // slot of each dense entry, so removal never looks inside a client
+    int slot_count;                 // slots handed out so far
+    int slot_capacity;
+    int free_head;                  // released slots are reused oldest first
+    int free_tail;
+    int count;
+    int limit;
+} client_registry_t;
+
+#define REGISTRY_INITIALIZER(max) { .free_head = -1, .free_tail = -1, .limit = (max) }
+
+// Double the slot and dense arrays, up to the limit
+static inline int registry_grow(client_registry_t *reg) {
+    int capacity = reg->slot_capacity ? reg->slot_capacity * 2 : 64;
+    if(capacity > reg->limit) {
+        capacity = reg->limit;
+    }
+    
+    registry_slot_t *slots = realloc(reg->slots, capacity * sizeof(registry_slot_t));
+    if(slots == NULL) {
+        return -1;
+    }
+    reg->slots = slots;
+    struct client **dense = realloc(reg->dense, capacity * sizeof(struct client*));
+    if(dense == NULL) {
+        return -1;
+    }
+    reg->dense = dense;
+    int *dense_slot = realloc(reg->dense_slot, capacity * sizeof(int));
+    if(dense_slot == NULL) {
+        return -1;
+    }
+    reg->dense_slot = dense_slot;
+    reg->slot_capacity = capacity;
+    return 0;
+}
+
+// Add a client and return its fresh id, or -1 when the registry is full
+static inline int registry_add(client_registry_t *reg, struct client *cl) {
+    int slot;
+    if(reg->count == reg->limit) {
+        return -1;
+    }
+    
+    if(reg->free_head >= 0) {
+        slot = reg->free_head;
+        reg->free_head = reg->slots[slot].next_free;
+        if(reg->free_head < 0) {
+            reg->free_tail = -1;
+        }
+    } else {
+        if(reg->slot_count == reg->slot_capacity && registry_grow(reg) < 0) {
+            return -1;
+        }
+        slot = reg->slot_count++;
+        reg->slots[slot].generation = 1;
+    }
+    
+    reg->slots[slot].client = cl;
+    reg->slots[slot].dense_index = reg->count;
+    reg->dense_slot[reg->count] = slot;
+    reg->dense[reg->count++] = cl;
+    return (reg->slots[slot].generation << REGISTRY_SLOT_BITS) | slot;
+}
+
+// Look up a client by id; NULL once the id has been removed
+static inline struct client *registry_find(client_registry_t *reg, int id) {
+    int slot = id & (REGISTRY_MAX_SLOTS - 1);
+    if(id <= 0 || slot >= reg->slot_count) {
+        return NULL;
+    }
+    if(reg->slots[slot].generation != id >> REGISTRY_SLOT_BITS) {
+        return NULL;
+    }
+    return reg->slots[slot].client;
+}
+
+// Remove a client by id; returns -1 if the id is stale
+static inline int registry_remove(client_registry_t *reg, int id) {
+    if(registry_find(reg, id) == NULL) {
+        return -1;
+    }
+    int slot = id & (REGISTRY_MAX_SLOTS - 1);
+    registry_slot_t *entry = &reg->slots[slot];
+    
+    // Keep dense packed by moving its last client into the hole
+    int last = --reg->count;
+    reg->dense[entry->dense_index] = reg->dense[last];
+    reg->dense_slot[entry->dense_index] = reg->dense_slot[last];
+    reg->slots[reg->dense_slot[last]].dense_index = entry->dense_index;
+    
+    // Retire the id and queue the slot for reuse
+    entry->client = NULL;
+    entry->generation = entry->generation % (REGISTRY_GENERATIONS - 1) + 1;
+    entry->next_free = -1;
+    if(reg->free_tail >= 0) {
+        reg->slots[reg->free_tail].next_free = slot;
+    } else {
+        reg->free_head = slot;
+    }
+    reg->free_tail = slot;
+    return 0;
+}
+
+#endif
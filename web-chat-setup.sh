@@ -4,12 +4,12 @@
 echo "Web Chat Server Setup"
 echo "========================"
 
-# Compile the web server
+# Compile the web server (make pgo builds a profile-optimized one into build/pgo instead)
 echo "Compiling web chat server..."
-gcc -o web_chat_server chat-server.c -lpthread
+make release
 
 if [ $? -ne 0 ]; then
-    echo "Failed to compile server. Make sure you have gcc and pthread library."
+    echo "Failed to compile server. Make sure you have make, gcc, zlib and brotli development libraries."
     exit 1
 fi
 
@@ -37,4 +37,4 @@ echo "   Press Ctrl+C to stop"
 echo ""
 
 # Start the server
-./web-server
+./build/release/web-server "$@"
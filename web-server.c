@@ -1,4 +1,5 @@
 // web_chat_server.c - HTTP-based chat server accessible via web browsers
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<unistd.h>
@@ -10,12 +11,75 @@
 #include<ifaddrs.h>
 #include<time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "metrics.h"
+#include "registry.h"
+#include "chat-log.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-#define MAX_CLIENTS 50
+#define MAX_CLIENTS 100000     // default registry limit, see --max-clients
 #define BUFFER_SIZE 4096
-#define MAX_MESSAGES 100
+#define MAX_MESSAGES 100     // default history capacity, see --history
+#define MAX_EVENTS 256
+#define WORKER_THREADS 4
+#define KEEPALIVE_TIMEOUT 15
+#define MAX_REQUESTS_PER_CONN 100
+#define MAX_PENDING_OUTPUT (64 * 1024)
+#define LONG_POLL_TIMEOUT 25
+#define SSE_HEARTBEAT_INTERVAL 15
+#define MAX_EVENT_LOOPS 64
+#define MAX_IOVECS 64
+#define WS_PING_INTERVAL 20
+#define WS_PONG_TIMEOUT 45
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+#define MAX_HEADERS 32
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512            // provided receive buffers per loop, a power of two
+#define URING_BUFFER_GROUP 0
+#define MAX_RECV_STASH 16
+#define MAX_CHUNK_LINE 64
+#define MAX_ROOMS 1024               // default room limit, see --max-rooms
+#define ROOM_SHARDS 16               // lock stripes of the room directory
+#define ROOM_BUCKETS 64              // hash buckets per stripe
+#define DEFAULT_ROOM "lobby"
+#define MAX_HISTORY_LIMIT 200                // most messages one /history request returns
+#define HISTORY_PARTS (MAX_HISTORY_LIMIT / LOG_PAGE + 3)  // partial page at each end, whole ones, the ring
+#define DEFAULT_HISTORY_LIMIT 50
+#define BINARY_MESSAGES_TYPE "application/x-chat-messages"   // /api/messages in length-prefixed records
+#define FORM_VECTOR_RUN 16                   // plain bytes form_decode copies one at a time before scanning by vector
+#define MAX_METRIC_THREADS 128               // threads with their own metrics slot; any beyond share the last
+#define POOL_MIN_SHIFT 8                     // smallest pooled buffer is 256 bytes
+#define POOL_CLASSES 9                       // power-of-two size classes, 256 bytes to 64 KiB
+#define POOL_KEEP_BYTES (1024 * 1024)        // free bytes a loop keeps per class; the rest go back to malloc
+#define CONN_SLAB 64                         // connections carved from one allocation
+#define ARENA_BLOCK 16384                    // first block of a loop's request arena
 
-typedef struct {
+typedef struct client {
     int socket_fd;
     struct sockaddr_in address;
     int id;
@@ -24,381 +88,4546 @@ typedef struct {
 } client_t;
 
 typedef struct {
+    unsigned long seq;
     char username[32];
     char message[256];
     char timestamp[32];
+    time_t posted;
+    char html[512];             // fragment rendered once when the message is posted
+    int html_len;
 } chat_message_t;
 
-client_t *clients[MAX_CLIENTS];
-chat_message_t chat_history[MAX_MESSAGES];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t messages_mutex = PTHREAD_MUTEX_INITIALIZER;
-int client_count = 0;
-int message_count = 0;
+// One history ring slot guarded by a seqlock: version is odd while the writer is inside
+typedef struct {
+    atomic_ulong version;
+    chat_message_t message;
+} history_slot_t;
+
+client_registry_t registry = REGISTRY_INITIALIZER(MAX_CLIENTS);    // open WebSockets, under clients_mutex
+int history_capacity = MAX_MESSAGES;    // slots in every room's history ring
+pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Timed operations and locks, exported by /metrics
+enum {
+    TIME_ACCEPT,
+    TIME_PARSE,
+    TIME_RENDER,
+    TIME_SEND,
+    TIME_BROADCAST,
+    TIME_MESSAGES_WAIT,
+    TIME_CLIENTS_WAIT,
+    TIME_MESSAGES_HOLD,
+    TIME_CLIENTS_HOLD,
+    TIMINGS
+};
+
+// One thread's counters; only that thread writes them, /metrics sums every slot
+typedef struct {
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t shed;                  // accepted and closed at once for want of a descriptor
+    _Atomic uint64_t closed;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t posts;
+    metrics_histogram_t timings[TIMINGS];
+} __attribute__((aligned(64))) thread_metrics_t;
+
+thread_metrics_t thread_metrics[MAX_METRIC_THREADS];
+atomic_int metric_threads;
+__thread thread_metrics_t *my_metrics;
+
+struct http_conn;
+struct rendered_history;
+
+// A named room with its own history and render cache; a post only reaches the loops waiting on it
+typedef struct chat_room {
+    char name[32];
+    history_slot_t *history;        // ring allocated by the first post; seq lives in slot (seq - 1) % history_capacity
+    pthread_mutex_t messages_mutex; // serializes posts; readers never take it
+    pthread_mutex_t render_mutex;
+    atomic_ulong last_seq;          // published after the slot is complete
+    atomic_int claimed;             // counted against --max-rooms, from its first post on
+    unsigned long oldest_seq;       // set by log recovery when it restores less than a full ring
+    log_room_index_t index;         // log writer only
+    struct rendered_history *rendered;              // guarded by render_mutex
+    struct http_conn *waiters[MAX_EVENT_LOOPS];     // parked polls, streams and sockets; each list is loop-owned
+    atomic_ulong waiter_loops;      // loops whose waiters list is non-empty
+    atomic_ulong pending_loops;     // loops that have the room on their pending_rooms list
+    struct chat_room *pending_next[MAX_EVENT_LOOPS];
+    struct chat_room *next;         // next room in the same directory bucket
+} chat_room_t;
+
+// One lock stripe of the room directory; lookups in different stripes never contend
+typedef struct {
+    pthread_mutex_t mutex;
+    chat_room_t *buckets[ROOM_BUCKETS];
+} room_shard_t;
+
+room_shard_t room_shards[ROOM_SHARDS];
+atomic_int room_count;              // rooms someone has posted to
+atomic_int watched_count;           // rooms only waiters have opened; bounded by max_rooms as well
+int max_rooms = MAX_ROOMS;
+
+// What reads of a room nobody has posted to see; never in the directory
+chat_room_t empty_room = { .messages_mutex = PTHREAD_MUTEX_INITIALIZER, .render_mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// How find_room treats a name it does not know yet
+enum {
+    ROOM_LOOKUP,        // reads: NULL, nothing is created
+    ROOM_WATCH,         // waiters: created uncounted, so parking on a room does not use up --max-rooms
+    ROOM_POST           // posts: created, or claimed if only waiters had it, against --max-rooms
+};
+
+// io_uring instance behind one event loop, driven through the raw syscalls
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;         // SQEs filled in but not yet published to the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;                  // URING_BUFFERS receive buffers of BUFFER_SIZE bytes
+    unsigned short buf_tail;
+    int buffers_free;
+    struct http_conn *starved;      // connections waiting for receive buffers to come back
+} uring_t;
+
+// What a completion belongs to; the tag lives in the low bits of user_data
+enum {
+    URING_ACCEPT = 1,
+    URING_WAKE,
+    URING_RECV,
+    URING_SEND,
+    URING_CLOSE,
+    URING_CANCEL
+};
+#define URING_TAG_MASK 7
+
+// Received bytes still parked in a provided buffer because in_buf was full
+typedef struct {
+    unsigned short bid;
+    unsigned short offset;
+    unsigned short len;
+} recv_chunk_t;
+
+// One piece of pending output: bytes owned in out_buf, or a borrowed slice sent without copying
+typedef struct {
+    const char *data;               // borrowed bytes, NULL when the bytes live in out_buf
+    size_t offset;                  // start in out_buf for owned bytes
+    size_t len;
+    struct rendered_history *ref;   // keeps borrowed bytes alive, NULL for static data
+} out_segment_t;
+
+// Bytes inside a connection's input buffer, referenced in place rather than copied
+typedef struct {
+    const char *data;
+    size_t len;
+} slice_t;
+
+typedef struct {
+    slice_t name;
+    slice_t value;
+} http_header_t;
+
+// Request limits; the header section and body together must fit in one input buffer
+typedef struct {
+    size_t max_request_line;
+    size_t max_header_bytes;        // request line, headers and chunk trailers
+    int max_headers;
+    size_t max_body;                // decoded body, whichever framing it arrived in
+} http_limits_t;
+
+http_limits_t http_limits = { 1024, 2048, MAX_HEADERS, BUFFER_SIZE - 1 - 2048 - MAX_CHUNK_LINE };
+
+// Where the request parser is; each state resumes cleanly when more bytes arrive
+enum {
+    PARSE_REQUEST_LINE,
+    PARSE_HEADERS,
+    PARSE_BODY,
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_CHUNK_END,
+    PARSE_TRAILERS,
+    PARSE_DONE,
+    PARSE_ERROR
+};
+
+// Incremental parser state for the request at the front of in_buf; slices point into in_buf
+typedef struct {
+    int state;
+    size_t pos;                     // bytes of in_buf the parser has consumed
+    size_t scan;                    // where the next CRLF search resumes
+    slice_t method;
+    slice_t path;                   // NUL-terminated once the request line is parsed
+    slice_t query;                  // NUL-terminated, empty when absent
+    int http10;
+    http_header_t headers[MAX_HEADERS];
+    int header_count;
+    size_t header_bytes;
+    int chunked;
+    size_t content_length;
+    size_t body_start;              // chunked bodies are compacted in place from here
+    size_t body_len;
+    size_t chunk_left;
+    int sent_continue;
+    const char *error;              // status line when state is PARSE_ERROR
+} http_request_t;
+
+// Doubly linked list of connections, oldest first
+typedef struct {
+    struct http_conn *head;
+    struct http_conn *tail;
+} conn_list_t;
+
+// Free pooled buffer, linked through its first bytes
+typedef struct pool_buffer {
+    struct pool_buffer *next;
+} pool_buffer_t;
+
+// A loop's recycled memory: I/O buffers in power-of-two classes and slab-allocated connections.
+// Only the loop's own thread touches it, so nothing is locked.
+typedef struct {
+    pool_buffer_t *free[POOL_CLASSES];
+    int free_count[POOL_CLASSES];
+    struct http_conn *free_conns;   // linked through list_next
+} buffer_pool_t;
+
+// One block of a request arena
+typedef struct arena_block {
+    struct arena_block *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+// Bump-pointer scratch memory for the request being handled; reset, not freed, when it ends.
+// A request that outgrows the block chains a bigger one, which is the one kept at the reset.
+typedef struct {
+    arena_block_t *top;
+} request_arena_t;
+
+// Event loop owning a listening socket and every connection accepted on it
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    int spare_fd;                   // /dev/null held in reserve so a full descriptor table can still turn clients away
+    time_t accept_stalled;          // when clients were left on the listener for want of descriptors, 0 otherwise
+    int wake_fd;                    // eventfd signalled when a room with waiters here gets a message
+    int index;                      // this loop's bit in a room's waiter and pending masks
+    pthread_mutex_t rooms_mutex;    // guards pending_rooms and finished_loads
+    struct chat_room *pending_rooms;    // rooms with messages not yet handed to this loop's waiters
+    struct history_load *finished_loads;    // /history pages the worker pool has read for this loop
+    conn_list_t idle;               // plain HTTP connections by last activity
+    conn_list_t pollers;            // parked long-poll requests by park time
+    conn_list_t streams;            // open Server-Sent Events streams
+    conn_list_t sockets;            // open WebSocket connections
+    time_t last_heartbeat;
+    time_t last_ping;
+    uring_t *ring;                  // io_uring backend, NULL when the loop runs on epoll
+    buffer_pool_t pool;
+    request_arena_t arena;
+} event_loop_t;
+
+// What a connection is currently doing
+enum {
+    CONN_HTTP,
+    CONN_LOADING,
+    CONN_LONG_POLL,
+    CONN_EVENT_STREAM,
+    CONN_WEBSOCKET
+};
+
+// Per-connection state; the loop reads into in_buf and drains the output segments with one sendmsg.
+// Buffers come from the loop's pool while they hold bytes, so an idle connection is just this struct.
+typedef struct http_conn {
+    event_loop_t *loop;
+    conn_list_t *list;
+    struct http_conn *list_prev;
+    struct http_conn *list_next;
+    time_t last_active;
+    time_t parked_at;
+    int mode;
+    unsigned long since;            // newest sequence the client has seen
+    chat_room_t *room;              // room whose waiters list holds the connection, NULL for none
+    struct http_conn *room_prev;
+    struct http_conn *room_next;
+    client_t *client;               // registry entry while a WebSocket is open
+    struct history_load *load;      // pages a CONN_LOADING request waits for
+    time_t last_pong;
+    int fd;
+    int requests_served;
+    int keep_alive;
+    int read_eof;
+    char *in_buf;                   // BUFFER_SIZE bytes while input is buffered, else NULL
+    size_t in_len;
+    http_request_t *req;            // parse state of the request at the front of in_buf, pooled with it
+    char *out_buf;                  // backing store for owned output bytes, NULL while nothing is pending
+    size_t out_len;
+    size_t out_cap;
+    out_segment_t *segs;            // pending output in send order
+    int seg_head;
+    int seg_count;
+    int seg_cap;
+    size_t seg_sent;                // bytes of segs[seg_head] already written
+    size_t out_pending;             // bytes queued but not yet written
+    int close_after_write;
+    
+    // io_uring backend only
+    int ops_inflight;               // submitted operations that still point at this connection
+    int closed;                     // close_conn ran; freed once ops_inflight drops to zero
+    int fd_closing;                 // a close of fd is already queued
+    int recv_armed;
+    int recv_paused;                // recv cancelled until the stash drains
+    int recv_starved;               // on the loop's starved list
+    int recv_eof;
+    int send_inflight;
+    uint64_t send_started;          // submit time of the in-flight send, for the send histogram
+    char *send_out_buf;             // out_buf the in-flight send points into
+    size_t send_out_cap;
+    struct iovec *send_iov;         // pooled while a send is in flight
+    struct msghdr send_msg;
+    recv_chunk_t stash[MAX_RECV_STASH];
+    int stash_head;
+    int stash_count;
+    struct http_conn *starved_next;
+} http_conn_t;
+
+// Job handed to the worker pool for anything that may block
+typedef struct work_item {
+    void (*fn)(void *arg);
+    void *arg;
+    struct work_item *next;
+} work_item_t;
+
+work_item_t *work_head = NULL;
+work_item_t *work_tail = NULL;
+work_item_t *work_free = NULL;          // finished items kept for reuse, guarded by work_mutex
+pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+// Worker thread: run queued jobs off the event loop
+void *worker_thread(void *arg) {
+    (void)arg;
+    work_item_t *done = NULL;
+    while (1) {
+        pthread_mutex_lock(&work_mutex);
+        if (done) {
+            done->next = work_free;
+            work_free = done;
+        }
+        while (work_head == NULL) {
+            pthread_cond_wait(&work_cond, &work_mutex);
+        }
+        work_item_t *item = work_head;
+        work_head = item->next;
+        if (work_head == NULL) {
+            work_tail = NULL;
+        }
+        pthread_mutex_unlock(&work_mutex);
+        
+        item->fn(item->arg);
+        done = item;
+    }
+    return NULL;
+}
+
+// Queue a job for the worker pool
+void submit_work(void (*fn)(void *arg), void *arg) {
+    pthread_mutex_lock(&work_mutex);
+    work_item_t *item = work_free;
+    if (item) {
+        work_free = item->next;
+    } else {
+        pthread_mutex_unlock(&work_mutex);
+        item = malloc(sizeof(work_item_t));
+        if (item == NULL) {
+            fn(arg);
+            return;
+        }
+        pthread_mutex_lock(&work_mutex);
+    }
+    item->fn = fn;
+    item->arg = arg;
+    item->next = NULL;
+    if (work_tail) {
+        work_tail->next = item;
+    } else {
+        work_head = item;
+    }
+    work_tail = item;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_mutex);
+}
+
+// Start the fixed-size worker pool
+void start_worker_pool(int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, NULL) == 0) {
+            pthread_detach(tid);
+        }
+    }
+}
+
+event_loop_t *event_loops[MAX_EVENT_LOOPS];
+int event_loop_count = 0;
+
+// Queue a room on each loop that has waiters in it and wake those loops; the rest never hear of it
+void notify_room_waiters(chat_room_t *room) {
+    uint64_t mask = atomic_load(&room->waiter_loops);
+    for (int i = 0; mask; i++, mask >>= 1) {
+        uint64_t bit = 1ULL << i;
+        if (!(mask & 1) || (atomic_fetch_or(&room->pending_loops, bit) & bit)) {
+            // Already pending there; that delivery reads the newest sequence and covers this post too
+            continue;
+        }
+        
+        event_loop_t *loop = event_loops[i];
+        pthread_mutex_lock(&loop->rooms_mutex);
+        room->pending_next[i] = loop->pending_rooms;
+        loop->pending_rooms = room;
+        pthread_mutex_unlock(&loop->rooms_mutex);
+        
+        uint64_t one = 1;
+        if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+            // Counter already pending; the loop will wake anyway
+        }
+    }
+}
+
+// Metrics slot of the calling thread, claimed on first use
+thread_metrics_t *metrics() {
+    if (my_metrics == NULL) {
+        int index = atomic_fetch_add(&metric_threads, 1);
+        my_metrics = &thread_metrics[index < MAX_METRIC_THREADS ? index : MAX_METRIC_THREADS - 1];
+    }
+    return my_metrics;
+}
+
+// The calling thread's histogram for one timed operation or lock
+metrics_histogram_t *timing(int which) {
+    return &metrics()->timings[which];
+}
+
+// Add client to the registry and give it a fresh id; returns -1 when it is full
+int add_client(client_t *cl) {
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    int id = registry_add(&registry, cl);
+    if (id > 0) {
+        cl->id = id;
+    }
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+    return id > 0 ? 0 : -1;
+}
+
+// Remove client from the registry; the id is only used to find its slot, clients are never looked up by it
+void remove_client(int id) {
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    registry_remove(&registry, id);
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+}
+
+// Number of open WebSockets
+int client_count() {
+    uint64_t locked = metrics_lock(&clients_mutex, timing(TIME_CLIENTS_WAIT));
+    int count = registry.count;
+    metrics_unlock(&clients_mutex, timing(TIME_CLIENTS_HOLD), locked);
+    return count;
+}
+
+// Offset of the first byte in p[0, len) that must be escaped, or len. Both forms escape < > & and ";
+// HTML text adds ', a JSON string adds backslash and control bytes. AVX2 or SSE2 when the build targets them.
+size_t find_markup_escape(const char* p, size_t len, int json) {
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i lt32 = _mm256_set1_epi8('<'), gt32 = _mm256_set1_epi8('>'), amp32 = _mm256_set1_epi8('&');
+    __m256i quote32 = _mm256_set1_epi8('"'), extra32 = _mm256_set1_epi8(json ? '\\' : '\'');
+    __m256i ctrl32 = _mm256_set1_epi8(json ? 0x1F : 0);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, lt32), _mm256_cmpeq_epi8(v, gt32));
+        hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(v, amp32), _mm256_cmpeq_epi8(v, quote32)));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, extra32));
+        // Unsigned v <= ctrl; for HTML that is only NUL, which a C string never holds
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl32), v));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    __m128i lt16 = _mm_set1_epi8('<'), gt16 = _mm_set1_epi8('>'), amp16 = _mm_set1_epi8('&');
+    __m128i quote16 = _mm_set1_epi8('"'), extra16 = _mm_set1_epi8(json ? '\\' : '\'');
+    __m128i ctrl16 = _mm_set1_epi8(json ? 0x1F : 0);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, lt16), _mm_cmpeq_epi8(v, gt16));
+        hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(v, amp16), _mm_cmpeq_epi8(v, quote16)));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, extra16));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl16), v));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = p[i];
+        if (c == '<' || c == '>' || c == '&' || c == '"' || c == (json ? '\\' : '\'') || (json && c < 0x20)) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Escape s[0, len) for HTML text or a JSON string into out, which holds cap bytes. Runs needing no
+// escape are copied a block at a time. Stops early rather than overflow, never inside an escape or a
+// UTF-8 sequence. Returns the bytes written.
+size_t markup_escape(char* out, size_t cap, const char* s, size_t len, int json) {
+    size_t in = 0, written = 0;
+    
+    while (in < len) {
+        size_t run = find_markup_escape(s + in, len - in, json);
+        if (run > cap - written) {
+            // Out of room inside a plain run: back off to the start of a character
+            run = cap - written;
+            while (run > 0 && ((unsigned char)s[in + run] & 0xC0) == 0x80) {
+                run--;
+            }
+            memcpy(out + written, s + in, run);
+            return written + run;
+        }
+        memcpy(out + written, s + in, run);
+        in += run;
+        written += run;
+        if (in >= len) {
+            break;
+        }
+        
+        static const char hex[] = "0123456789abcdef";
+        unsigned char c = s[in];
+        char json_escape[6] = { '\\', c, '0', '0', hex[c >> 4], hex[c & 15] };
+        const char *escape = json_escape;
+        size_t escape_len = 2;
+        if (json) {
+            if (c != '"' && c != '\\') {
+                json_escape[1] = 'u';
+                escape_len = 6;
+            }
+        } else {
+            escape = c == '<' ? "&lt;" : c == '>' ? "&gt;" : c == '&' ? "&amp;" : c == '"' ? "&quot;" : "&#39;";
+            escape_len = strlen(escape);
+        }
+        if (escape_len > cap - written) {
+            break;
+        }
+        memcpy(out + written, escape, escape_len);
+        written += escape_len;
+        in++;
+    }
+    return written;
+}
+
+// Render a message's HTML fragment; done once, at post time. Name and text are escaped, and a text
+// whose escapes do not fit in html is shortened rather than cut mid-tag.
+void render_message_html(chat_message_t *msg) {
+    static const char tail[] = "</span></div>\n";
+    size_t cap = sizeof(msg->html) - 1;
+    size_t len = snprintf(msg->html, cap,
+        "<div class='message'>"
+        "<span class='time'>%s</span> "
+        "<span class='username'>",
+        msg->timestamp);
+    len += markup_escape(msg->html + len, cap - len, msg->username, strlen(msg->username), 0);
+    len += snprintf(msg->html + len, cap - len, ":</span> <span class='text'>");
+    len += markup_escape(msg->html + len, cap - len - (sizeof(tail) - 1), msg->message, strlen(msg->message), 0);
+    memcpy(msg->html + len, tail, sizeof(tail));
+    msg->html_len = len + sizeof(tail) - 1;
+}
+
+#define LOG_MAX_RECORD LOG_RECORD_SIZE(sizeof(((chat_message_t*)0)->username) - 1, \
+                                       sizeof(((chat_message_t*)0)->message) - 1)
+
+// The history log; off until main opens it with --log-dir
+chat_log_t chat_log = CHAT_LOG_INITIALIZER(sizeof(((chat_message_t*)0)->username) - 1,
+                                           sizeof(((chat_message_t*)0)->message) - 1);
+
+// Fill in a message and render its HTML
+void fill_message(chat_message_t *msg, unsigned long seq, time_t posted, const char* username, const char* message) {
+    msg->seq = seq;
+    snprintf(msg->username, sizeof(msg->username), "%s", username);
+    snprintf(msg->message, sizeof(msg->message), "%s", message);
+    
+    // Add timestamp
+    struct tm tm_info;
+    localtime_r(&posted, &tm_info);
+    strftime(msg->timestamp, sizeof(msg->timestamp), "%H:%M:%S", &tm_info);
+    msg->posted = posted;
+    render_message_html(msg);
+}
+
+// Allocate a room's ring on its first post; returns -1 when it cannot be allocated
+int ensure_history_ring(chat_room_t *room) {
+    // Rooms nobody posts to never pay for a ring; readers only look at it once last_seq is non-zero
+    if (room->history == NULL) {
+        room->history = calloc(history_capacity, sizeof(history_slot_t));
+        if (room->history == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write message seq into a room's ring; the caller publishes last_seq. Returns -1 when the ring cannot be allocated.
+int store_history_message(chat_room_t *room, unsigned long seq, time_t posted,
+                          const char* username, const char* message) {
+    if (ensure_history_ring(room) < 0) {
+        return -1;
+    }
+    
+    history_slot_t *slot = &room->history[(seq - 1) % history_capacity];
+    unsigned long version = atomic_load_explicit(&slot->version, memory_order_relaxed);
+    
+    atomic_store_explicit(&slot->version, version + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    fill_message(&slot->message, seq, posted, username, message);
+    
+    atomic_store_explicit(&slot->version, version + 2, memory_order_release);
+    return 0;
+}
+
+// Add message to a room's history and queue it for the log. The record is encoded before the room
+// lock is taken; a post the log or the ring cannot take returns -1 without using up a sequence number.
+int add_message_to_history(chat_room_t *room, const char* username, const char* message) {
+    char record[LOG_MAX_RECORD] __attribute__((aligned(8)));
+    size_t record_len = 0;
+    time_t posted = time(0);
+    if (chat_log.dir) {
+        // Lengths are clipped to the ring's fields so the record matches what the ring holds
+        record_len = log_encode_fields(record, room->name, strlen(room->name), 0, posted,
+                                       username, strnlen(username, chat_log.max_username),
+                                       message, strnlen(message, chat_log.max_message));
+    }
+    
+    // Writers serialize on messages_mutex; readers never take it
+    uint64_t locked = metrics_lock(&room->messages_mutex, timing(TIME_MESSAGES_WAIT));
+    
+    unsigned long seq = atomic_load_explicit(&room->last_seq, memory_order_relaxed) + 1;
+    // The ring is allocated before the log takes the record, so a queued record is always stored
+    if (ensure_history_ring(room) < 0 || (record_len && log_append(&chat_log, record, record_len, seq) < 0)) {
+        metrics_unlock(&room->messages_mutex, timing(TIME_MESSAGES_HOLD), locked);
+        return -1;
+    }
+    store_history_message(room, seq, posted, username, message);
+    
+    // Sequentially consistent with room_attach: either the poster sees the new waiter's loop
+    // in waiter_loops or the waiter sees this sequence when it reads the bounds
+    atomic_store(&room->last_seq, seq);
+    metrics_unlock(&room->messages_mutex, timing(TIME_MESSAGES_HOLD), locked);
+    
+    metrics_add(&metrics()->posts, 1);
+    notify_room_waiters(room);
+    return 0;
+}
+
+// Copy message seq out of a room's ring; returns -1 if it has already been overwritten
+int read_history_message(chat_room_t *room, unsigned long seq, chat_message_t *out) {
+    history_slot_t *slot = &room->history[(seq - 1) % history_capacity];
+    
+    while (1) {
+        unsigned long before = atomic_load_explicit(&slot->version, memory_order_acquire);
+        if (before & 1) {
+            // Writer is mid-update; it never holds the slot for long
+            sched_yield();
+            continue;
+        }
+        memcpy(out, &slot->message, sizeof(chat_message_t));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->version, memory_order_relaxed) == before) {
+            break;
+        }
+    }
+    return out->seq == seq ? 0 : -1;
+}
+
+// Report the oldest and newest sequence numbers still in a room's history (0 when empty)
+void get_history_bounds(chat_room_t *room, unsigned long *first_seq, unsigned long *last_seq) {
+    unsigned long newest = atomic_load(&room->last_seq);
+    *last_seq = newest;
+    if (newest == 0) {
+        *first_seq = 0;
+    } else if (newest > (unsigned long)history_capacity) {
+        *first_seq = newest - history_capacity + 1;
+    } else {
+        *first_seq = 1;
+    }
+    if (*first_seq < room->oldest_seq) {
+        *first_seq = room->oldest_seq;
+    }
+}
+
+// Contiguous HTML for the whole history window, shared read-only by every response
+typedef struct rendered_history {
+    atomic_int refs;
+    unsigned long first_seq;    // 0 when the history is empty
+    unsigned long last_seq;
+    size_t len;
+    size_t *offsets;            // offsets[i] is where message first_seq + i starts; offsets[count] == len
+    char *html;                 // NUL-terminated
+} rendered_history_t;
+
+// Drop a reference to a rendered history
+void release_rendered_history(rendered_history_t *rendered) {
+    if (rendered && atomic_fetch_sub(&rendered->refs, 1) == 1) {
+        free(rendered);
+    }
+}
+
+// Build the rendered history for a room's current window, reusing what old already rendered
+rendered_history_t *render_chat_history(chat_room_t *room, const rendered_history_t *old) {
+    unsigned long first_seq, last_seq;
+    get_history_bounds(room, &first_seq, &last_seq);
+    unsigned long count = last_seq - first_seq + (last_seq ? 1 : 0);
+    
+    // Messages still in the window that old already has are copied in one block
+    unsigned long reuse_first = 0, reuse_last = 0;
+    if (old && old->first_seq && old->last_seq >= first_seq && old->last_seq <= last_seq) {
+        reuse_first = old->first_seq > first_seq ? old->first_seq : first_seq;
+        reuse_last = old->last_seq;
+    }
+    if (reuse_first != first_seq) {
+        reuse_first = reuse_last = 0;
+    }
+    size_t reuse_start = reuse_last ? old->offsets[reuse_first - old->first_seq] : 0;
+    size_t reuse_len = reuse_last ? old->len - reuse_start : 0;
+    unsigned long fresh = count - (reuse_last ? reuse_last - reuse_first + 1 : 0);
+    
+    size_t html_cap = reuse_len + fresh * sizeof(((chat_message_t*)0)->html) + 1;
+    rendered_history_t *rendered = malloc(sizeof(rendered_history_t) +
+                                          (count + 1) * sizeof(size_t) + html_cap);
+    if (rendered == NULL) {
+        return NULL;
+    }
+    atomic_init(&rendered->refs, 1);
+    rendered->first_seq = first_seq;
+    rendered->last_seq = last_seq;
+    rendered->offsets = (size_t*)(rendered + 1);
+    rendered->html = (char*)(rendered->offsets + count + 1);
+    
+    size_t len = 0;
+    unsigned long seq = first_seq;
+    if (reuse_last) {
+        memcpy(rendered->html, old->html + reuse_start, reuse_len);
+        for (; seq <= reuse_last; seq++) {
+            rendered->offsets[seq - first_seq] = old->offsets[seq - old->first_seq] - reuse_start;
+        }
+        len = reuse_len;
+    }
+    
+    for (; seq != 0 && seq <= last_seq; seq++) {
+        chat_message_t msg;
+        if (read_history_message(room, seq, &msg) < 0) {
+            // Writers lapped the whole ring while we were copying; start over
+            free(rendered);
+            return render_chat_history(room, NULL);
+        }
+        rendered->offsets[seq - first_seq] = len;
+        memcpy(rendered->html + len, msg.html, msg.html_len);
+        len += msg.html_len;
+    }
+    rendered->offsets[count] = len;
+    rendered->html[len] = '\0';
+    rendered->len = len;
+    return rendered;
+}
+
+// Take a reference to a room's rendered history that is current as of now
+rendered_history_t *get_rendered_history(chat_room_t *room) {
+    pthread_mutex_lock(&room->render_mutex);
+    unsigned long newest = atomic_load(&room->last_seq);
+    
+    // Invalidated by sequence number: only the first read after a post re-renders
+    if (room->rendered == NULL || room->rendered->last_seq != newest) {
+        uint64_t start = metrics_now();
+        rendered_history_t *fresh = render_chat_history(room, room->rendered);
+        metrics_since(timing(TIME_RENDER), start);
+        if (fresh) {
+            release_rendered_history(room->rendered);
+            room->rendered = fresh;
+        }
+    }
+    
+    rendered_history_t *rendered = room->rendered;
+    if (rendered) {
+        atomic_fetch_add(&rendered->refs, 1);
+    }
+    pthread_mutex_unlock(&room->render_mutex);
+    return rendered;
+}
+
+// Size class of a pooled buffer of size bytes, -1 past the largest
+int pool_class(size_t size) {
+    int class = 0;
+    while (class < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + class)) < size) {
+        class++;
+    }
+    return class < POOL_CLASSES ? class : -1;
+}
+
+// Take a buffer of at least size bytes from the loop's pool; release it with the same size
+void *pool_get(event_loop_t *loop, size_t size) {
+    int class = pool_class(size);
+    if (class < 0) {
+        return malloc(size);
+    }
+    pool_buffer_t *buf = loop->pool.free[class];
+    if (buf == NULL) {
+        return malloc((size_t)1 << (POOL_MIN_SHIFT + class));
+    }
+    loop->pool.free[class] = buf->next;
+    loop->pool.free_count[class]--;
+    return buf;
+}
+
+// Return a buffer taken with pool_get; classes already holding POOL_KEEP_BYTES free it instead
+void pool_put(event_loop_t *loop, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    int class = pool_class(size);
+    if (class < 0 || ((size_t)loop->pool.free_count[class] << (POOL_MIN_SHIFT + class)) >= POOL_KEEP_BYTES) {
+        free(ptr);
+        return;
+    }
+    pool_buffer_t *buf = ptr;
+    buf->next = loop->pool.free[class];
+    loop->pool.free[class] = buf;
+    loop->pool.free_count[class]++;
+}
+
+// Scratch memory valid until the loop's arena is next reset; NULL only when malloc fails
+void *arena_alloc(event_loop_t *loop, size_t size) {
+    request_arena_t *arena = &loop->arena;
+    size = (size + 15) & ~(size_t)15;
+    arena_block_t *top = arena->top;
+    if (top == NULL || top->size - top->used < size) {
+        size_t block_size = top ? top->size * 2 : ARENA_BLOCK;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        arena_block_t *block = malloc(sizeof(arena_block_t) + block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->prev = top;
+        block->size = block_size;
+        block->used = 0;
+        arena->top = block;
+        top = block;
+    }
+    void *ptr = top->data + top->used;
+    top->used += size;
+    return ptr;
+}
+
+// End of a request: everything allocated from the arena is dead; keep only the largest block
+void arena_reset(event_loop_t *loop) {
+    arena_block_t *top = loop->arena.top;
+    if (top == NULL) {
+        return;
+    }
+    while (top->prev) {
+        arena_block_t *prev = top->prev;
+        top->prev = prev->prev;
+        free(prev);
+    }
+    top->used = 0;
+}
+
+// Give the connection an input buffer and parser state before bytes are read into it
+int conn_hold_input(http_conn_t *conn) {
+    if (conn->in_buf) {
+        return 0;
+    }
+    conn->in_buf = pool_get(conn->loop, BUFFER_SIZE);
+    conn->req = pool_get(conn->loop, sizeof(http_request_t));
+    if (conn->in_buf == NULL || conn->req == NULL) {
+        pool_put(conn->loop, conn->in_buf, BUFFER_SIZE);
+        pool_put(conn->loop, conn->req, sizeof(http_request_t));
+        conn->in_buf = NULL;
+        conn->req = NULL;
+        return -1;
+    }
+    memset(conn->req, 0, sizeof(http_request_t));
+    return 0;
+}
+
+// Hand the input buffer back once everything in it has been consumed
+void conn_drop_input(http_conn_t *conn) {
+    if (conn->in_buf == NULL || conn->in_len > 0) {
+        return;
+    }
+    pool_put(conn->loop, conn->in_buf, BUFFER_SIZE);
+    pool_put(conn->loop, conn->req, sizeof(http_request_t));
+    conn->in_buf = NULL;
+    conn->req = NULL;
+}
+
+// Reserve the next output segment
+out_segment_t *conn_push_segment(http_conn_t *conn) {
+    if (conn->seg_count == conn->seg_cap) {
+        int new_cap = conn->seg_cap ? conn->seg_cap * 2 : 16;
+        out_segment_t *grown = pool_get(conn->loop, new_cap * sizeof(out_segment_t));
+        if (grown == NULL) {
+            return NULL;
+        }
+        if (conn->seg_count > 0) {
+            memcpy(grown, conn->segs, conn->seg_count * sizeof(out_segment_t));
+        }
+        pool_put(conn->loop, conn->segs, conn->seg_cap * sizeof(out_segment_t));
+        conn->segs = grown;
+        conn->seg_cap = new_cap;
+    }
+    return &conn->segs[conn->seg_count++];
+}
+
+// Make room for len more owned output bytes and return where they go; conn_commit queues what was
+// written there. Serializers write into the result directly instead of building a copy first.
+char *conn_reserve(http_conn_t *conn, size_t len) {
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : BUFFER_SIZE;
+        while (new_cap < conn->out_len + len) {
+            new_cap *= 2;
+        }
+        char *grown = pool_get(conn->loop, new_cap);
+        if (grown == NULL) {
+            return NULL;
+        }
+        if (conn->out_len > 0) {
+            memcpy(grown, conn->out_buf, conn->out_len);
+        }
+        
+        // An io_uring send may still be reading the old buffer; it is released when that send completes
+        if (conn->out_buf != conn->send_out_buf) {
+            pool_put(conn->loop, conn->out_buf, conn->out_cap);
+        }
+        conn->out_buf = grown;
+        conn->out_cap = new_cap;
+    }
+    return conn->out_buf + conn->out_len;
+}
+
+// Queue len bytes written at the pointer conn_reserve returned
+int conn_commit(http_conn_t *conn, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    
+    // Owned bytes written back to back share one segment
+    out_segment_t *last = conn->seg_count > conn->seg_head ? &conn->segs[conn->seg_count - 1] : NULL;
+    if (last && last->data == NULL && last->offset + last->len == conn->out_len) {
+        last->len += len;
+    } else {
+        out_segment_t *seg = conn_push_segment(conn);
+        if (seg == NULL) {
+            return -1;
+        }
+        seg->data = NULL;
+        seg->offset = conn->out_len;
+        seg->len = len;
+        seg->ref = NULL;
+    }
+    
+    conn->out_len += len;
+    conn->out_pending += len;
+    return 0;
+}
+
+// Append bytes to a connection's pending output (copied)
+int conn_append(http_conn_t *conn, const char* data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    char *out = conn_reserve(conn, len);
+    if (out == NULL) {
+        return -1;
+    }
+    memcpy(out, data, len);
+    return conn_commit(conn, len);
+}
+
+// Append bytes without copying; ref (if any) keeps them alive until they are written
+int conn_append_shared(http_conn_t *conn, const char* data, size_t len, struct rendered_history *ref) {
+    if (len == 0) {
+        return 0;
+    }
+    out_segment_t *seg = conn_push_segment(conn);
+    if (seg == NULL) {
+        return -1;
+    }
+    seg->data = data;
+    seg->offset = 0;
+    seg->len = len;
+    seg->ref = ref;
+    if (ref) {
+        atomic_fetch_add(&ref->refs, 1);
+    }
+    conn->out_pending += len;
+    return 0;
+}
+
+// Piece of a response body; zero_copy parts are static or pinned by ref and are not copied
+typedef struct {
+    const char *data;
+    size_t len;
+    int zero_copy;
+    rendered_history_t *ref;
+} body_part_t;
+
+// Where a streamed response's Content-Length value and body sit in out_buf
+typedef struct {
+    size_t length_at;
+    size_t body_at;
+} response_mark_t;
+
+// Content-Length left blank for finish_http_response; the padding is optional whitespace to HTTP
+#define LENGTH_PLACEHOLDER "Content-Length:                     \r\n"
+#define LENGTH_DIGITS 20
+
+// Format the status line and headers straight into the output buffer; length_header is a whole line or empty
+int queue_response_head(http_conn_t *conn, const char* status, const char* content_type,
+                        const char* length_header, const char* extra_headers) {
+    size_t cap = strlen(status) + strlen(content_type) + strlen(length_header) + strlen(extra_headers) + 128;
+    char *out = conn_reserve(conn, cap);
+    if (out == NULL) {
+        return -1;
+    }
+    int len = snprintf(out, cap,
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "%s"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s"
+        "%s"
+        "\r\n",
+        status, content_type, length_header,
+        conn->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n",
+        extra_headers);
+    return conn_commit(conn, len);
+}
+
+// Start a response whose body the caller serializes into the output buffer behind it
+int begin_http_response(http_conn_t *conn, const char* status, const char* content_type,
+                        const char* extra_headers, response_mark_t *mark) {
+    size_t head_at = conn->out_len;
+    if (queue_response_head(conn, status, content_type, LENGTH_PLACEHOLDER, extra_headers) < 0) {
+        conn->close_after_write = 1;
+        return -1;
+    }
+    const char *field = memmem(conn->out_buf + head_at, conn->out_len - head_at, "Content-Length:", 15);
+    // The digits go right-aligned just before the line's CRLF
+    mark->length_at = field - conn->out_buf + strlen(LENGTH_PLACEHOLDER) - 2 - LENGTH_DIGITS;
+    mark->body_at = conn->out_len;
+    return 0;
+}
+
+// Fill in the length of everything written since begin_http_response
+void finish_http_response(http_conn_t *conn, const response_mark_t *mark) {
+    char digits[LENGTH_DIGITS + 1];
+    snprintf(digits, sizeof(digits), "%*zu", LENGTH_DIGITS, conn->out_len - mark->body_at);
+    memcpy(conn->out_buf + mark->length_at, digits, LENGTH_DIGITS);
+    if (!conn->keep_alive) {
+        conn->close_after_write = 1;
+    }
+}
+
+// Queue HTTP response whose body is the concatenation of parts
+void send_http_response_parts(http_conn_t *conn, const char* status, const char* content_type,
+                              const char* extra_headers, const body_part_t *parts, int part_count) {
+    size_t body_len = 0;
+    for (int i = 0; i < part_count; i++) {
+        body_len += parts[i].len;
+    }
+    
+    // A 304 carries no body and must not claim a zero length for the cached one
+    char length_header[48] = "";
+    if (strncmp(status, "304", 3) != 0) {
+        snprintf(length_header, sizeof(length_header), "Content-Length: %zu\r\n", body_len);
+    }
+    
+    if (queue_response_head(conn, status, content_type, length_header, extra_headers) < 0) {
+        conn->close_after_write = 1;
+        return;
+    }
+    for (int i = 0; i < part_count; i++) {
+        int queued = parts[i].zero_copy ? conn_append_shared(conn, parts[i].data, parts[i].len, parts[i].ref)
+                                        : conn_append(conn, parts[i].data, parts[i].len);
+        if (queued < 0) {
+            // The head already promised the whole body; a short one must end the connection, or the
+            // client would read the next response as the rest of it. conn_append_shared takes its own
+            // reference only for a part it queues, so the parts left over hold none to give back.
+            conn->close_after_write = 1;
+            return;
+        }
+    }
+    if (!conn->keep_alive) {
+        conn->close_after_write = 1;
+    }
+}
+
+// Queue HTTP response with extra header lines (each ending in \r\n) on the connection
+void send_http_response_with_headers(http_conn_t *conn, const char* status, const char* content_type,
+                                     const char* extra_headers, const char* body) {
+    body_part_t part = { body, strlen(body), 0, NULL };
+    send_http_response_parts(conn, status, content_type, extra_headers, &part, 1);
+}
+
+// Queue HTTP response on the connection
+void send_http_response(http_conn_t *conn, const char* status, const char* content_type, const char* body) {
+    send_http_response_with_headers(conn, status, content_type, "", body);
+}
+
+// Stylesheet for the chat page, served as /app.css
+const char chat_page_css[] =
+    "body { font-family: Arial, sans-serif; margin: 0; padding: 10px; background: linear-gradient(135deg, #667eea 0%, #764ba2 100%); min-height: 100vh; }\n"
+    ".container { max-width: 800px; margin: 0 auto; background: white; border-radius: 10px; box-shadow: 0 4px 6px rgba(0,0,0,0.1); overflow: hidden; }\n"
+    ".header { background: #4a5568; color: white; padding: 20px; text-align: center; }\n"
+    ".chat-area { height: 400px; overflow-y: auto; padding: 20px; background: #f7fafc; border-bottom: 1px solid #e2e8f0; }\n"
+    ".message { margin: 5px 0; padding: 8px; background: white; border-radius: 5px; box-shadow: 0 1px 2px rgba(0,0,0,0.1); }\n"
+    ".time { color: #718096; font-size: 0.8em; }\n"
+    ".username { font-weight: bold; color: #2d3748; }\n"
+    ".text { color: #4a5568; }\n"
+    ".input-area { padding: 20px; background: white; }\n"
+    ".input-group { display: flex; gap: 10px; margin-bottom: 10px; }\n"
+    "input[type='text'] { flex: 1; padding: 10px; border: 1px solid #cbd5e0; border-radius: 5px; font-size: 16px; }\n"
+    "button { padding: 10px 20px; background: #4299e1; color: white; border: none; border-radius: 5px; cursor: pointer; font-size: 16px; }\n"
+    "button:hover { background: #3182ce; }\n"
+    ".status { text-align: center; padding: 10px; color: #718096; font-style: italic; }\n"
+    ".client-count { background: #48bb78; color: white; padding: 5px 10px; border-radius: 15px; font-size: 0.8em; }\n"
+    "@media (max-width: 600px) {\n"
+    "  .input-group { flex-direction: column; }\n"
+    "  .container { margin: 0; border-radius: 0; }\n"
+    "}\n";
+
+// Client script for the chat page, served as /app.js
+const char chat_page_js[] =
+    "// Filled in from the streams and /status; the script itself never changes\n"
+    "let lastSeq = 0;\n"
+    "let maxMessages = 100;\n"
+    "let username = '';\n"
+    "let socket = null;\n"
+    "// Every endpoint is scoped to the room named in the page URL, /?room=<name>\n"
+    "const room = new URLSearchParams(location.search).get('room') || 'lobby';\n"
+    "const roomQuery = 'room=' + encodeURIComponent(room);\n"
+    "\n"
+    "function sendMessage() {\n"
+    "    const usernameInput = document.getElementById('username');\n"
+    "    const messageInput = document.getElementById('messageInput');\n"
+    "    \n"
+    "    username = usernameInput.value.trim();\n"
+    "    const message = messageInput.value.trim();\n"
+    "    \n"
+    "    if (!username) {\n"
+    "        alert('Please enter your name first!');\n"
+    "        usernameInput.focus();\n"
+    "        return;\n"
+    "    }\n"
+    "    \n"
+    "    if (!message) {\n"
+    "        alert('Please enter a message!');\n"
+    "        messageInput.focus();\n"
+    "        return;\n"
+    "    }\n"
+    "    \n"
+    "    const body = `username=${encodeURIComponent(username)}&message=${encodeURIComponent(message)}`;\n"
+    "    if (socket && socket.readyState === WebSocket.OPEN) {\n"
+    "        socket.send(body);\n"
+    "        messageInput.value = '';\n"
+    "        messageInput.focus();\n"
+    "        return;\n"
+    "    }\n"
+    "    \n"
+    "    // Send message via POST request\n"
+    "    fetch('/send?' + roomQuery, {\n"
+    "        method: 'POST',\n"
+    "        headers: { 'Content-Type': 'application/x-www-form-urlencoded' },\n"
+    "        body: body\n"
+    "    })\n"
+    "    .then(response => response.text())\n"
+    "    .then(data => {\n"
+    "        messageInput.value = '';\n"
+    "        messageInput.focus();\n"
+    "    })\n"
+    "    .catch(error => {\n"
+    "        document.getElementById('status').textContent = 'Error sending message. Please try again.';\n"
+    "    });\n"
+    "}\n"
+    "\n"
+    "function applyUpdate(update) {\n"
+    "    const chatArea = document.getElementById('chatArea');\n"
+    "    // Ignore deltas we already applied through another path\n"
+    "    if (!update.reset && update.seq <= lastSeq) return;\n"
+    "    if (!isNaN(update.seq)) lastSeq = update.seq;\n"
+    "    if (update.reset) {\n"
+    "        chatArea.innerHTML = update.html;\n"
+    "    } else if (update.html) {\n"
+    "        chatArea.insertAdjacentHTML('beforeend', update.html);\n"
+    "        while (chatArea.children.length > maxMessages) chatArea.firstElementChild.remove();\n"
+    "    } else {\n"
+    "        return;\n"
+    "    }\n"
+    "    // Scroll to bottom\n"
+    "    chatArea.scrollTop = chatArea.scrollHeight;\n"
+    "}\n"
+    "\n"
+    "// Long-poll fallback: the server holds the request until something new arrives\n"
+    "function waitForMessages() {\n"
+    "    fetch('/messages/wait?since=' + lastSeq + '&' + roomQuery)\n"
+    "    .then(response => response.text().then(html => ({\n"
+    "        seq: parseInt(response.headers.get('X-Last-Seq')),\n"
+    "        reset: response.headers.get('X-History-Reset') === '1',\n"
+    "        html: html\n"
+    "    })))\n"
+    "    .then(update => {\n"
+    "        applyUpdate(update);\n"
+    "        waitForMessages();\n"
+    "    })\n"
+    "    .catch(error => {\n"
+    "        console.error('Error updating chat:', error);\n"
+    "        setTimeout(waitForMessages, 2000);\n"
+    "    });\n"
+    "}\n"
+    "\n"
+    "function streamMessages() {\n"
+    "    const events = new EventSource('/events?since=' + lastSeq + '&' + roomQuery);\n"
+    "    const onEvent = reset => event => applyUpdate({\n"
+    "        seq: parseInt(event.lastEventId), reset: reset, html: event.data\n"
+    "    });\n"
+    "    events.addEventListener('message', onEvent(false));\n"
+    "    events.addEventListener('reset', onEvent(true));\n"
+    "}\n"
+    "\n"
+    "// Each frame is \"<seq> <reset>\\n\" followed by the new messages' HTML\n"
+    "function connectSocket() {\n"
+    "    const scheme = location.protocol === 'https:' ? 'wss://' : 'ws://';\n"
+    "    const ws = new WebSocket(scheme + location.host + '/ws?since=' + lastSeq + '&' + roomQuery);\n"
+    "    let opened = false;\n"
+    "    ws.onopen = () => { opened = true; socket = ws; };\n"
+    "    ws.onmessage = event => {\n"
+    "        const newline = event.data.indexOf('\\n');\n"
+    "        const header = event.data.substring(0, newline).split(' ');\n"
+    "        applyUpdate({\n"
+    "            seq: parseInt(header[0]), reset: header[1] === '1', html: event.data.substring(newline + 1)\n"
+    "        });\n"
+    "    };\n"
+    "    ws.onclose = () => {\n"
+    "        socket = null;\n"
+    "        // Never connected: WebSockets are blocked somewhere, use the HTTP transports\n"
+    "        if (!opened) startHttpUpdates(); else setTimeout(connectSocket, 2000);\n"
+    "    };\n"
+    "}\n"
+    "\n"
+    "function startHttpUpdates() {\n"
+    "    if (window.EventSource) {\n"
+    "        streamMessages();\n"
+    "    } else {\n"
+    "        waitForMessages();\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Handle Enter key\n"
+    "document.getElementById('messageInput').addEventListener('keypress', function(event) {\n"
+    "    if (event.key === 'Enter') {\n"
+    "        sendMessage();\n"
+    "    }\n"
+    "});\n"
+    "\n"
+    "document.getElementById('username').addEventListener('keypress', function(event) {\n"
+    "    if (event.key === 'Enter') {\n"
+    "        document.getElementById('messageInput').focus();\n"
+    "    }\n"
+    "});\n"
+    "\n"
+    "// New messages are pushed; nothing is fetched while the room is idle\n"
+    "if (window.WebSocket) {\n"
+    "    connectSocket();\n"
+    "} else {\n"
+    "    startHttpUpdates();\n"
+    "}\n"
+    "\n"
+    "// Server address, online count and history size are the only dynamic parts of the page\n"
+    "fetch('/status?' + roomQuery)\n"
+    ".then(response => response.json())\n"
+    ".then(status => {\n"
+    "    document.getElementById('serverAddress').textContent = status.server + ' #' + status.room;\n"
+    "    document.getElementById('clientCount').textContent = status.clients + ' users online';\n"
+    "    maxMessages = status.history;\n"
+    "});\n"
+    "\n"
+    "// Initial focus\n"
+    "document.getElementById('username').focus();\n";
+
+// Page shell served as /; the two %s are the stylesheet and script versions
+const char chat_page_shell[] =
+    "<!DOCTYPE html>\n"
+    "<html>\n"
+    "<head>\n"
+    "<meta charset='UTF-8'>\n"
+    "<meta name='viewport' content='width=device-width, initial-scale=1.0'>\n"
+    "<title>WiFi Chat Room</title>\n"
+    "<link rel='stylesheet' href='/app.css?v=%s'>\n"
+    "</head>\n"
+    "<body>\n"
+    "<div class='container'>\n"
+    "<div class='header'>\n"
+    "<h1>📱 WiFi Chat Room</h1>\n"
+    "<div>Server: <span id='serverAddress'></span> | <span class='client-count' id='clientCount'>0 users online</span></div>\n"
+    "</div>\n"
+    "<div class='chat-area' id='chatArea'>\n"
+    "</div>\n"
+    "<div class='input-area'>\n"
+    "<div class='input-group'>\n"
+    "<input type='text' id='username' placeholder='Your name' maxlength='30'>\n"
+    "<input type='text' id='messageInput' placeholder='Type your message...' maxlength='200'>\n"
+    "<button onclick='sendMessage()'>Send</button>\n"
+    "</div>\n"
+    "<div class='status' id='status'>Enter your name and start chatting!</div>\n"
+    "</div>\n"
+    "</div>\n"
+    "\n"
+    "<script src='/app.js?v=%s'></script>\n"
+    "</body>\n"
+    "</html>";
+
+// Immutable asset kept in memory with its precompressed variants
+typedef struct {
+    const char *path;
+    const char *content_type;
+    const char *cache_control;
+    const char *body;
+    size_t len;
+    char *gzip;                     // NULL when compressing did not help
+    size_t gzip_len;
+    char *brotli;
+    size_t brotli_len;
+    char etag[24];                  // quoted content hash
+} static_asset_t;
+
+enum {
+    ASSET_SHELL,
+    ASSET_CSS,
+    ASSET_JS,
+    ASSET_COUNT
+};
+
+static_asset_t static_assets[ASSET_COUNT];
+
+// FNV-1a content hash used for ETags and asset versions
+uint64_t hash_bytes(const char* data, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// gzip-compress data; returns NULL unless the result is smaller
+char* gzip_compress(const char* data, size_t len, size_t *out_len) {
+    z_stream stream = { 0 };
+    if (deflateInit2(&stream, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t cap = deflateBound(&stream, len);
+    char *out = malloc(cap);
+    if (out == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = len;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = cap;
+    int result = deflate(&stream, Z_FINISH);
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    
+    if (result != Z_STREAM_END || *out_len >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Brotli-compress data at maximum quality; returns NULL unless the result is smaller
+char* brotli_compress(const char* data, size_t len, size_t *out_len) {
+    size_t cap = BrotliEncoderMaxCompressedSize(len);
+    char *out = cap ? malloc(cap) : NULL;
+    if (out == NULL) {
+        return NULL;
+    }
+    
+    *out_len = cap;
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t*)data, out_len, (uint8_t*)out) ||
+        *out_len >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Fill in an asset: hash it and compress it once, at startup
+void init_static_asset(static_asset_t *asset, const char* path, const char* content_type,
+                       const char* cache_control, const char* body, size_t len) {
+    asset->path = path;
+    asset->content_type = content_type;
+    asset->cache_control = cache_control;
+    asset->body = body;
+    asset->len = len;
+    snprintf(asset->etag, sizeof(asset->etag), "\"%016llx\"",
+             (unsigned long long)hash_bytes(body, len));
+    asset->gzip = gzip_compress(body, len, &asset->gzip_len);
+    asset->brotli = brotli_compress(body, len, &asset->brotli_len);
+}
+
+// Build the page assets; the shell links the stylesheet and script by content hash
+int init_static_assets() {
+    static char shell[sizeof(chat_page_shell) + 64];
+    const char *immutable = "public, max-age=31536000, immutable";
+    
+    init_static_asset(&static_assets[ASSET_CSS], "/app.css", "text/css; charset=utf-8",
+                      immutable, chat_page_css, strlen(chat_page_css));
+    init_static_asset(&static_assets[ASSET_JS], "/app.js", "application/javascript; charset=utf-8",
+                      immutable, chat_page_js, strlen(chat_page_js));
+    
+    // Strip the quotes off the ETags to use them as version query strings
+    char css_version[24], js_version[24];
+    snprintf(css_version, sizeof(css_version), "%.16s", static_assets[ASSET_CSS].etag + 1);
+    snprintf(js_version, sizeof(js_version), "%.16s", static_assets[ASSET_JS].etag + 1);
+    int shell_len = snprintf(shell, sizeof(shell), chat_page_shell, css_version, js_version);
+    if (shell_len < 0 || shell_len >= (int)sizeof(shell)) {
+        return -1;
+    }
+    
+    // The shell is revalidated on every visit so new asset versions are picked up
+    init_static_asset(&static_assets[ASSET_SHELL], "/", "text/html; charset=utf-8",
+                      "no-cache", shell, shell_len);
+    return 0;
+}
+
+// Find an asset by path
+const static_asset_t* find_static_asset(const char* path) {
+    for (int i = 0; i < ASSET_COUNT; i++) {
+        if (strcmp(static_assets[i].path, path) == 0) {
+            return &static_assets[i];
+        }
+    }
+    return NULL;
+}
+
+// Check whether a comma-separated Accept or Accept-Encoding value allows coding (q=0 means refused)
+int accepts_token(const char* accept, const char* coding) {
+    size_t coding_len = strlen(coding);
+    const char *token = accept;
+    
+    while (token && *token && *token != '\r') {
+        while (*token == ' ' || *token == ',') {
+            token++;
+        }
+        size_t token_len = strcspn(token, ",;\r ");
+        if (token_len == coding_len && strncasecmp(token, coding, coding_len) == 0) {
+            const char *params = token + token_len;
+            const char *end = params + strcspn(params, ",\r");
+            const char *q = strstr(params, "q=");
+            return !(q && q < end && strtod(q + 2, NULL) == 0);
+        }
+        token = strchr(token, ',');
+    }
+    return 0;
+}
+
+// Offset of the first '%' or '+' in p[0, len), or len; AVX2 or SSE2 when the build targets them
+size_t find_form_escape(const char* p, size_t len) {
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i percent32 = _mm256_set1_epi8('%'), plus32 = _mm256_set1_epi8('+');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, percent32), _mm256_cmpeq_epi8(v, plus32));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    __m128i percent16 = _mm_set1_epi8('%'), plus16 = _mm_set1_epi8('+');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, percent16), _mm_cmpeq_epi8(v, plus16));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == '%' || p[i] == '+') {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Value of one hex digit, -1 for any other byte
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Decode form-urlencoded bytes in place and return the decoded length; the output never outgrows
+// the input. Form values are mostly short words between escapes, which the byte loop handles best;
+// once a plain run reaches FORM_VECTOR_RUN bytes with at least as many left, the rest of it is found
+// a vector at a time and moved as one block. Malformed escapes and %00 are kept literally.
+size_t form_decode(char* s, size_t len) {
+    size_t in = 0, out = 0, plain = 0;
+    
+    while (in < len) {
+        char c = s[in];
+        if (c == '+') {
+            s[out++] = ' ';
+            in++;
+            plain = 0;
+        } else if (c == '%') {
+            int high, low;
+            if (in + 2 < len && (high = hex_value(s[in + 1])) >= 0 && (low = hex_value(s[in + 2])) >= 0 &&
+                (high | low) != 0) {
+                s[out++] = (char)(high << 4 | low);
+                in += 3;
+            } else {
+                s[out++] = s[in++];
+            }
+            plain = 0;
+        } else if (plain < FORM_VECTOR_RUN || len - in < FORM_VECTOR_RUN) {
+            s[out++] = c;
+            in++;
+            plain++;
+        } else {
+            size_t run = find_form_escape(s + in, len - in);
+            if (out != in) {
+                memmove(s + out, s + in, run);
+            }
+            in += run;
+            out += run;
+            plain = 0;
+        }
+    }
+    return out;
+}
+
+// Split off the next name=value pair of a form body, decoding both in place.
+// Returns 0 once the form is exhausted; name and value come back NUL-terminated inside the buffer.
+int next_form_field(char** cursor, char* end, char** name, char** value) {
+    while (*cursor < end) {
+        char *field = *cursor;
+        char *field_end = memchr(field, '&', end - field);
+        if (field_end == NULL) {
+            field_end = end;
+        }
+        *cursor = field_end < end ? field_end + 1 : end;
+        
+        char *equals = memchr(field, '=', field_end - field);
+        char *value_start = equals ? equals + 1 : field_end;
+        size_t name_len = form_decode(field, (equals ? equals : field_end) - field);
+        size_t value_len = form_decode(value_start, field_end - value_start);
+        
+        // Decoding only shrinks, so both terminators land on bytes this field already owned
+        field[name_len] = '\0';
+        value_start[value_len] = '\0';
+        if (name_len > 0) {
+            *name = field;
+            *value = value_start;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Length of at most max bytes of s that does not end inside a UTF-8 sequence
+size_t utf8_clip(const char* s, size_t max) {
+    size_t len = strnlen(s, max + 1);
+    if (len <= max) {
+        return len;
+    }
+    len = max;
+    while (len > 0 && ((unsigned char)s[len] & 0xC0) == 0x80) {
+        len--;
+    }
+    return len;
+}
+
+// Compare a slice against a C string, ignoring ASCII case
+int slice_equals(slice_t slice, const char* text) {
+    return slice.len == strlen(text) && strncasecmp(slice.data, text, slice.len) == 0;
+}
+
+// Look up a header of the parsed request; the slice is empty (data NULL) when absent
+slice_t request_header(const http_request_t *req, const char* name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (slice_equals(req->headers[i].name, name)) {
+            return req->headers[i].value;
+        }
+    }
+    slice_t none = { NULL, 0 };
+    return none;
+}
+
+// Does a comma-separated header value list the given token?
+int slice_has_token(slice_t value, const char* token) {
+    size_t token_len = strlen(token);
+    const char *p = value.data;
+    const char *end = value.data + value.len;
+    
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *item = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char *item_end = p;
+        while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+            item_end--;
+        }
+        if ((size_t)(item_end - item) == token_len && strncasecmp(item, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Stop parsing and remember which status the request earned
+long reject_request(http_request_t *req, const char* status) {
+    req->state = PARSE_ERROR;
+    req->error = status;
+    return -1;
+}
+
+// Request line: METHOD SP request-target SP HTTP-version; splits and terminates path and query in place
+long parse_request_line(http_request_t *req, char* line, size_t len) {
+    char *end = line + len;
+    char *target = memchr(line, ' ', len);
+    if (target == NULL || target == line) {
+        return reject_request(req, "400 Bad Request");
+    }
+    req->method.data = line;
+    req->method.len = target - line;
+    for (const char *c = line; c < target; c++) {
+        if (!isupper((unsigned char)*c)) {
+            return reject_request(req, "400 Bad Request");
+        }
+    }
+    
+    target++;
+    char *version = memchr(target, ' ', end - target);
+    if (version == NULL || version == target || *target != '/') {
+        return reject_request(req, "400 Bad Request");
+    }
+    *version++ = '\0';
+    if (end - version != 8 || strncmp(version, "HTTP/1.", 7) != 0 ||
+        (version[7] != '0' && version[7] != '1')) {
+        return reject_request(req, "505 HTTP Version Not Supported");
+    }
+    req->http10 = version[7] == '0';
+    
+    char *query = memchr(target, '?', version - 1 - target);
+    req->path.data = target;
+    if (query) {
+        *query++ = '\0';
+        req->path.len = query - 1 - target;
+        req->query.data = query;
+        req->query.len = version - 1 - query;
+    } else {
+        req->path.len = version - 1 - target;
+        req->query.data = version - 1;
+        req->query.len = 0;
+    }
+    req->state = PARSE_HEADERS;
+    return 0;
+}
+
+// One "Name: value" line; optional whitespace around the value is left out of the slice
+long parse_header_line(http_request_t *req, char* line, size_t len) {
+    char *colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line) {
+        return reject_request(req, "400 Bad Request");
+    }
+    for (const char *c = line; c < colon; c++) {
+        if (*c == ' ' || *c == '\t') {
+            return reject_request(req, "400 Bad Request");
+        }
+    }
+    if (req->state == PARSE_TRAILERS) {
+        return 0;
+    }
+    if (req->header_count >= http_limits.max_headers) {
+        return reject_request(req, "431 Request Header Fields Too Large");
+    }
+    
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    http_header_t *header = &req->headers[req->header_count++];
+    header->name.data = line;
+    header->name.len = colon - line;
+    header->value.data = value;
+    header->value.len = end - value;
+    return 0;
+}
+
+// How many times a header was sent; *differs is set when a repeat's value is not the first one's
+int count_header(const http_request_t *req, const char* name, int *differs) {
+    slice_t first = { NULL, 0 };
+    int count = 0;
+    *differs = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        if (slice_equals(req->headers[i].name, name)) {
+            slice_t value = req->headers[i].value;
+            if (count++ == 0) {
+                first = value;
+            } else if (value.len != first.len || memcmp(value.data, first.data, value.len) != 0) {
+                *differs = 1;
+            }
+        }
+    }
+    return count;
+}
+
+// Blank line after the headers: work out how the body is framed
+long finish_headers(http_request_t *req) {
+    slice_t encoding = request_header(req, "Transfer-Encoding");
+    slice_t length = request_header(req, "Content-Length");
+    int length_differs, encoding_differs;
+    
+    // request_header only sees the first of each, and a proxy may have acted on another. Repeated
+    // identical lengths are one length; a repeated encoding applies chunked twice, which nobody can read.
+    if ((count_header(req, "Content-Length", &length_differs) > 1 && length_differs) ||
+        count_header(req, "Transfer-Encoding", &encoding_differs) > 1) {
+        return reject_request(req, "400 Bad Request");
+    }
+    
+    if (encoding.data) {
+        // Both framings at once is how requests get smuggled past proxies
+        if (length.data) {
+            return reject_request(req, "400 Bad Request");
+        }
+        if (!slice_equals(encoding, "chunked")) {
+            return reject_request(req, "501 Not Implemented");
+        }
+        req->chunked = 1;
+        req->body_start = req->pos;
+        req->state = PARSE_CHUNK_SIZE;
+        return 0;
+    }
+    
+    if (length.data) {
+        size_t value = 0;
+        if (length.len == 0) {
+            return reject_request(req, "400 Bad Request");
+        }
+        for (size_t i = 0; i < length.len; i++) {
+            if (!isdigit((unsigned char)length.data[i])) {
+                return reject_request(req, "400 Bad Request");
+            }
+            value = value * 10 + (length.data[i] - '0');
+            if (value > http_limits.max_body) {
+                return reject_request(req, "413 Payload Too Large");
+            }
+        }
+        req->content_length = value;
+    }
+    req->body_start = req->pos;
+    req->state = req->content_length > 0 ? PARSE_BODY : PARSE_DONE;
+    return 0;
+}
+
+// Chunk size line: hex digits, optionally followed by ;extensions we ignore
+long parse_chunk_size(http_request_t *req, const char* line, size_t len) {
+    size_t size = 0;
+    size_t i = 0;
+    for (; i < len && isxdigit((unsigned char)line[i]); i++) {
+        int digit = isdigit((unsigned char)line[i]) ? line[i] - '0'
+                                                    : (tolower((unsigned char)line[i]) - 'a' + 10);
+        size = size * 16 + digit;
+        if (req->body_len + size > http_limits.max_body) {
+            return reject_request(req, "413 Payload Too Large");
+        }
+    }
+    if (i == 0 || (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+        return reject_request(req, "400 Bad Request");
+    }
+    req->chunk_left = size;
+    req->state = size > 0 ? PARSE_CHUNK_DATA : PARSE_TRAILERS;
+    return 0;
+}
+
+// Advance the parser over whatever has arrived in in_buf since the last call.
+// Returns the length of the complete request, 0 if more bytes are needed, -1 if it was rejected.
+long parse_request(http_conn_t *conn) {
+    if (conn->in_len == 0) {
+        return 0;
+    }
+    http_request_t *req = conn->req;
+    char *buf = conn->in_buf;
+    
+    while (1) {
+        if (req->state == PARSE_DONE) {
+            return req->pos;
+        }
+        if (req->state == PARSE_ERROR) {
+            return -1;
+        }
+        
+        if (req->state == PARSE_BODY) {
+            if (conn->in_len - req->body_start < req->content_length) {
+                return 0;
+            }
+            req->body_len = req->content_length;
+            req->pos = req->body_start + req->content_length;
+            req->state = PARSE_DONE;
+            continue;
+        }
+        
+        if (req->state == PARSE_CHUNK_DATA) {
+            // Slide chunk data down against the body so far and drop the framing from the buffer
+            size_t n = conn->in_len - req->pos;
+            if (n > req->chunk_left) {
+                n = req->chunk_left;
+            }
+            size_t body_end = req->body_start + req->body_len;
+            if (body_end != req->pos) {
+                memmove(buf + body_end, buf + req->pos, conn->in_len - req->pos);
+                conn->in_len -= req->pos - body_end;
+                req->pos = body_end;
+            }
+            req->body_len += n;
+            req->pos += n;
+            req->scan = req->pos;
+            req->chunk_left -= n;
+            if (req->chunk_left > 0) {
+                return 0;
+            }
+            req->state = PARSE_CHUNK_END;
+            continue;
+        }
+        
+        // Everything else is line based; only look at bytes not yet searched for CRLF
+        char *eol = conn->in_len > req->scan
+            ? memmem(buf + req->scan, conn->in_len - req->scan, "\r\n", 2) : NULL;
+        size_t header_room = req->header_bytes + 2 < http_limits.max_header_bytes
+                           ? http_limits.max_header_bytes - req->header_bytes - 2 : 0;
+        size_t line_limit = req->state == PARSE_REQUEST_LINE ? http_limits.max_request_line
+                          : req->state == PARSE_CHUNK_SIZE || req->state == PARSE_CHUNK_END
+                          ? MAX_CHUNK_LINE : header_room;
+        size_t line_len = eol ? (size_t)(eol - (buf + req->pos)) : conn->in_len - req->pos;
+        if (line_len > line_limit) {
+            return reject_request(req, req->state == PARSE_REQUEST_LINE ? "414 URI Too Long"
+                                     : req->state == PARSE_HEADERS || req->state == PARSE_TRAILERS
+                                     ? "431 Request Header Fields Too Large" : "400 Bad Request");
+        }
+        if (eol == NULL) {
+            // A lone CR at the end may be half of the CRLF we are waiting for
+            req->scan = conn->in_len > req->pos ? conn->in_len - 1 : req->pos;
+            return 0;
+        }
+        
+        char *line = buf + req->pos;
+        req->pos += line_len + 2;
+        req->scan = req->pos;
+        if (req->state != PARSE_CHUNK_SIZE && req->state != PARSE_CHUNK_END) {
+            req->header_bytes += line_len + 2;
+        }
+        
+        switch (req->state) {
+        case PARSE_REQUEST_LINE:
+            // Tolerate stray blank lines between pipelined requests
+            if (line_len > 0 && parse_request_line(req, line, line_len) < 0) {
+                return -1;
+            }
+            break;
+        case PARSE_HEADERS:
+            if (line_len == 0 ? finish_headers(req) < 0 : parse_header_line(req, line, line_len) < 0) {
+                return -1;
+            }
+            break;
+        case PARSE_CHUNK_SIZE:
+            if (parse_chunk_size(req, line, line_len) < 0) {
+                return -1;
+            }
+            break;
+        case PARSE_CHUNK_END:
+            if (line_len != 0) {
+                return reject_request(req, "400 Bad Request");
+            }
+            req->state = PARSE_CHUNK_SIZE;
+            break;
+        case PARSE_TRAILERS:
+            if (line_len == 0) {
+                req->state = PARSE_DONE;
+            } else if (parse_header_line(req, line, line_len) < 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+}
+
+// Terminate the decoded body in place; the caller restores the byte behind the request
+char* request_body(http_conn_t *conn) {
+    char *body = conn->in_buf + conn->req->body_start;
+    body[conn->req->body_len] = '\0';
+    return body;
+}
+
+// Find a query parameter's raw value and its length; NULL when absent
+const char* query_param(const char* query, const char* name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *param = query;
+    
+    while (*param) {
+        if (strncmp(param, name, name_len) == 0 && param[name_len] == '=') {
+            const char *value = param + name_len + 1;
+            *len = strcspn(value, "&");
+            return value;
+        }
+        param = strchr(param, '&');
+        if (param == NULL) {
+            break;
+        }
+        param++;
+    }
+    return NULL;
+}
+
+// Look up a numeric query parameter; returns default_value when absent
+unsigned long query_param_ulong(const char* query, const char* name, unsigned long default_value) {
+    size_t len;
+    const char *value = query_param(query, name, &len);
+    return value ? strtoul(value, NULL, 10) : default_value;
+}
+
+// Room names are 1-31 letters, digits, '-' or '_', so they pass through URLs and HTML untouched
+int valid_room_name(const char* name, size_t len) {
+    if (len == 0 || len >= sizeof(((chat_room_t*)0)->name)) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Count a room against --max-rooms at its first post; -1 when the limit is reached
+int claim_room(chat_room_t *room) {
+    if (atomic_load(&room->claimed)) {
+        return 0;
+    }
+    pthread_mutex_lock(&room->messages_mutex);
+    int ok = atomic_load(&room->claimed);
+    if (!ok && atomic_fetch_add(&room_count, 1) < max_rooms) {
+        atomic_fetch_sub(&watched_count, 1);
+        atomic_store(&room->claimed, 1);
+        ok = 1;
+    } else if (!ok) {
+        atomic_fetch_sub(&room_count, 1);
+    }
+    pthread_mutex_unlock(&room->messages_mutex);
+    return ok ? 0 : -1;
+}
+
+// Look up a room by name; mode says whether an unknown one is created. NULL when it is not, or when
+// the room limit is reached. Rooms live until the server exits, so connections keep plain pointers to them.
+chat_room_t *find_room(const char* name, size_t len, int mode) {
+    uint64_t hash = hash_bytes(name, len);
+    room_shard_t *shard = &room_shards[hash % ROOM_SHARDS];
+    chat_room_t **bucket = &shard->buckets[(hash / ROOM_SHARDS) % ROOM_BUCKETS];
+    
+    pthread_mutex_lock(&shard->mutex);
+    for (chat_room_t *room = *bucket; room; room = room->next) {
+        if (strlen(room->name) == len && memcmp(room->name, name, len) == 0) {
+            pthread_mutex_unlock(&shard->mutex);
+            return mode == ROOM_POST && claim_room(room) < 0 ? NULL : room;
+        }
+    }
+    
+    chat_room_t *room = NULL;
+    atomic_int *count = mode == ROOM_POST ? &room_count : &watched_count;
+    if (mode != ROOM_LOOKUP && atomic_fetch_add(count, 1) < max_rooms) {
+        room = calloc(1, sizeof(chat_room_t));
+    }
+    if (room == NULL) {
+        if (mode != ROOM_LOOKUP) {
+            atomic_fetch_sub(count, 1);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        return NULL;
+    }
+    memcpy(room->name, name, len);
+    atomic_init(&room->claimed, mode == ROOM_POST);
+    pthread_mutex_init(&room->messages_mutex, NULL);
+    pthread_mutex_init(&room->render_mutex, NULL);
+    room->next = *bucket;
+    *bucket = room;
+    pthread_mutex_unlock(&shard->mutex);
+    return room;
+}
+
+// The request's ?room=, the lobby when absent
+const char* request_room_name(http_conn_t *conn, size_t *len) {
+    const char *name = query_param(conn->req->query.data, "room", len);
+    if (name == NULL) {
+        *len = strlen(DEFAULT_ROOM);
+        return DEFAULT_ROOM;
+    }
+    return name;
+}
+
+// Name to report for a room; a read of one nobody has posted to has empty_room, so it comes from the request
+const char* reported_room_name(http_conn_t *conn, chat_room_t *room, size_t *len) {
+    if (room == &empty_room) {
+        return request_room_name(conn, len);
+    }
+    *len = strlen(room->name);
+    return room->name;
+}
+
+// Resolve the request's ?room= as find_room's mode says; reads of a room nobody has posted to get
+// empty_room. On failure the error response is queued and NULL returned.
+chat_room_t *request_room(http_conn_t *conn, int mode) {
+    size_t len;
+    const char *name = request_room_name(conn, &len);
+    if (!valid_room_name(name, len)) {
+        conn->keep_alive = 0;
+        send_http_response(conn, "400 Bad Request", "text/plain", "Room names are 1-31 letters, digits, '-' or '_'");
+        return NULL;
+    }
+    chat_room_t *room = find_room(name, len, mode);
+    if (room == NULL && mode == ROOM_LOOKUP) {
+        return &empty_room;
+    }
+    if (room == NULL) {
+        conn->keep_alive = 0;
+        send_http_response(conn, "503 Service Unavailable", "text/plain", "No more rooms can be created");
+    }
+    return room;
+}
+
+// Restate every room's retained history at the start of a new log segment
+void write_log_snapshot(log_snapshot_t *snap) {
+    for (int s = 0; s < ROOM_SHARDS; s++) {
+        // Rooms are pushed on the front of their bucket and never unlinked or freed, so the chains
+        // behind a copy of the heads can be walked without the lock that find_room needs
+        chat_room_t *heads[ROOM_BUCKETS];
+        pthread_mutex_lock(&room_shards[s].mutex);
+        memcpy(heads, room_shards[s].buckets, sizeof(heads));
+        pthread_mutex_unlock(&room_shards[s].mutex);
+        
+        for (int b = 0; b < ROOM_BUCKETS; b++) {
+            for (chat_room_t *room = heads[b]; room; room = room->next) {
+                unsigned long first_seq, last_seq;
+                get_history_bounds(room, &first_seq, &last_seq);
+                for (unsigned long seq = first_seq; seq != 0 && seq <= last_seq; seq++) {
+                    chat_message_t msg;
+                    if (read_history_message(room, seq, &msg) < 0) {
+                        // Lapped by new posts; those are in the batches that follow
+                        continue;
+                    }
+                    log_snapshot_add(snap, room->name, strlen(room->name), msg.seq, msg.posted,
+                                     msg.username, strlen(msg.username), msg.message, strlen(msg.message));
+                }
+            }
+        }
+    }
+}
+
+// Turn a checked log record back into a rendered message
+void decode_log_record(const log_record_t *rec, chat_message_t *msg) {
+    const char *room_name = (const char*)(rec + 1);
+    char username[sizeof(((chat_message_t*)0)->username)];
+    char message[sizeof(((chat_message_t*)0)->message)];
+    
+    memcpy(username, room_name + rec->room_len, rec->username_len);
+    username[rec->username_len] = '\0';
+    memcpy(message, room_name + rec->room_len + rec->username_len, rec->message_len);
+    message[rec->message_len] = '\0';
+    fill_message(msg, rec->seq, rec->posted, username, message);
+}
+
+// Put a recovered record back into its room's ring; repeats from a snapshot overlap are skipped
+int restore_log_record(const log_record_t *rec) {
+    chat_room_t *room = find_room((const char*)(rec + 1), rec->room_len, ROOM_POST);
+    if (room == NULL) {
+        return 0;
+    }
+    unsigned long last_seq = atomic_load_explicit(&room->last_seq, memory_order_relaxed);
+    if (rec->seq <= last_seq) {
+        return 0;
+    }
+    
+    // A gap means what came before is gone for good; the readable window starts here
+    chat_message_t msg;
+    decode_log_record(rec, &msg);
+    if (last_seq == 0 || rec->seq != last_seq + 1) {
+        room->oldest_seq = rec->seq;
+    }
+    if (store_history_message(room, rec->seq, rec->posted, msg.username, msg.message) < 0) {
+        return 0;
+    }
+    atomic_store(&room->last_seq, rec->seq);
+    return 1;
+}
+
+// Index cursor of the room a logged record belongs to
+log_room_index_t *room_log_index(const char* name, size_t len) {
+    chat_room_t *room = find_room(name, len, ROOM_LOOKUP);
+    return room ? &room->index : NULL;
+}
+
+// Reference counting for pages in the history cache
+void retain_history_page(void *page) {
+    atomic_fetch_add(&((rendered_history_t*)page)->refs, 1);
+}
+
+void release_history_page(void *page) {
+    release_rendered_history(page);
+}
+
+// Pages read from the log, rendered like the live cache so responses can share them; shared by every event loop
+log_page_cache_t history_cache = LOG_CACHE_INITIALIZER(retain_history_page, release_history_page);
+
+// Record found by log_read_page: decode it into its place on the page
+void collect_history_record(const log_record_t *rec, void *arg) {
+    chat_message_t *msgs = arg;
+    decode_log_record(rec, &msgs[(rec->seq - 1) % LOG_PAGE]);
+}
+
+// Read one page of a room's history out of the log: sequences number * LOG_PAGE + 1 onwards.
+// Sets *final when the log can add nothing more to the page, so it may be cached.
+rendered_history_t *load_history_page(chat_room_t *room, unsigned long number, int *final) {
+    unsigned long first = number * LOG_PAGE + 1;
+    chat_message_t *msgs = calloc(LOG_PAGE, sizeof(chat_message_t));
+    *final = 0;
+    if (msgs == NULL) {
+        return NULL;
+    }
+    int read = log_read_page(&chat_log, room->name, number, collect_history_record, msgs);
+    if (read < 0) {
+        free(msgs);
+        return NULL;
+    }
+    
+    // Same layout as the live render cache; messages the log no longer has render as nothing
+    size_t html_len = 0;
+    for (int i = 0; i < LOG_PAGE; i++) {
+        html_len += msgs[i].seq ? msgs[i].html_len : 0;
+    }
+    rendered_history_t *page = malloc(sizeof(rendered_history_t) + (LOG_PAGE + 1) * sizeof(size_t) + html_len + 1);
+    if (page == NULL) {
+        free(msgs);
+        return NULL;
+    }
+    atomic_init(&page->refs, 1);
+    page->first_seq = first;
+    page->last_seq = first + LOG_PAGE - 1;
+    page->offsets = (size_t*)(page + 1);
+    page->html = (char*)(page->offsets + LOG_PAGE + 1);
+    size_t len = 0;
+    for (int i = 0; i < LOG_PAGE; i++) {
+        page->offsets[i] = len;
+        if (msgs[i].seq) {
+            memcpy(page->html + len, msgs[i].html, msgs[i].html_len);
+            len += msgs[i].html_len;
+        }
+    }
+    page->offsets[LOG_PAGE] = len;
+    page->html[len] = '\0';
+    page->len = len;
+    free(msgs);
+    *final = read;
+    return page;
+}
+
+// Take a reference to a cached page of a room's history; NULL when it has to be read from the log
+rendered_history_t *find_history_page(const chat_room_t *room, unsigned long number) {
+    return log_cache_find(&history_cache, room, number);
+}
+
+// Take a reference to a rendered page of a room's history, from the cache or from the log.
+// Reads the disk on a miss, so only the worker pool calls it.
+rendered_history_t *get_history_page(chat_room_t *room, unsigned long number) {
+    rendered_history_t *page = find_history_page(room, number);
+    if (page) {
+        return page;
+    }
+    log_cache_miss(&history_cache);
+    
+    // Read without the lock; a page the log may still add to is not cached
+    int final;
+    page = load_history_page(room, number, &final);
+    if (page && final) {
+        log_cache_insert(&history_cache, room, number, page);
+    }
+    return page;
+}
+
+// Get server IP for display; looked up once by main before any event loop runs
+char* get_server_ip() {
+    static char server_ip[INET_ADDRSTRLEN];
+    struct ifaddrs *interfaces, *interface;
+    struct sockaddr_in *addr;
+    
+    if (server_ip[0] != '\0') {
+        return server_ip;
+    }
+    
+    strcpy(server_ip, "localhost");
+    
+    if (getifaddrs(&interfaces) == -1) {
+        return server_ip;
+    }
+    
+    for (interface = interfaces; interface != NULL; interface = interface->ifa_next) {
+        if (interface->ifa_addr == NULL || interface->ifa_addr->sa_family != AF_INET) 
+            continue;
+        
+        addr = (struct sockaddr_in *)interface->ifa_addr;
+        
+        if (strncmp(interface->ifa_name, "wlan", 4) == 0 || 
+            strncmp(interface->ifa_name, "wlp", 3) == 0 ||
+            strncmp(interface->ifa_name, "wifi", 4) == 0 ||
+            strncmp(interface->ifa_name, "eth", 3) == 0 ||
+            strncmp(interface->ifa_name, "enp", 3) == 0 ||
+            strncmp(interface->ifa_name, "eno", 3) == 0) {
+            
+            inet_ntop(AF_INET, &(addr->sin_addr), server_ip, INET_ADDRSTRLEN);
+            if (strcmp(server_ip, "127.0.0.1") != 0) {
+                break;
+            }
+        }
+    }
+    
+    freeifaddrs(interfaces);
+    return server_ip;
+}
+
+// Posted message handed to the worker pool for logging
+typedef struct log_job {
+    char room[32];
+    char username[64];
+    char message[256];
+    struct log_job *next;           // on log_jobs_free once printed
+} log_job_t;
+
+log_job_t *log_jobs_free = NULL;
+pthread_mutex_t log_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Reuse a printed job, or allocate one while the queue is deeper than it has been before
+log_job_t *get_log_job() {
+    pthread_mutex_lock(&log_jobs_mutex);
+    log_job_t *job = log_jobs_free;
+    if (job) {
+        log_jobs_free = job->next;
+    }
+    pthread_mutex_unlock(&log_jobs_mutex);
+    return job ? job : malloc(sizeof(log_job_t));
+}
+
+// Print a posted message off the event loop so a slow terminal never stalls it
+void log_message_job(void *arg) {
+    log_job_t *job = (log_job_t*)arg;
+    printf(" #%s %s: %s\n", job->room, job->username, job->message);
+    pthread_mutex_lock(&log_jobs_mutex);
+    job->next = log_jobs_free;
+    log_jobs_free = job;
+    pthread_mutex_unlock(&log_jobs_mutex);
+}
+
+// Seconds on the monotonic clock
+time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Unlink a connection from whichever list holds it
+void list_remove(http_conn_t *conn) {
+    conn_list_t *list = conn->list;
+    if (list == NULL) {
+        return;
+    }
+    
+    if (conn->list_prev) {
+        conn->list_prev->list_next = conn->list_next;
+    } else {
+        list->head = conn->list_next;
+    }
+    if (conn->list_next) {
+        conn->list_next->list_prev = conn->list_prev;
+    } else {
+        list->tail = conn->list_prev;
+    }
+    conn->list = NULL;
+    conn->list_prev = NULL;
+    conn->list_next = NULL;
+}
+
+// Move a connection to the tail of a list
+void list_move_tail(conn_list_t *list, http_conn_t *conn) {
+    if (conn->list == list && list->tail == conn) {
+        return;
+    }
+    list_remove(conn);
+    
+    conn->list = list;
+    conn->list_prev = list->tail;
+    if (list->tail) {
+        list->tail->list_next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+}
+
+// Add a connection to its room's waiters on the connection's own loop
+void room_attach(http_conn_t *conn, chat_room_t *room) {
+    int index = conn->loop->index;
+    conn->room = room;
+    conn->room_prev = NULL;
+    conn->room_next = room->waiters[index];
+    if (conn->room_next) {
+        conn->room_next->room_prev = conn;
+    }
+    room->waiters[index] = conn;
+    
+    // Set before the caller reads the history bounds; see add_message_to_history
+    atomic_fetch_or(&room->waiter_loops, 1ULL << index);
+}
+
+// Take a connection off its room's waiters; the loop's bit is cleared with the last one
+void room_detach(http_conn_t *conn) {
+    chat_room_t *room = conn->room;
+    if (room == NULL) {
+        return;
+    }
+    
+    int index = conn->loop->index;
+    if (conn->room_prev) {
+        conn->room_prev->room_next = conn->room_next;
+    } else {
+        room->waiters[index] = conn->room_next;
+    }
+    if (conn->room_next) {
+        conn->room_next->room_prev = conn->room_prev;
+    }
+    if (room->waiters[index] == NULL) {
+        atomic_fetch_and(&room->waiter_loops, ~(1ULL << index));
+    }
+    conn->room = NULL;
+    conn->room_prev = NULL;
+    conn->room_next = NULL;
+}
+
+// Mark a plain HTTP connection as just active
+void touch_conn(http_conn_t *conn) {
+    conn->last_active = now_seconds();
+    if (conn->mode == CONN_HTTP) {
+        list_move_tail(&conn->loop->idle, conn);
+    }
+}
+
+// Slice of the rendered history newer than since, shared by every waiter starting there
+typedef struct {
+    unsigned long since;
+    unsigned long last_seq;
+    int reset;
+    rendered_history_t *history;    // reference keeping html alive
+    const char *html;
+    size_t html_len;
+} history_delta_t;
+
+// Find a room's messages newer than since, starting over when since is outside the history window
+void render_history_delta(history_delta_t *delta, chat_room_t *room, unsigned long since) {
+    rendered_history_t *history = get_rendered_history(room);
+    unsigned long first_seq = history ? history->first_seq : 0;
+    unsigned long last_seq = history ? history->last_seq : 0;
+    
+    // A client that fell behind the history window or is ahead of a restarted server starts over
+    delta->since = since;
+    delta->reset = since == 0 || since > last_seq || (first_seq > 0 && since + 1 < first_seq);
+    delta->last_seq = last_seq;
+    delta->history = history;
+    
+    if (history == NULL) {
+        delta->html = "";
+        delta->html_len = 0;
+    } else if (delta->reset || first_seq == 0) {
+        delta->html = history->html;
+        delta->html_len = history->len;
+    } else {
+        // Nothing new leaves an empty slice, which is all the client needs
+        size_t start = history->offsets[since + 1 - first_seq];
+        delta->html = history->html + start;
+        delta->html_len = history->len - start;
+    }
+}
+
+// Drop the delta's reference to the rendered history
+void release_history_delta(history_delta_t *delta) {
+    release_rendered_history(delta->history);
+    delta->history = NULL;
+}
+
+// Queue a /messages reply carrying a rendered delta
+void send_history_delta(http_conn_t *conn, const history_delta_t *delta) {
+    char headers[128];
+    snprintf(headers, sizeof(headers), "X-Last-Seq: %lu\r\nX-History-Reset: %d\r\n",
+             delta->last_seq, delta->reset);
+    body_part_t part = { delta->html, delta->html_len, 1, delta->history };
+    send_http_response_parts(conn, "200 OK", "text/html", headers, &part, 1);
+}
+
+// Queue a /messages reply with everything in the room newer than since
+void send_messages_since(http_conn_t *conn, chat_room_t *room, unsigned long since) {
+    history_delta_t delta;
+    render_history_delta(&delta, room, since);
+    send_history_delta(conn, &delta);
+    release_history_delta(&delta);
+}
+
+// Pages of older history a /history reply needs from the log, read on the worker pool so the loop never waits on disk
+typedef struct history_load {
+    event_loop_t *loop;
+    http_conn_t *conn;              // NULL once the connection closed while the pages were read
+    chat_room_t *room;
+    unsigned long before;           // resolved when the request came in, so the reply covers what was asked
+    unsigned long limit;
+    unsigned long first_page;
+    unsigned long page_count;
+    rendered_history_t *pages[HISTORY_PARTS];   // NULL where a page could not be read
+    struct history_load *next;      // on the loop's finished_loads
+} history_load_t;
+
+// Worker job: read a load's pages, then hand it back to its connection's loop
+void load_history_job(void *arg) {
+    history_load_t *load = (history_load_t*)arg;
+    for (unsigned long i = 0; i < load->page_count; i++) {
+        load->pages[i] = get_history_page(load->room, load->first_page + i);
+    }
+    
+    event_loop_t *loop = load->loop;
+    pthread_mutex_lock(&loop->rooms_mutex);
+    load->next = loop->finished_loads;
+    loop->finished_loads = load;
+    pthread_mutex_unlock(&loop->rooms_mutex);
+    
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        // Counter already pending; the loop will wake anyway
+    }
+}
+
+// Set a /history request aside while the worker pool reads its pages; finish_history_load answers it
+void start_history_load(http_conn_t *conn, chat_room_t *room, unsigned long before, unsigned long limit,
+                        unsigned long first_page, unsigned long page_count) {
+    history_load_t *load = calloc(1, sizeof(history_load_t));
+    if (load == NULL) {
+        send_http_response(conn, "503 Service Unavailable", "text/plain", "History is unavailable; try again");
+        return;
+    }
+    load->loop = conn->loop;
+    load->conn = conn;
+    load->room = room;
+    load->before = before;
+    load->limit = limit;
+    load->first_page = first_page;
+    load->page_count = page_count;
+    
+    // Pipelined requests wait behind it, and the idle sweep leaves it alone
+    conn->mode = CONN_LOADING;
+    conn->load = load;
+    list_remove(conn);
+    submit_work(load_history_job, load);
+}
+
+// Queue a /history reply: up to limit messages older than before, oldest first. The ring serves what
+// it still holds and the log the rest; X-First-Seq is the oldest sequence sent, the next page's before.
+// Log pages come from the cache or from load; when one is in neither, the request waits for a new load.
+void send_history_before(http_conn_t *conn, chat_room_t *room, unsigned long before, unsigned long limit,
+                         history_load_t *load) {
+    rendered_history_t *recent = get_rendered_history(room);
+    unsigned long ring_first = recent ? recent->first_seq : 0;
+    unsigned long newest = recent ? recent->last_seq : 0;
+    if (before == 0 || before > newest + 1) {
+        before = newest + 1;
+    }
+    if (limit == 0 || limit > MAX_HISTORY_LIMIT) {
+        limit = MAX_HISTORY_LIMIT;
+    }
+    unsigned long last = before - 1;
+    unsigned long first = last > limit ? last - limit + 1 : 1;
+    
+    // Gather the log pages under the part of the window the ring no longer holds
+    rendered_history_t *pages[HISTORY_PARTS] = { NULL };
+    unsigned long first_page = 0, page_count = 0;
+    unsigned long log_last = ring_first && ring_first <= last ? ring_first - 1 : last;
+    if (chat_log.dir && last > 0 && first <= log_last) {
+        int missing = 0;
+        first_page = (first - 1) / LOG_PAGE;
+        page_count = (log_last - 1) / LOG_PAGE - first_page + 1;
+        for (unsigned long i = 0; i < page_count; i++) {
+            unsigned long number = first_page + i;
+            if (load && number >= load->first_page && number - load->first_page < load->page_count) {
+                // A page the worker could not read is skipped, as if there were no log
+                if ((pages[i] = load->pages[number - load->first_page]) != NULL) {
+                    atomic_fetch_add(&pages[i]->refs, 1);
+                }
+            } else if ((pages[i] = find_history_page(room, number)) == NULL) {
+                missing = 1;
+            }
+        }
+        if (missing) {
+            for (unsigned long i = 0; i < page_count; i++) {
+                release_rendered_history(pages[i]);
+            }
+            release_rendered_history(recent);
+            start_history_load(conn, room, before, limit, first_page, page_count);
+            return;
+        }
+    }
+    
+    body_part_t parts[HISTORY_PARTS] = { { 0 } };
+    int part_count = 0;
+    unsigned long sent_first = 0, sent_last = 0;
+    
+    unsigned long seq = first;
+    while (last > 0 && seq <= last && part_count < HISTORY_PARTS) {
+        rendered_history_t *source;
+        unsigned long stop = last;
+        if (ring_first && seq >= ring_first) {
+            source = recent;
+        } else if (page_count && (source = pages[(seq - 1) / LOG_PAGE - first_page]) != NULL) {
+            if (stop > source->last_seq) {
+                stop = source->last_seq;
+            }
+            if (ring_first && stop >= ring_first) {
+                stop = ring_first - 1;
+            }
+        } else {
+            // Nothing older than the ring survives without a log
+            if (ring_first == 0) {
+                break;
+            }
+            seq = ring_first;
+            continue;
+        }
+        
+        size_t start = source->offsets[seq - source->first_seq];
+        size_t end = source->offsets[stop - source->first_seq + 1];
+        parts[part_count++] = (body_part_t){ source->html + start, end - start, 1, source };
+        if (sent_first == 0) {
+            sent_first = seq;
+        }
+        sent_last = stop;
+        seq = stop + 1;
+    }
+    
+    char headers[128];
+    snprintf(headers, sizeof(headers), "X-First-Seq: %lu\r\nX-Last-Seq: %lu\r\n", sent_first, sent_last);
+    send_http_response_parts(conn, "200 OK", "text/html", headers, parts, part_count);
+    for (unsigned long i = 0; i < page_count; i++) {
+        release_rendered_history(pages[i]);
+    }
+    release_rendered_history(recent);
+}
+
+// Write v in decimal without a terminator; returns the digit count. snprintf costs more than the escaping.
+size_t format_decimal(char* out, unsigned long long v) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+// Append one message as a JSON object, escaping straight into the output buffer
+int write_message_json(http_conn_t *conn, const chat_message_t *msg, int first) {
+    size_t user_len = strlen(msg->username), text_len = strlen(msg->message);
+    size_t cap = 96 + 6 * (user_len + text_len);   // any byte may become a six-byte \u escape
+    char *out = conn_reserve(conn, cap);
+    if (out == NULL) {
+        return -1;
+    }
+    size_t len = 0;
+    if (!first) {
+        out[len++] = ',';
+    }
+    memcpy(out + len, "{\"seq\":", 7);
+    len += format_decimal(out + len + 7, msg->seq) + 7;
+    memcpy(out + len, ",\"posted\":", 10);
+    len += format_decimal(out + len + 10, msg->posted > 0 ? msg->posted : 0) + 10;
+    memcpy(out + len, ",\"user\":\"", 9);
+    len += 9;
+    len += markup_escape(out + len, cap - len, msg->username, user_len, 1);
+    memcpy(out + len, "\",\"text\":\"", 10);
+    len += 10;
+    len += markup_escape(out + len, cap - len, msg->message, text_len, 1);
+    memcpy(out + len, "\"}", 2);
+    return conn_commit(conn, len + 2);
+}
+
+// Append one message as a binary record: seq and posted Unix time as 8-byte big-endian integers,
+// the name length in one byte, the text length in two, then name and text. 19 bytes plus the text.
+int write_message_binary(http_conn_t *conn, const chat_message_t *msg) {
+    size_t user_len = strlen(msg->username), text_len = strlen(msg->message);
+    unsigned char *out = (unsigned char*)conn_reserve(conn, 19 + user_len + text_len);
+    if (out == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint64_t)msg->seq >> (56 - 8 * i);
+        out[8 + i] = (uint64_t)msg->posted >> (56 - 8 * i);
+    }
+    out[16] = user_len;
+    out[17] = text_len >> 8;
+    out[18] = text_len;
+    memcpy(out + 19, msg->username, user_len);
+    memcpy(out + 19 + user_len, msg->message, text_len);
+    return conn_commit(conn, 19 + user_len + text_len);
+}
+
+// Queue an /api/messages reply: the room's messages newer than since, with the same starting-over
+// rule as /messages, serialized straight into the output buffer as JSON or binary records
+void send_api_messages(http_conn_t *conn, chat_room_t *room, unsigned long since, int binary) {
+    unsigned long first_seq, last_seq;
+    get_history_bounds(room, &first_seq, &last_seq);
+    int reset = since == 0 || since > last_seq || (first_seq > 0 && since + 1 < first_seq);
+    
+    char headers[128];
+    snprintf(headers, sizeof(headers), "X-Last-Seq: %lu\r\nX-History-Reset: %d\r\nVary: Accept\r\n",
+             last_seq, reset);
+    response_mark_t mark;
+    if (begin_http_response(conn, "200 OK", binary ? BINARY_MESSAGES_TYPE : "application/json",
+                            headers, &mark) < 0) {
+        return;
+    }
+    
+    uint64_t start = metrics_now();
+    if (!binary) {
+        char head[128];
+        size_t name_len;
+        const char *name = reported_room_name(conn, room, &name_len);
+        int len = snprintf(head, sizeof(head), "{\"room\":\"%.*s\",\"last_seq\":%lu,\"reset\":%s,\"messages\":[",
+                           (int)name_len, name, last_seq, reset ? "true" : "false");
+        conn_append(conn, head, len);
+    }
+    int first = 1;
+    for (unsigned long seq = reset ? first_seq : since + 1; seq != 0 && seq <= last_seq; seq++) {
+        chat_message_t msg;
+        if (read_history_message(room, seq, &msg) < 0) {
+            // Lapped by writers while we were copying; the client asks again from X-Last-Seq
+            continue;
+        }
+        if ((binary ? write_message_binary(conn, &msg) : write_message_json(conn, &msg, first)) < 0) {
+            break;
+        }
+        first = 0;
+    }
+    if (!binary) {
+        conn_append(conn, "]}", 2);
+    }
+    metrics_since(timing(TIME_RENDER), start);
+    finish_http_response(conn, &mark);
+}
+
+// Park a long-poll request until a newer message is posted to the room or it times out
+void park_conn(http_conn_t *conn, chat_room_t *room, unsigned long since) {
+    conn->mode = CONN_LONG_POLL;
+    conn->since = since;
+    conn->parked_at = now_seconds();
+    list_move_tail(&conn->loop->pollers, conn);
+    room_attach(conn, room);
+}
+
+// Return a parked long-poll to plain HTTP so it can be answered
+void unpark_conn(http_conn_t *conn) {
+    conn->mode = CONN_HTTP;
+    room_detach(conn);
+}
+
+// Queue one SSE event carrying a rendered delta
+void send_event_stream_update(http_conn_t *conn, const history_delta_t *delta) {
+    char line[64];
+    snprintf(line, sizeof(line), "event: %s\nid: %lu\n",
+             delta->reset ? "reset" : "message", delta->last_seq);
+    conn_append(conn, line, strlen(line));
+    
+    // Every line of the payload becomes its own data: field
+    const char *start = delta->html;
+    const char *stop = delta->html + delta->html_len;
+    do {
+        const char *end = memchr(start, '\n', stop - start);
+        size_t len = end ? (size_t)(end - start) : (size_t)(stop - start);
+        conn_append(conn, "data: ", 6);
+        conn_append_shared(conn, start, len, delta->history);
+        conn_append(conn, "\n", 1);
+        start = end ? end + 1 : stop;
+    } while (start < stop);
+    conn_append(conn, "\n", 1);
+    conn->since = delta->last_seq;
+}
+
+// Turn the connection into an SSE stream on a room and send whatever the client is missing
+void start_event_stream(http_conn_t *conn, chat_room_t *room, unsigned long since) {
+    const char *headers =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+        "retry: 2000\n\n";
+    conn_append(conn, headers, strlen(headers));
+    conn->mode = CONN_EVENT_STREAM;
+    list_move_tail(&conn->loop->streams, conn);
+    room_attach(conn, room);
+    
+    history_delta_t delta;
+    render_history_delta(&delta, room, since);
+    if (delta.last_seq != since || (delta.reset && since != 0)) {
+        send_event_stream_update(conn, &delta);
+    }
+    conn->since = delta.last_seq;
+    release_history_delta(&delta);
+}
+
+// Post a form-encoded username/message pair to a room, from /send or a WebSocket text frame.
+// Returns -1 when the room cannot be counted against --max-rooms or the post cannot be stored;
+// an incomplete form is ignored.
+int post_form_message(chat_room_t *room, char* form, size_t len, client_t *cl) {
+    char *cursor = form, *name, *value;
+    char *username = NULL, *message = NULL;
+    
+    // Fields are decoded where they sit in the connection buffer; nothing is copied until they fit
+    while (next_form_field(&cursor, form + len, &name, &value)) {
+        if (strcmp(name, "username") == 0) {
+            username = value;
+        } else if (strcmp(name, "message") == 0) {
+            message = value;
+        }
+    }
+    if (username == NULL || message == NULL || *username == '\0' || *message == '\0') {
+        return 0;
+    }
+    if (claim_room(room) < 0) {
+        return -1;
+    }
+    username[utf8_clip(username, sizeof(((chat_message_t*)0)->username) - 1)] = '\0';
+    message[utf8_clip(message, sizeof(((chat_message_t*)0)->message) - 1)] = '\0';
+    
+    if (add_message_to_history(room, username, message) < 0) {
+        return -1;
+    }
+    if (cl) {
+        snprintf(cl->name, sizeof(cl->name), "%s", username);
+    }
+    
+    log_job_t *job = get_log_job();
+    if (job) {
+        snprintf(job->room, sizeof(job->room), "%s", room->name);
+        snprintf(job->username, sizeof(job->username), "%s", username);
+        snprintf(job->message, sizeof(job->message), "%s", message);
+        submit_work(log_message_job, job);
+    }
+    return 0;
+}
+
+// SHA-1 digest, needed only for the WebSocket handshake
+void sha1(const unsigned char* data, size_t len, unsigned char digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char block[64];
+    uint64_t bit_len = (uint64_t)len * 8;
+    size_t total = ((len + 8) / 64 + 1) * 64;
+    
+    for (size_t offset = 0; offset < total; offset += 64) {
+        // Build the block from data, the 0x80 terminator and the length trailer
+        for (size_t i = 0; i < 64; i++) {
+            size_t pos = offset + i;
+            if (pos < len) {
+                block[i] = data[pos];
+            } else if (pos == len) {
+                block[i] = 0x80;
+            } else if (pos >= total - 8) {
+                block[i] = (unsigned char)(bit_len >> (8 * (total - 1 - pos)));
+            } else {
+                block[i] = 0;
+            }
+        }
+        
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+                   (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+        
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = h[i] >> 24;
+        digest[i * 4 + 1] = h[i] >> 16;
+        digest[i * 4 + 2] = h[i] >> 8;
+        digest[i * 4 + 3] = h[i];
+    }
+}
+
+// Base64-encode len bytes into out (needs 4 * ceil(len / 3) + 1 bytes)
+void base64_encode(const unsigned char* data, size_t len, char* out) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+    for (i = 0; i + 2 < len; i += 3) {
+        *out++ = alphabet[data[i] >> 2];
+        *out++ = alphabet[(data[i] & 0x03) << 4 | data[i + 1] >> 4];
+        *out++ = alphabet[(data[i + 1] & 0x0F) << 2 | data[i + 2] >> 6];
+        *out++ = alphabet[data[i + 2] & 0x3F];
+    }
+    if (i < len) {
+        *out++ = alphabet[data[i] >> 2];
+        if (i + 1 < len) {
+            *out++ = alphabet[(data[i] & 0x03) << 4 | data[i + 1] >> 4];
+            *out++ = alphabet[(data[i + 1] & 0x0F) << 2];
+        } else {
+            *out++ = alphabet[(data[i] & 0x03) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+// Queue the header of an unmasked server-to-client WebSocket frame
+void send_websocket_header(http_conn_t *conn, int opcode, size_t len) {
+    unsigned char header[10];
+    size_t header_len;
+    
+    header[0] = 0x80 | opcode;
+    if (len < 126) {
+        header[1] = len;
+        header_len = 2;
+    } else if (len <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = len >> 8;
+        header[3] = len;
+        header_len = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        }
+        header_len = 10;
+    }
+    conn_append(conn, (const char*)header, header_len);
+}
+
+// Queue one unmasked server-to-client WebSocket frame
+void send_websocket_frame(http_conn_t *conn, int opcode, const char* payload, size_t len) {
+    send_websocket_header(conn, opcode, len);
+    conn_append(conn, payload, len);
+}
+
+// Queue a text frame carrying a rendered delta: "<seq> <reset>\n" followed by the HTML
+void send_websocket_update(http_conn_t *conn, const history_delta_t *delta) {
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%lu %d\n", delta->last_seq, delta->reset);
+    send_websocket_header(conn, WS_OPCODE_TEXT, prefix_len + delta->html_len);
+    conn_append(conn, prefix, prefix_len);
+    conn_append_shared(conn, delta->html, delta->html_len, delta->history);
+    conn->since = delta->last_seq;
+}
+
+// Complete the RFC 6455 upgrade handshake, join the WebSocket registry and subscribe to a room
+void start_websocket(http_conn_t *conn, chat_room_t *room, unsigned long since) {
+    slice_t upgrade = request_header(conn->req, "Upgrade");
+    slice_t key = request_header(conn->req, "Sec-WebSocket-Key");
+    
+    if (!slice_equals(upgrade, "websocket") || key.len == 0) {
+        conn->keep_alive = 0;
+        send_http_response(conn, "400 Bad Request", "text/plain", "Expected a WebSocket upgrade");
+        return;
+    }
+    
+    client_t *cl = pool_get(conn->loop, sizeof(client_t));
+    if (cl) {
+        memset(cl, 0, sizeof(client_t));
+    }
+    if (cl == NULL || add_client(cl) < 0) {
+        pool_put(conn->loop, cl, sizeof(client_t));
+        conn->keep_alive = 0;
+        send_http_response(conn, "503 Service Unavailable", "text/plain", "Chat room is full");
+        return;
+    }
+    socklen_t address_len = sizeof(cl->address);
+    getpeername(conn->fd, (struct sockaddr*)&cl->address, &address_len);
+    cl->socket_fd = conn->fd;
+    cl->is_websocket = 1;
+    strcpy(cl->name, "Anonymous");
+    
+    // Sec-WebSocket-Accept = base64(SHA-1(key + magic GUID))
+    char key_guid[128];
+    size_t key_len = key.len > 64 ? 64 : key.len;
+    memcpy(key_guid, key.data, key_len);
+    strcpy(key_guid + key_len, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    
+    unsigned char digest[20];
+    char accept_key[32];
+    char response[256];
+    sha1((const unsigned char*)key_guid, strlen(key_guid), digest);
+    base64_encode(digest, sizeof(digest), accept_key);
+    snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n",
+        accept_key);
+    conn_append(conn, response, strlen(response));
+    
+    conn->client = cl;
+    conn->mode = CONN_WEBSOCKET;
+    conn->last_pong = now_seconds();
+    list_move_tail(&conn->loop->sockets, conn);
+    room_attach(conn, room);
+    
+    // Catch the client up on anything it missed
+    history_delta_t delta;
+    render_history_delta(&delta, room, since);
+    if (delta.last_seq != since || (delta.reset && since != 0)) {
+        send_websocket_update(conn, &delta);
+    }
+    conn->since = delta.last_seq;
+    release_history_delta(&delta);
+}
+
+// Serve a static asset: 304 when the ETag matches, else the best encoding the client accepts
+void send_static_asset(http_conn_t *conn, const static_asset_t *asset) {
+    const char *accept = request_header(conn->req, "Accept-Encoding").data;
+    slice_t if_none_match = request_header(conn->req, "If-None-Match");
+    
+    const char *body = asset->body;
+    size_t len = asset->len;
+    const char *encoding = NULL;
+    if (accept && asset->brotli && accepts_token(accept, "br")) {
+        body = asset->brotli;
+        len = asset->brotli_len;
+        encoding = "br";
+    } else if (accept && asset->gzip && accepts_token(accept, "gzip")) {
+        body = asset->gzip;
+        len = asset->gzip_len;
+        encoding = "gzip";
+    }
+    
+    // Every encoding of an asset shares one ETag; Vary keeps caches from mixing them up
+    char headers[256];
+    snprintf(headers, sizeof(headers),
+        "ETag: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "%s%s%s",
+        asset->etag, asset->cache_control,
+        encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "");
+    
+    if (if_none_match.data) {
+        const char *match = memmem(if_none_match.data, if_none_match.len,
+                                   asset->etag, strlen(asset->etag));
+        if (match || slice_equals(if_none_match, "*")) {
+            send_http_response_parts(conn, "304 Not Modified", asset->content_type, headers, NULL, 0);
+            return;
+        }
+    }
+    
+    body_part_t part = { body, len, 1, NULL };
+    send_http_response_parts(conn, "200 OK", asset->content_type, headers, &part, 1);
+}
+
+// Queue the dynamic bits of the page as JSON
+void send_status(http_conn_t *conn, chat_room_t *room) {
+    unsigned long first_seq, last_seq;
+    char body[256];
+    size_t name_len;
+    const char *name = reported_room_name(conn, room, &name_len);
+    get_history_bounds(room, &first_seq, &last_seq);
+    snprintf(body, sizeof(body),
+        "{\"server\":\"%s:8080\",\"clients\":%d,\"room\":\"%.*s\",\"rooms\":%d,"
+        "\"last_seq\":%lu,\"history\":%d}",
+        get_server_ip(), client_count(), (int)name_len, name, atomic_load(&room_count), last_seq, history_capacity);
+    send_http_response_with_headers(conn, "200 OK", "application/json",
+                                    "Cache-Control: no-store\r\n", body);
+}
+
+// Queue every counter and histogram in Prometheus text format, summed over the threads' slots
+void send_metrics(http_conn_t *conn) {
+    static const char *timing_series[TIMINGS] = {
+        "chat_operation_seconds", "chat_operation_seconds", "chat_operation_seconds",
+        "chat_operation_seconds", "chat_operation_seconds",
+        "chat_lock_wait_seconds", "chat_lock_wait_seconds", "chat_lock_hold_seconds", "chat_lock_hold_seconds"
+    };
+    static const char *timing_labels[TIMINGS] = {
+        "op=\"accept\"", "op=\"parse\"", "op=\"render\"", "op=\"send\"", "op=\"broadcast\"",
+        "lock=\"messages_mutex\"", "lock=\"clients_mutex\"", "lock=\"messages_mutex\"", "lock=\"clients_mutex\""
+    };
+    uint64_t bytes_in = 0, bytes_out = 0, accepted = 0, shed = 0, closed = 0, requests = 0, posts = 0;
+    unsigned long log_records, log_batches, log_refused, cache_hits, cache_misses;
+    metrics_text_t text = { 0 };
+    int threads = atomic_load(&metric_threads);
+    if (threads > MAX_METRIC_THREADS) {
+        threads = MAX_METRIC_THREADS;
+    }
+    
+    for (int i = 0; i < threads; i++) {
+        thread_metrics_t *m = &thread_metrics[i];
+        bytes_in += atomic_load_explicit(&m->bytes_in, memory_order_relaxed);
+        bytes_out += atomic_load_explicit(&m->bytes_out, memory_order_relaxed);
+        accepted += atomic_load_explicit(&m->accepted, memory_order_relaxed);
+        shed += atomic_load_explicit(&m->shed, memory_order_relaxed);
+        closed += atomic_load_explicit(&m->closed, memory_order_relaxed);
+        requests += atomic_load_explicit(&m->requests, memory_order_relaxed);
+        posts += atomic_load_explicit(&m->posts, memory_order_relaxed);
+    }
+    pthread_mutex_lock(&chat_log.mutex);
+    log_records = chat_log.records;
+    log_batches = chat_log.batches;
+    log_refused = chat_log.refused;
+    pthread_mutex_unlock(&chat_log.mutex);
+    pthread_mutex_lock(&history_cache.mutex);
+    cache_hits = history_cache.hits;
+    cache_misses = history_cache.misses;
+    pthread_mutex_unlock(&history_cache.mutex);
+    metrics_printf(&text,
+        "# TYPE chat_bytes_received_total counter\nchat_bytes_received_total %llu\n"
+        "# TYPE chat_bytes_sent_total counter\nchat_bytes_sent_total %llu\n"
+        "# TYPE chat_connections_accepted_total counter\nchat_connections_accepted_total %llu\n"
+        "# TYPE chat_connections_shed_total counter\nchat_connections_shed_total %llu\n"
+        "# TYPE chat_connections_active gauge\nchat_connections_active %llu\n"
+        "# TYPE chat_websocket_clients gauge\nchat_websocket_clients %d\n"
+        "# TYPE chat_http_requests_total counter\nchat_http_requests_total %llu\n"
+        "# TYPE chat_messages_posted_total counter\nchat_messages_posted_total %llu\n"
+        "# TYPE chat_rooms gauge\nchat_rooms %d\n"
+        "# TYPE chat_log_records_total counter\nchat_log_records_total %lu\n"
+        "# TYPE chat_log_batches_total counter\nchat_log_batches_total %lu\n"
+        "# TYPE chat_log_refused_total counter\nchat_log_refused_total %lu\n"
+        "# TYPE chat_history_cache_hits_total counter\nchat_history_cache_hits_total %lu\n"
+        "# TYPE chat_history_cache_misses_total counter\nchat_history_cache_misses_total %lu\n",
+        (unsigned long long)bytes_in, (unsigned long long)bytes_out, (unsigned long long)accepted,
+        (unsigned long long)shed, (unsigned long long)(accepted - closed), client_count(),
+        (unsigned long long)requests, (unsigned long long)posts, atomic_load(&room_count),
+        log_records, log_batches, log_refused, cache_hits, cache_misses);
+    
+    // One snapshot at a time keeps the merge buffer to a single histogram
+    metrics_histogram_t *snapshot = arena_alloc(conn->loop, sizeof(metrics_histogram_t));
+    for (int t = 0; t < TIMINGS && snapshot; t++) {
+        // Series of one histogram are adjacent, as the format requires
+        if (t == 0 || strcmp(timing_series[t], timing_series[t - 1]) != 0) {
+            metrics_printf(&text, "# TYPE %s histogram\n", timing_series[t]);
+        }
+        memset(snapshot, 0, sizeof(*snapshot));
+        for (int i = 0; i < threads; i++) {
+            metrics_merge(snapshot, &thread_metrics[i].timings[t]);
+        }
+        metrics_print_prometheus(&text, timing_series[t], timing_labels[t], snapshot);
+    }
+    
+    send_http_response_with_headers(conn, "200 OK", "text/plain; version=0.0.4",
+                                    "Cache-Control: no-store\r\n", text.data ? text.data : "");
+    free(text.data);
+}
+
+// Handle one parsed HTTP request and queue its response
+void handle_http_request(http_conn_t *conn) {
+    http_request_t *req = conn->req;
+    const char *path = req->path.data;
+    const char *query = req->query.data;
+    
+    const static_asset_t *asset = find_static_asset(path);
+    chat_room_t *room;
+    if (asset && slice_equals(req->method, "GET")) {
+        // Page shell, stylesheet and script never change while the server runs
+        send_static_asset(conn, asset);
+        
+    } else if (strcmp(path, "/status") == 0) {
+        // Server address, online count, room and history size for the page header
+        if ((room = request_room(conn, ROOM_LOOKUP))) {
+            send_status(conn, room);
+        }
+        
+    } else if (strcmp(path, "/metrics") == 0) {
+        // Counters and latency histograms for Prometheus
+        send_metrics(conn);
+        
+    } else if (strcmp(path, "/messages") == 0) {
+        // Serve the room's messages newer than ?since=N, or its whole history
+        if ((room = request_room(conn, ROOM_LOOKUP))) {
+            send_messages_since(conn, room, query_param_ulong(query, "since", 0));
+        }
+        
+    } else if (strcmp(path, "/api/messages") == 0) {
+        // Messages newer than ?since=N as JSON, or as binary records when Accept asks for them
+        slice_t accept = request_header(req, "Accept");
+        if ((room = request_room(conn, ROOM_LOOKUP))) {
+            send_api_messages(conn, room, query_param_ulong(query, "since", 0),
+                              accept.data && accepts_token(accept.data, BINARY_MESSAGES_TYPE));
+        }
+        
+    } else if (strcmp(path, "/history") == 0) {
+        // Page back through older messages with ?before=<seq>&limit=N
+        if ((room = request_room(conn, ROOM_LOOKUP))) {
+            send_history_before(conn, room, query_param_ulong(query, "before", 0),
+                                query_param_ulong(query, "limit", DEFAULT_HISTORY_LIMIT), NULL);
+        }
+        
+    } else if (strcmp(path, "/messages/wait") == 0) {
+        // Long-poll: park first so a post racing the check still wakes us, then answer now if something is newer
+        if ((room = request_room(conn, ROOM_WATCH))) {
+            unsigned long since = query_param_ulong(query, "since", 0);
+            unsigned long first_seq, last_seq;
+            park_conn(conn, room, since);
+            get_history_bounds(room, &first_seq, &last_seq);
+            if (since != last_seq) {
+                unpark_conn(conn);
+                send_messages_since(conn, room, since);
+            }
+        }
+        
+    } else if (strcmp(path, "/events") == 0) {
+        // Server-Sent Events stream; EventSource resends Last-Event-ID when it reconnects
+        slice_t last_event_id = request_header(req, "Last-Event-ID");
+        unsigned long since = last_event_id.data ? strtoul(last_event_id.data, NULL, 10)
+                                                 : query_param_ulong(query, "since", 0);
+        if ((room = request_room(conn, ROOM_WATCH))) {
+            start_event_stream(conn, room, since);
+        }
+        
+    } else if (strcmp(path, "/ws") == 0) {
+        // WebSocket: messages are pushed as frames and posts arrive on the same socket
+        if ((room = request_room(conn, ROOM_WATCH))) {
+            start_websocket(conn, room, query_param_ulong(query, "since", 0));
+        }
+        
+    } else if (strcmp(path, "/send") == 0 && slice_equals(req->method, "POST")) {
+        // Handle message sending
+        if ((room = request_room(conn, ROOM_POST)) == NULL) {
+            // request_room has answered
+        } else if (post_form_message(room, request_body(conn), conn->req->body_len, NULL) < 0) {
+            send_http_response(conn, "503 Service Unavailable", "text/plain", "The post could not be stored; try again");
+        } else {
+            send_http_response(conn, "200 OK", "text/plain", "OK");
+        }
+        
+    } else {
+        // 404 Not Found
+        send_http_response(conn, "404 Not Found", "text/html", 
+            "<h1>404 - Page Not Found</h1><p><a href='/'>Go to Chat</a></p>");
+    }
+}
+
+// Decide whether the connection stays open after the parsed request
+int request_keep_alive(http_conn_t *conn) {
+    if (conn->requests_served + 1 >= MAX_REQUESTS_PER_CONN) {
+        return 0;
+    }
+    
+    slice_t connection = request_header(conn->req, "Connection");
+    if (slice_has_token(connection, "close")) {
+        return 0;
+    }
+    if (slice_has_token(connection, "keep-alive")) {
+        return 1;
+    }
+    return !conn->req->http10;
+}
+
+// Tell a client that sent "Expect: 100-continue" to go ahead with the body
+void send_continue(http_conn_t *conn) {
+    http_request_t *req = conn->req;
+    if (req->sent_continue || req->state < PARSE_BODY || req->state == PARSE_DONE ||
+        conn->in_len > req->body_start || req->http10) {
+        return;
+    }
+    if (slice_equals(request_header(req, "Expect"), "100-continue")) {
+        const char *interim = "HTTP/1.1 100 Continue\r\n\r\n";
+        conn_append(conn, interim, strlen(interim));
+    }
+    req->sent_continue = 1;
+}
+
+// Publish queued SQEs and optionally wait; returns the io_uring_enter result
+int uring_enter(uring_t *ring, unsigned wait_nr, struct io_uring_getevents_arg *arg) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (arg) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, arg,
+                   arg ? sizeof(*arg) : 0);
+}
+
+// Next free submission entry, zeroed; submits early when the queue is full
+struct io_uring_sqe* uring_sqe(uring_t *ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_enter(ring, 0, NULL);
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Hand a receive buffer back to the kernel
+void uring_recycle_buffer(uring_t *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (unsigned long)(ring->buffers + (size_t)bid * BUFFER_SIZE);
+    buf->len = BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+    ring->buffers_free++;
+}
+
+// Arm one multishot recv that keeps filling provided buffers until it is cancelled
+void uring_arm_recv(http_conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(conn->loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)conn | URING_RECV;
+    conn->recv_armed = 1;
+    conn->ops_inflight++;
+}
+
+// Stop the multishot recv; its last completion arrives with -ECANCELED
+void uring_cancel_recv(http_conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(conn->loop->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)conn | URING_RECV;
+    sqe->user_data = URING_CANCEL;
+}
+
+// Re-arm receiving once nothing holds it back
+void uring_maybe_rearm(http_conn_t *conn) {
+    if (conn->closed || conn->recv_armed || conn->recv_eof || conn->recv_starved || conn->fd_closing) {
+        return;
+    }
+    if (conn->recv_paused && conn->stash_count > 0) {
+        return;
+    }
+    conn->recv_paused = 0;
+    uring_arm_recv(conn);
+}
+
+// io_uring flavour of read_conn: move stashed bytes into in_buf; -1 once the peer is done
+int uring_drain_recv(http_conn_t *conn) {
+    uring_t *ring = conn->loop->ring;
+    if (conn->stash_count > 0 && conn_hold_input(conn) < 0) {
+        return -1;
+    }
+    while (conn->stash_count > 0 && conn->in_len < BUFFER_SIZE - 1) {
+        recv_chunk_t *chunk = &conn->stash[conn->stash_head];
+        size_t room = BUFFER_SIZE - 1 - conn->in_len;
+        size_t n = chunk->len < room ? chunk->len : room;
+        memcpy(conn->in_buf + conn->in_len, ring->buffers + (size_t)chunk->bid * BUFFER_SIZE + chunk->offset, n);
+        conn->in_len += n;
+        metrics_add(&metrics()->bytes_in, n);
+        chunk->offset += n;
+        chunk->len -= n;
+        if (chunk->len == 0) {
+            uring_recycle_buffer(ring, chunk->bid);
+            conn->stash_head = (conn->stash_head + 1) % MAX_RECV_STASH;
+            conn->stash_count--;
+        }
+    }
+    uring_maybe_rearm(conn);
+    return conn->stash_count == 0 && conn->recv_eof ? -1 : 0;
+}
+
+// Read everything the socket has; returns -1 on EOF or error
+int read_conn(http_conn_t *conn) {
+    if (conn->loop->ring) {
+        return uring_drain_recv(conn);
+    }
+    if (conn_hold_input(conn) < 0) {
+        return -1;
+    }
+    while (conn->in_len < BUFFER_SIZE - 1) {
+        ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len,
+                         BUFFER_SIZE - 1 - conn->in_len, 0);
+        if (n > 0) {
+            conn->in_len += n;
+            metrics_add(&metrics()->bytes_in, n);
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Handle every complete request already buffered, in order
+void process_requests(http_conn_t *conn) {
+    while (conn->mode == CONN_HTTP && !conn->close_after_write && conn->in_len > 0 &&
+           conn->out_pending < MAX_PENDING_OUTPUT) {
+        int was_full = conn->in_len >= BUFFER_SIZE - 1;
+        uint64_t start = metrics_now();
+        long length = parse_request(conn);
+        metrics_since(timing(TIME_PARSE), start);
+        if (length == 0 && conn->in_len >= BUFFER_SIZE - 1) {
+            length = reject_request(conn->req, "413 Payload Too Large");
+        }
+        if (length < 0) {
+            conn->keep_alive = 0;
+            send_http_response(conn, conn->req->error, "text/plain", "Request rejected");
+            return;
+        }
+        if (length == 0) {
+            // Chunk framing the parser dropped may have made room for bytes still in the socket
+            if (was_full && !conn->read_eof) {
+                if (read_conn(conn) < 0) {
+                    conn->read_eof = 1;
+                }
+                continue;
+            }
+            send_continue(conn);
+            return;
+        }
+        
+        // Terminate this request so pipelined bytes behind it stay out of handling
+        char saved = conn->in_buf[length];
+        conn->in_buf[length] = '\0';
+        conn->keep_alive = request_keep_alive(conn);
+        handle_http_request(conn);
+        arena_reset(conn->loop);
+        conn->in_buf[length] = saved;
+        conn->requests_served++;
+        metrics_add(&metrics()->requests, 1);
+        
+        memmove(conn->in_buf, conn->in_buf + length, conn->in_len - length);
+        conn->in_len -= length;
+        memset(conn->req, 0, sizeof(http_request_t));
+        
+        // Edge-triggered: a full buffer may have left unread bytes in the socket
+        if (was_full && !conn->read_eof && read_conn(conn) < 0) {
+            conn->read_eof = 1;
+        }
+    }
+}
+
+// Describe pending output as an iovec array, resuming inside a partly written head segment
+int gather_output(http_conn_t *conn, struct iovec *iov, int max) {
+    int count = 0;
+    for (int i = conn->seg_head; i < conn->seg_count && count < max; i++) {
+        out_segment_t *seg = &conn->segs[i];
+        size_t skip = i == conn->seg_head ? conn->seg_sent : 0;
+        const char *base = seg->data ? seg->data : conn->out_buf + seg->offset;
+        iov[count].iov_base = (void*)(base + skip);
+        iov[count].iov_len = seg->len - skip;
+        count++;
+    }
+    return count;
+}
+
+// Hand drained output buffers back to the pool; a buffer an io_uring send still reads waits for its completion
+void release_output(http_conn_t *conn) {
+    if (conn->out_buf != conn->send_out_buf) {
+        pool_put(conn->loop, conn->out_buf, conn->out_cap);
+    }
+    pool_put(conn->loop, conn->segs, conn->seg_cap * sizeof(out_segment_t));
+    conn->out_buf = NULL;
+    conn->out_cap = 0;
+    conn->segs = NULL;
+    conn->seg_cap = 0;
+}
+
+// Retire n written bytes; a partial write leaves seg_sent inside the head segment
+void retire_output(http_conn_t *conn, size_t n) {
+    conn->out_pending -= n;
+    metrics_add(&metrics()->bytes_out, n);
+    while (n > 0) {
+        out_segment_t *seg = &conn->segs[conn->seg_head];
+        size_t left = seg->len - conn->seg_sent;
+        if (n < left) {
+            conn->seg_sent += n;
+            break;
+        }
+        n -= left;
+        release_rendered_history(seg->ref);
+        conn->seg_head++;
+        conn->seg_sent = 0;
+    }
+    if (conn->seg_head == conn->seg_count) {
+        conn->seg_head = 0;
+        conn->seg_count = 0;
+        conn->out_len = 0;
+        release_output(conn);
+    }
+}
+
+// io_uring flavour of flush: keep one sendmsg in flight; the last one before a close carries it linked
+void uring_send(http_conn_t *conn) {
+    if (conn->send_inflight || conn->fd_closing || conn->seg_head == conn->seg_count) {
+        return;
+    }
+    conn->send_iov = pool_get(conn->loop, MAX_IOVECS * sizeof(struct iovec));
+    if (conn->send_iov == NULL) {
+        return;
+    }
+    
+    int count = gather_output(conn, conn->send_iov, MAX_IOVECS);
+    memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+    conn->send_msg.msg_iov = conn->send_iov;
+    conn->send_msg.msg_iovlen = count;
+    
+    uring_t *ring = conn->loop->ring;
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)&conn->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | URING_SEND;
+    conn->send_inflight = 1;
+    conn->send_started = metrics_now();
+    conn->send_out_buf = conn->out_buf;
+    conn->send_out_cap = conn->out_cap;
+    conn->ops_inflight++;
+    
+    // Final response: close right behind it without another trip through the loop.
+    // MSG_WAITALL keeps a short send from breaking the link; if it breaks anyway the close is cancelled.
+    if (conn->close_after_write && conn->seg_head + count == conn->seg_count) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->msg_flags |= MSG_WAITALL;
+        if (conn->recv_armed) {
+            uring_cancel_recv(conn);
+        }
+        struct io_uring_sqe *close_sqe = uring_sqe(ring);
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->fd = conn->fd;
+        close_sqe->user_data = (uintptr_t)conn | URING_CLOSE;
+        conn->fd_closing = 1;
+        conn->ops_inflight++;
+    }
+}
+
+// Write as much pending output as the socket takes, many segments per syscall;
+// returns -1 once the connection is done
+int flush_conn(http_conn_t *conn) {
+    if (conn->loop->ring) {
+        uring_send(conn);
+        return conn->close_after_write && !conn->send_inflight && conn->out_pending == 0 ? -1 : 0;
+    }
+    
+    while (conn->seg_head < conn->seg_count) {
+        struct iovec iov[MAX_IOVECS];
+        struct msghdr msg = { 0 };
+        msg.msg_iov = iov;
+        msg.msg_iovlen = gather_output(conn, iov, MAX_IOVECS);
+        uint64_t start = metrics_now();
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        metrics_since(timing(TIME_SEND), start);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        retire_output(conn, n);
+    }
+    return conn->close_after_write ? -1 : 0;
+}
+
+// Return a connection and its buffers to the loop's pool; nothing may still be using it
+void free_conn(http_conn_t *conn) {
+    event_loop_t *loop = conn->loop;
+    for (int i = conn->seg_head; i < conn->seg_count; i++) {
+        release_rendered_history(conn->segs[i].ref);
+    }
+    for (int i = 0; i < conn->stash_count; i++) {
+        uring_recycle_buffer(loop->ring, conn->stash[(conn->stash_head + i) % MAX_RECV_STASH].bid);
+    }
+    conn->in_len = 0;
+    conn_drop_input(conn);
+    release_output(conn);
+    conn->list_next = loop->pool.free_conns;
+    loop->pool.free_conns = conn;
+}
+
+// io_uring flavour of close: cancel the recv, queue the close, free after the last completion
+void uring_close(http_conn_t *conn) {
+    conn->closed = 1;
+    if (conn->recv_armed) {
+        uring_cancel_recv(conn);
+    }
+    if (!conn->fd_closing) {
+        struct io_uring_sqe *sqe = uring_sqe(conn->loop->ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = conn->fd;
+        sqe->user_data = (uintptr_t)conn | URING_CLOSE;
+        conn->fd_closing = 1;
+        conn->ops_inflight++;
+    }
+}
+
+// Release a connection
+void close_conn(http_conn_t *conn) {
+    metrics_add(&metrics()->closed, 1);
+    list_remove(conn);
+    room_detach(conn);
+    if (conn->load) {
+        // The worker still owns the load; finish_history_load frees it without an answer
+        conn->load->conn = NULL;
+        conn->load = NULL;
+    }
+    if (conn->client) {
+        remove_client(conn->client->id);
+        pool_put(conn->loop, conn->client, sizeof(client_t));
+        conn->client = NULL;
+    }
+    if (conn->loop->ring) {
+        uring_close(conn);
+        return;
+    }
+    close(conn->fd);
+    free_conn(conn);
+}
+
+// Set up state for an accepted socket; closes it on failure.
+// Connections are carved CONN_SLAB at a time and recycled through the loop's pool, never freed.
+http_conn_t* new_conn(event_loop_t *loop, int fd) {
+    if (loop->pool.free_conns == NULL) {
+        http_conn_t *slab = malloc(CONN_SLAB * sizeof(http_conn_t));
+        if (slab == NULL) {
+            close(fd);
+            return NULL;
+        }
+        for (int i = 0; i < CONN_SLAB; i++) {
+            slab[i].list_next = loop->pool.free_conns;
+            loop->pool.free_conns = &slab[i];
+        }
+    }
+    http_conn_t *conn = loop->pool.free_conns;
+    loop->pool.free_conns = conn->list_next;
+    memset(conn, 0, sizeof(http_conn_t));
+    conn->loop = loop;
+    conn->fd = fd;
+    touch_conn(conn);
+    metrics_add(&metrics()->accepted, 1);
+    return conn;
+}
+
+// Out of descriptors: give up the spare for long enough to accept one waiting client and close it,
+// so it hears a reset instead of hanging in a backlog the edge-triggered listener will not report again.
+// Returns -1 when no client could be turned away.
+int shed_connection(event_loop_t *loop) {
+    if (loop->spare_fd >= 0) {
+        close(loop->spare_fd);
+    }
+    int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0) {
+        close(fd);
+        metrics_add(&metrics()->shed, 1);
+    }
+    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0 ? 0 : -1;
+}
+
+// Accept every pending connection on the listener
+void accept_connections(event_loop_t *loop) {
+    loop->accept_stalled = 0;
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        uint64_t start = metrics_now();
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr*)&client_addr,
+                                &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection(loop) == 0) {
+                    continue;
+                }
+                // Another thread took the spare's descriptor; no new edge will come, so retry after a sweep
+                loop->accept_stalled = time(NULL);
+            }
+            return;
+        }
+        
+        http_conn_t *conn = new_conn(loop, client_fd);
+        if (conn == NULL) {
+            continue;
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            close_conn(conn);
+            continue;
+        }
+        metrics_since(timing(TIME_ACCEPT), start);
+    }
+}
+
+// Send a close frame with a status code and stop reading
+void close_websocket(http_conn_t *conn, int status) {
+    char code[2] = { (char)(status >> 8), (char)(status & 0xFF) };
+    send_websocket_frame(conn, WS_OPCODE_CLOSE, code, sizeof(code));
+    conn->close_after_write = 1;
+}
+
+// Parse and act on every complete WebSocket frame in in_buf
+void process_websocket_frames(http_conn_t *conn) {
+    while (conn->mode == CONN_WEBSOCKET && !conn->close_after_write && conn->in_len >= 2) {
+        unsigned char *data = (unsigned char*)conn->in_buf;
+        int fin = data[0] & 0x80;
+        int opcode = data[0] & 0x0F;
+        int masked = data[1] & 0x80;
+        uint64_t payload_len = data[1] & 0x7F;
+        size_t header_len = 2;
+        
+        if (payload_len == 126) {
+            if (conn->in_len < 4) {
+                return;
+            }
+            payload_len = (uint64_t)data[2] << 8 | data[3];
+            header_len = 4;
+        } else if (payload_len == 127) {
+            if (conn->in_len < 10) {
+                return;
+            }
+            payload_len = 0;
+            for (int i = 0; i < 8; i++) {
+                payload_len = payload_len << 8 | data[2 + i];
+            }
+            header_len = 10;
+        }
+        
+        // Clients must mask every frame, and a frame has to fit in the input buffer
+        if (!masked) {
+            close_websocket(conn, 1002);
+            return;
+        }
+        if (payload_len > BUFFER_SIZE - 1 - header_len - 4) {
+            close_websocket(conn, 1009);
+            return;
+        }
+        size_t frame_len = header_len + 4 + payload_len;
+        if (conn->in_len < frame_len) {
+            return;
+        }
+        
+        unsigned char *mask = data + header_len;
+        char *payload = (char*)data + header_len + 4;
+        for (size_t i = 0; i < payload_len; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+        
+        switch (opcode) {
+        case WS_OPCODE_TEXT:
+            if (!fin) {
+                // Chat posts are tiny; fragmented messages are not supported
+                close_websocket(conn, 1003);
+                return;
+            } else {
+                char saved = payload[payload_len];
+                payload[payload_len] = '\0';
+                int posted = post_form_message(conn->room, payload, payload_len, conn->client);
+                payload[payload_len] = saved;
+                if (posted < 0) {
+                    // No more rooms can be counted, or the log cannot take the post right now
+                    close_websocket(conn, 1013);
+                    return;
+                }
+            }
+            break;
+        case WS_OPCODE_PING:
+            send_websocket_frame(conn, WS_OPCODE_PONG, payload, payload_len);
+            break;
+        case WS_OPCODE_PONG:
+            conn->last_pong = now_seconds();
+            break;
+        case WS_OPCODE_CLOSE:
+            send_websocket_frame(conn, WS_OPCODE_CLOSE, payload, payload_len >= 2 ? 2 : 0);
+            conn->close_after_write = 1;
+            break;
+        case WS_OPCODE_CONTINUATION:
+        case WS_OPCODE_BINARY:
+            close_websocket(conn, 1003);
+            return;
+        default:
+            close_websocket(conn, 1002);
+            return;
+        }
+        
+        int was_full = conn->in_len >= BUFFER_SIZE - 1;
+        memmove(conn->in_buf, conn->in_buf + frame_len, conn->in_len - frame_len);
+        conn->in_len -= frame_len;
+        
+        // Edge-triggered: a full buffer may have left unread bytes in the socket
+        if (was_full && !conn->read_eof && read_conn(conn) < 0) {
+            conn->read_eof = 1;
+        }
+    }
+}
+
+// Answer buffered requests and flush output; closes the connection once it is finished
+void service_conn(http_conn_t *conn) {
+    // Pipelined requests are answered in order; the output cap pauses them until EPOLLOUT
+    while (1) {
+        process_requests(conn);
+        process_websocket_frames(conn);
+        if (flush_conn(conn) < 0) {
+            close_conn(conn);
+            return;
+        }
+        if (conn->out_pending > 0 || conn->mode != CONN_HTTP || parse_request(conn) == 0) {
+            break;
+        }
+    }
+    
+    // A request still loading history is answered even if the client has finished sending
+    if (conn->read_eof && conn->mode != CONN_LOADING && (conn->out_pending == 0 || conn->mode != CONN_HTTP)) {
+        close_conn(conn);
+        return;
+    }
+    conn_drop_input(conn);
+    touch_conn(conn);
+}
 
-// Add message to history
-void add_message_to_history(const char* username, const char* message) {
-    pthread_mutex_lock(&messages_mutex);
+// Drive one connection after epoll reports readiness
+void handle_conn_event(http_conn_t *conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        close_conn(conn);
+        return;
+    }
     
-    if (message_count >= MAX_MESSAGES) {
-        // Shift messages to make room for new one
-        for (int i = 0; i < MAX_MESSAGES - 1; i++) {
-            chat_history[i] = chat_history[i + 1];
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !conn->read_eof) {
+        if (read_conn(conn) < 0) {
+            conn->read_eof = 1;
         }
-        message_count = MAX_MESSAGES - 1;
     }
     
-    strcpy(chat_history[message_count].username, username);
-    strcpy(chat_history[message_count].message, message);
+    // Event streams only talk one way; drop anything the client sends
+    if (conn->mode == CONN_EVENT_STREAM) {
+        conn->in_len = 0;
+    }
     
-    // Add timestamp
-    time_t now = time(0);
-    struct tm *tm_info = localtime(&now);
-    strftime(chat_history[message_count].timestamp, 32, "%H:%M:%S", tm_info);
+    service_conn(conn);
+}
+
+// Close keep-alive connections that have been quiet for too long
+void expire_idle_conns(event_loop_t *loop) {
+    time_t cutoff = now_seconds() - KEEPALIVE_TIMEOUT;
+    while (loop->idle.head && loop->idle.head->last_active <= cutoff) {
+        close_conn(loop->idle.head);
+    }
+}
+
+// Answer long-polls that waited LONG_POLL_TIMEOUT seconds with an empty delta
+void expire_long_polls(event_loop_t *loop) {
+    time_t cutoff = now_seconds() - LONG_POLL_TIMEOUT;
+    while (loop->pollers.head && loop->pollers.head->parked_at <= cutoff) {
+        http_conn_t *conn = loop->pollers.head;
+        chat_room_t *room = conn->room;
+        unpark_conn(conn);
+        send_messages_since(conn, room, conn->since);
+        service_conn(conn);
+    }
+}
+
+// Keep event streams alive through proxies and notice dead peers
+void send_stream_heartbeats(event_loop_t *loop) {
+    time_t now = now_seconds();
+    if (now - loop->last_heartbeat < SSE_HEARTBEAT_INTERVAL) {
+        return;
+    }
+    loop->last_heartbeat = now;
     
-    message_count++;
-    pthread_mutex_unlock(&messages_mutex);
+    http_conn_t *conn = loop->streams.head;
+    while (conn) {
+        http_conn_t *next = conn->list_next;
+        conn_append(conn, ": ping\n\n", 8);
+        service_conn(conn);
+        conn = next;
+    }
 }
 
-// Generate chat history HTML
-void generate_chat_history_html(char *html_buffer, int buffer_size) {
-    pthread_mutex_lock(&messages_mutex);
+// Ping every WebSocket and drop the ones that stopped answering
+void ping_websockets(event_loop_t *loop) {
+    time_t now = now_seconds();
+    if (now - loop->last_ping < WS_PING_INTERVAL) {
+        return;
+    }
+    loop->last_ping = now;
     
-    strcpy(html_buffer, "");
-    for (int i = 0; i < message_count; i++) {
-        char msg_html[512];
-        snprintf(msg_html, sizeof(msg_html), 
-            "<div class='message'>"
-            "<span class='time'>%s</span> "
-            "<span class='username'>%s:</span> "
-            "<span class='text'>%s</span>"
-            "</div>\n",
-            chat_history[i].timestamp,
-            chat_history[i].username,
-            chat_history[i].message);
-        
-        if (strlen(html_buffer) + strlen(msg_html) < buffer_size - 100) {
-            strcat(html_buffer, msg_html);
+    http_conn_t *conn = loop->sockets.head;
+    while (conn) {
+        http_conn_t *next = conn->list_next;
+        if (now - conn->last_pong > WS_PONG_TIMEOUT) {
+            close_conn(conn);
+        } else {
+            send_websocket_frame(conn, WS_OPCODE_PING, "", 0);
+            service_conn(conn);
         }
+        conn = next;
     }
-    
-    pthread_mutex_unlock(&messages_mutex);
 }
 
-// Send HTTP response
-void send_http_response(int client_fd, const char* status, const char* content_type, const char* body) {
-    char response[BUFFER_SIZE * 2];
-    snprintf(response, sizeof(response),
-        "HTTP/1.1 %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %ld\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "Connection: close\r\n"
-        "\r\n"
-        "%s",
-        status, content_type, strlen(body), body);
-    
-    send(client_fd, response, strlen(response), 0);
-}
-
-// Generate the main chat page HTML
-void generate_chat_page(char *html_buffer, int buffer_size, const char* server_ip) {
-    char chat_messages[BUFFER_SIZE];
-    generate_chat_history_html(chat_messages, sizeof(chat_messages));
-    
-    snprintf(html_buffer, buffer_size,
-        "<!DOCTYPE html>\n"
-        "<html>\n"
-        "<head>\n"
-        "<meta charset='UTF-8'>\n"
-        "<meta name='viewport' content='width=device-width, initial-scale=1.0'>\n"
-        "<title>WiFi Chat Room</title>\n"
-        "<style>\n"
-        "body { font-family: Arial, sans-serif; margin: 0; padding: 10px; background: linear-gradient(135deg, #667eea 0%%, #764ba2 100%%); min-height: 100vh; }\n"
-        ".container { max-width: 800px; margin: 0 auto; background: white; border-radius: 10px; box-shadow: 0 4px 6px rgba(0,0,0,0.1); overflow: hidden; }\n"
-        ".header { background: #4a5568; color: white; padding: 20px; text-align: center; }\n"
-        ".chat-area { height: 400px; overflow-y: auto; padding: 20px; background: #f7fafc; border-bottom: 1px solid #e2e8f0; }\n"
-        ".message { margin: 5px 0; padding: 8px; background: white; border-radius: 5px; box-shadow: 0 1px 2px rgba(0,0,0,0.1); }\n"
-        ".time { color: #718096; font-size: 0.8em; }\n"
-        ".username { font-weight: bold; color: #2d3748; }\n"
-        ".text { color: #4a5568; }\n"
-        ".input-area { padding: 20px; background: white; }\n"
-        ".input-group { display: flex; gap: 10px; margin-bottom: 10px; }\n"
-        "input[type='text'] { flex: 1; padding: 10px; border: 1px solid #cbd5e0; border-radius: 5px; font-size: 16px; }\n"
-        "button { padding: 10px 20px; background: #4299e1; color: white; border: none; border-radius: 5px; cursor: pointer; font-size: 16px; }\n"
-        "button:hover { background: #3182ce; }\n"
-        ".status { text-align: center; padding: 10px; color: #718096; font-style: italic; }\n"
-        ".client-count { background: #48bb78; color: white; padding: 5px 10px; border-radius: 15px; font-size: 0.8em; }\n"
-        "@media (max-width: 600px) {\n"
-        "  .input-group { flex-direction: column; }\n"
-        "  .container { margin: 0; border-radius: 0; }\n"
-        "}\n"
-        "</style>\n"
-        "</head>\n"
-        "<body>\n"
-        "<div class='container'>\n"
-        "<div class='header'>\n"
-        "<h1>📱 WiFi Chat Room</h1>\n"
-        "<div>Server: %s:8080 | <span class='client-count' id='clientCount'>%d users online</span></div>\n"
-        "</div>\n"
-        "<div class='chat-area' id='chatArea'>\n"
-        "%s\n"
-        "</div>\n"
-        "<div class='input-area'>\n"
-        "<div class='input-group'>\n"
-        "<input type='text' id='username' placeholder='Your name' maxlength='30'>\n"
-        "<input type='text' id='messageInput' placeholder='Type your message...' maxlength='200'>\n"
-        "<button onclick='sendMessage()'>Send</button>\n"
-        "</div>\n"
-        "<div class='status' id='status'>Enter your name and start chatting!</div>\n"
-        "</div>\n"
-        "</div>\n"
-        "\n"
-        "<script>\n"
-        "let lastMessageCount = %d;\n"
-        "let username = '';\n"
-        "\n"
-        "function sendMessage() {\n"
-        "    const usernameInput = document.getElementById('username');\n"
-        "    const messageInput = document.getElementById('messageInput');\n"
-        "    \n"
-        "    username = usernameInput.value.trim();\n"
-        "    const message = messageInput.value.trim();\n"
-        "    \n"
-        "    if (!username) {\n"
-        "        alert('Please enter your name first!');\n"
-        "        usernameInput.focus();\n"
-        "        return;\n"
-        "    }\n"
-        "    \n"
-        "    if (!message) {\n"
-        "        alert('Please enter a message!');\n"
-        "        messageInput.focus();\n"
-        "        return;\n"
-        "    }\n"
-        "    \n"
-        "    // Send message via POST request\n"
-        "    fetch('/send', {\n"
-        "        method: 'POST',\n"
-        "        headers: { 'Content-Type': 'application/x-www-form-urlencoded' },\n"
-        "        body: `username=${encodeURIComponent(username)}&message=${encodeURIComponent(message)}`\n"
-        "    })\n"
-        "    .then(response => response.text())\n"
-        "    .then(data => {\n"
-        "        messageInput.value = '';\n"
-        "        messageInput.focus();\n"
-        "        updateChat();\n"
-        "    })\n"
-        "    .catch(error => {\n"
-        "        document.getElementById('status').textContent = 'Error sending message. Please try again.';\n"
-        "    });\n"
-        "}\n"
-        "\n"
-        "function updateChat() {\n"
-        "    fetch('/messages')\n"
-        "    .then(response => response.text())\n"
-        "    .then(html => {\n"
-        "        document.getElementById('chatArea').innerHTML = html;\n"
-        "        // Scroll to bottom\n"
-        "        const chatArea = document.getElementById('chatArea');\n"
-        "        chatArea.scrollTop = chatArea.scrollHeight;\n"
-        "    })\n"
-        "    .catch(error => {\n"
-        "        console.error('Error updating chat:', error);\n"
-        "    });\n"
-        "}\n"
-        "\n"
-        "// Handle Enter key\n"
-        "document.getElementById('messageInput').addEventListener('keypress', function(event) {\n"
-        "    if (event.key === 'Enter') {\n"
-        "        sendMessage();\n"
-        "    }\n"
-        "});\n"
-        "\n"
-        "document.getElementById('username').addEventListener('keypress', function(event) {\n"
-        "    if (event.key === 'Enter') {\n"
-        "        document.getElementById('messageInput').focus();\n"
-        "    }\n"
-        "});\n"
-        "\n"
-        "// Auto-refresh chat every 2 seconds\n"
-        "setInterval(updateChat, 2000);\n"
-        "\n"
-        "// Initial focus\n"
-        "document.getElementById('username').focus();\n"
-        "</script>\n"
-        "</body>\n"
-        "</html>",
-        server_ip, client_count, chat_messages, message_count);
-}
-
-// Parse HTTP request to extract path and POST data
-void parse_http_request(const char* request, char* method, char* path, char* post_data) {
-    sscanf(request, "%s %s", method, path);
-    
-    // Extract POST data if present
-    const char* content_start = strstr(request, "\r\n\r\n");
-    if (content_start) {
-        strcpy(post_data, content_start + 4);
-    } else {
-        post_data[0] = '\0';
-    }
-}
-
-// URL decode function
-void url_decode(char* dst, const char* src) {
-    char a, b;
-    while (*src) {
-        if ((*src == '%') && ((a = src[1]) && (b = src[2])) && (isxdigit(a) && isxdigit(b))) {
-            if (a >= 'a') a -= 'a'-'A';
-            if (a >= 'A') a -= ('A' - 10);
-            else a -= '0';
-            if (b >= 'a') b -= 'a'-'A';
-            if (b >= 'A') b -= ('A' - 10);
-            else b -= '0';
-            *dst++ = 16*a+b;
-            src+=3;
-        } else if (*src == '+') {
-            *dst++ = ' ';
-            src++;
-        } else {
-            *dst++ = *src++;
+// Bring this loop's waiters in one room up to date; waiters usually share a starting point, so each delta is sliced once
+void deliver_room_messages(event_loop_t *loop, chat_room_t *room) {
+    uint64_t start = metrics_now();
+    unsigned long first_seq, last_seq;
+    get_history_bounds(room, &first_seq, &last_seq);
+    
+    history_delta_t shared = { 0 };
+    history_delta_t *delta = &shared;
+    int have_delta = 0;
+    
+    http_conn_t *conn = room->waiters[loop->index];
+    while (conn) {
+        http_conn_t *next = conn->room_next;
+        if (conn->since != last_seq) {
+            if (conn->mode != CONN_LONG_POLL && conn->out_pending > MAX_PENDING_OUTPUT) {
+                // Slow reader: drop it rather than buffer without bound; EventSource and the page reconnect from their last id
+                close_conn(conn);
+            } else {
+                if (!have_delta || delta->since != conn->since) {
+                    release_history_delta(delta);
+                    render_history_delta(delta, room, conn->since);
+                    have_delta = 1;
+                }
+                if (conn->mode == CONN_LONG_POLL) {
+                    unpark_conn(conn);
+                    send_history_delta(conn, delta);
+                } else if (conn->mode == CONN_EVENT_STREAM) {
+                    send_event_stream_update(conn, delta);
+                } else {
+                    send_websocket_update(conn, delta);
+                }
+                service_conn(conn);
+            }
         }
+        conn = next;
     }
-    *dst = '\0';
+    
+    release_history_delta(delta);
+    metrics_since(timing(TIME_BROADCAST), start);
 }
 
-// Get server IP for display
-char* get_server_ip() {
-    static char server_ip[INET_ADDRSTRLEN];
-    struct ifaddrs *interfaces, *interface;
-    struct sockaddr_in *addr;
+// Answer a /history request once the worker pool has read its pages, unless its connection has gone
+void finish_history_load(history_load_t *load) {
+    http_conn_t *conn = load->conn;
+    if (conn) {
+        conn->load = NULL;
+        conn->mode = CONN_HTTP;
+        send_history_before(conn, load->room, load->before, load->limit, load);
+        service_conn(conn);
+    }
+    for (unsigned long i = 0; i < load->page_count; i++) {
+        release_rendered_history(load->pages[i]);
+    }
+    free(load);
+}
+
+// Deliver every room that got a post since the last wake, and answer the /history requests whose
+// pages were read meanwhile; rooms without waiters here never show up
+void deliver_new_messages(event_loop_t *loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return;
+    }
     
-    strcpy(server_ip, "localhost");
+    pthread_mutex_lock(&loop->rooms_mutex);
+    chat_room_t *room = loop->pending_rooms;
+    loop->pending_rooms = NULL;
+    history_load_t *load = loop->finished_loads;
+    loop->finished_loads = NULL;
+    pthread_mutex_unlock(&loop->rooms_mutex);
     
-    if (getifaddrs(&interfaces) == -1) {
-        return server_ip;
+    while (load) {
+        history_load_t *next = load->next;
+        finish_history_load(load);
+        load = next;
     }
     
-    for (interface = interfaces; interface != NULL; interface = interface->ifa_next) {
-        if (interface->ifa_addr == NULL || interface->ifa_addr->sa_family != AF_INET) 
-            continue;
-        
-        addr = (struct sockaddr_in *)interface->ifa_addr;
-        
-        if (strncmp(interface->ifa_name, "wlan", 4) == 0 || 
-            strncmp(interface->ifa_name, "wlp", 3) == 0 ||
-            strncmp(interface->ifa_name, "wifi", 4) == 0 ||
-            strncmp(interface->ifa_name, "eth", 3) == 0 ||
-            strncmp(interface->ifa_name, "enp", 3) == 0 ||
-            strncmp(interface->ifa_name, "eno", 3) == 0) {
+    while (room) {
+        // Read the link before clearing the bit: a post after that may queue the room again
+        chat_room_t *next = room->pending_next[loop->index];
+        atomic_fetch_and(&room->pending_loops, ~(1ULL << loop->index));
+        deliver_room_messages(loop, room);
+        room = next;
+    }
+}
+
+// Drop one reference held by a finished operation; frees a closed connection after the last
+void uring_put(http_conn_t *conn) {
+    conn->ops_inflight--;
+    if (conn->closed && conn->ops_inflight == 0) {
+        free_conn(conn);
+    }
+}
+
+// Multishot accept: one SQE keeps producing a completion per new connection
+void uring_arm_accept(event_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// Multishot poll on the wake eventfd
+void uring_arm_wake(event_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(loop->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_WAKE;
+}
+
+// Bytes, EOF or an error from a connection's multishot recv
+void uring_recv_done(http_conn_t *conn, int res, unsigned flags) {
+    uring_t *ring = conn->loop->ring;
+    int more = flags & IORING_CQE_F_MORE;
+    
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        ring->buffers_free--;
+        if (conn->closed || conn->stash_count == MAX_RECV_STASH || res <= 0) {
+            uring_recycle_buffer(ring, bid);
+            if (!conn->closed && res > 0) {
+                // The client kept sending after the recv was paused; stop listening to it
+                close_conn(conn);
+            }
+        } else {
+            int tail = (conn->stash_head + conn->stash_count) % MAX_RECV_STASH;
+            conn->stash[tail].bid = bid;
+            conn->stash[tail].offset = 0;
+            conn->stash[tail].len = res;
+            conn->stash_count++;
             
-            inet_ntop(AF_INET, &(addr->sin_addr), server_ip, INET_ADDRSTRLEN);
-            if (strcmp(server_ip, "127.0.0.1") != 0) {
-                break;
+            // Receive no further ahead of the parser than the stash can hold
+            if (conn->stash_count >= MAX_RECV_STASH / 2 && more && !conn->recv_paused) {
+                conn->recv_paused = 1;
+                uring_cancel_recv(conn);
             }
         }
+    } else if (res == -ENOBUFS && !conn->closed) {
+        // Out of provided buffers: retry once other connections hand some back
+        conn->recv_starved = 1;
+        conn->starved_next = ring->starved;
+        ring->starved = conn;
+        conn->ops_inflight++;
+    } else if (res == 0 || (res < 0 && res != -ECANCELED)) {
+        conn->recv_eof = 1;
     }
     
-    freeifaddrs(interfaces);
-    return server_ip;
+    if (!more) {
+        conn->recv_armed = 0;
+    }
+    if (!conn->closed) {
+        handle_conn_event(conn, EPOLLIN);
+    }
+    if (!more) {
+        uring_maybe_rearm(conn);
+        uring_put(conn);
+    }
 }
 
-// Handle HTTP client
-void *handle_http_client(void *arg) {
-    int client_fd = *(int*)arg;
-    free(arg);
-    
-    char buffer[BUFFER_SIZE];
-    char method[16], path[256], post_data[BUFFER_SIZE];
-    char response_body[BUFFER_SIZE * 2];
+// A sendmsg finished: retire what went out and keep the connection moving
+void uring_send_done(http_conn_t *conn, int res) {
+    metrics_since(timing(TIME_SEND), conn->send_started);
+    conn->send_inflight = 0;
+    if (conn->send_out_buf != conn->out_buf) {
+        pool_put(conn->loop, conn->send_out_buf, conn->send_out_cap);
+    }
+    pool_put(conn->loop, conn->send_iov, MAX_IOVECS * sizeof(struct iovec));
+    conn->send_out_buf = NULL;
+    conn->send_iov = NULL;
     
-    // Read HTTP request
-    int bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_read <= 0) {
-        close(client_fd);
-        return NULL;
+    if (!conn->closed) {
+        if (res < 0) {
+            close_conn(conn);
+        } else {
+            retire_output(conn, res);
+            handle_conn_event(conn, EPOLLOUT);
+        }
     }
+    uring_put(conn);
+}
+
+// Dispatch one completion by the tag in its user_data
+void handle_uring_completion(event_loop_t *loop, const struct io_uring_cqe *cqe) {
+    http_conn_t *conn = (http_conn_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
     
-    buffer[bytes_read] = '\0';
-    parse_http_request(buffer, method, path, post_data);
+    switch (cqe->user_data & URING_TAG_MASK) {
+    case URING_ACCEPT:
+        if (cqe->res >= 0) {
+            uint64_t start = metrics_now();
+            if ((conn = new_conn(loop, cqe->res)) != NULL) {
+                uring_arm_recv(conn);
+                metrics_since(timing(TIME_ACCEPT), start);
+            }
+        } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            if (shed_connection(loop) < 0 && !(cqe->flags & IORING_CQE_F_MORE)) {
+                // Re-arming now would only fail again at once; wait for a sweep to free descriptors
+                loop->accept_stalled = time(NULL);
+                break;
+            }
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uring_arm_accept(loop);
+        }
+        break;
+    case URING_WAKE:
+        deliver_new_messages(loop);
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uring_arm_wake(loop);
+        }
+        break;
+    case URING_RECV:
+        uring_recv_done(conn, cqe->res, cqe->flags);
+        break;
+    case URING_SEND:
+        uring_send_done(conn, cqe->res);
+        break;
+    case URING_CLOSE:
+        // A close linked behind a send is cancelled when that send fails
+        if (cqe->res == -ECANCELED) {
+            close(conn->fd);
+        }
+        if (!conn->closed) {
+            close_conn(conn);
+        }
+        uring_put(conn);
+        break;
+    }
+}
+
+// Give starved connections another recv now that buffers are back
+void rearm_starved_conns(uring_t *ring) {
+    while (ring->starved && ring->buffers_free > 0) {
+        http_conn_t *conn = ring->starved;
+        ring->starved = conn->starved_next;
+        conn->recv_starved = 0;
+        uring_maybe_rearm(conn);
+        uring_put(conn);
+    }
+}
+
+// io_uring version of the loop: one io_uring_enter submits everything queued and reaps a batch
+void run_uring_loop(event_loop_t *loop) {
+    uring_t *ring = loop->ring;
+    uring_arm_accept(loop);
+    uring_arm_wake(loop);
     
-    if (strcmp(path, "/") == 0) {
-        // Serve main chat page
-        generate_chat_page(response_body, sizeof(response_body), get_server_ip());
-        send_http_response(client_fd, "200 OK", "text/html", response_body);
-        
-    } else if (strcmp(path, "/messages") == 0) {
-        // Serve chat messages
-        generate_chat_history_html(response_body, sizeof(response_body));
-        send_http_response(client_fd, "200 OK", "text/html", response_body);
+    while (1) {
+        struct __kernel_timespec timeout = { 1, 0 };
+        struct io_uring_getevents_arg arg = { 0 };
+        arg.ts = (uintptr_t)&timeout;
+        if (uring_enter(ring, 1, &arg) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+            printf("io_uring_enter failed\n");
+            return;
+        }
         
-    } else if (strcmp(path, "/send") == 0 && strcmp(method, "POST") == 0) {
-        // Handle message sending
-        char username[64] = "", message[256] = "";
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            handle_uring_completion(loop, &cqe);
+        }
+        rearm_starved_conns(ring);
+        arena_reset(loop);
         
-        // Parse POST data
-        char *token = strtok(post_data, "&");
-        while (token != NULL) {
-            if (strncmp(token, "username=", 9) == 0) {
-                url_decode(username, token + 9);
-            } else if (strncmp(token, "message=", 8) == 0) {
-                url_decode(message, token + 8);
+        expire_idle_conns(loop);
+        if (loop->accept_stalled && time(NULL) > loop->accept_stalled) {
+            loop->accept_stalled = 0;
+            uring_arm_accept(loop);
+        }
+        expire_long_polls(loop);
+        send_stream_heartbeats(loop);
+        ping_websockets(loop);
+    }
+}
+
+// Run the event loop forever
+void run_event_loop(event_loop_t *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    
+    if (loop->ring) {
+        run_uring_loop(loop);
+        return;
+    }
+    
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            token = strtok(NULL, "&");
+            printf("epoll_wait failed\n");
+            return;
         }
         
-        if (strlen(username) > 0 && strlen(message) > 0) {
-            add_message_to_history(username, message);
-            printf(" %s: %s\n", username, message);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop);
+            } else if (events[i].data.ptr == &loop->wake_fd) {
+                deliver_new_messages(loop);
+            } else {
+                handle_conn_event(events[i].data.ptr, events[i].events);
+            }
         }
+        arena_reset(loop);
         
-        send_http_response(client_fd, "200 OK", "text/plain", "OK");
-        
-    } else {
-        // 404 Not Found
-        send_http_response(client_fd, "404 Not Found", "text/html", 
-            "<h1>404 - Page Not Found</h1><p><a href='/'>Go to Chat</a></p>");
+        expire_idle_conns(loop);
+        if (loop->accept_stalled && time(NULL) > loop->accept_stalled) {
+            accept_connections(loop);
+        }
+        expire_long_polls(loop);
+        send_stream_heartbeats(loop);
+        ping_websockets(loop);
     }
-    
-    close(client_fd);
-    return NULL;
 }
 
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-    pthread_t thread_id;
-    int port = 8080;
+// Lift the soft descriptor limit so the registry limit, not RLIMIT_NOFILE, caps WebSockets
+void raise_fd_limit(int clients) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return;
+    }
     
-    printf("Web-Based Chat Server Starting...\n");
-    printf("=====================================\n");
+    rlim_t wanted = (rlim_t)clients + 64;
+    if (limit.rlim_cur >= wanted) {
+        return;
+    }
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < wanted) {
+        printf("Descriptor limit is %lu; fewer than %d clients may connect\n",
+               (unsigned long)limit.rlim_cur, clients);
+    }
+}
+
+// Open a listener and its own epoll set and wake eventfd; reuse_port lets several loops share the port
+int init_event_loop(event_loop_t *loop, int port, int reuse_port) {
+    struct sockaddr_in server_addr;
     
     // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
+    loop->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (loop->listen_fd < 0) {
         printf("Socket creation failed\n");
         return -1;
     }
     
     int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(loop->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuse_port && setsockopt(loop->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        printf("SO_REUSEPORT is not supported\n");
+        return -1;
+    }
     
     // Bind
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
     
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(loop->listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         printf("Binding failed\n");
         return -1;
     }
     
-    if (listen(server_fd, 10) < 0) {
+    if (listen(loop->listen_fd, SOMAXCONN) < 0) {
         printf("Listen failed\n");
         return -1;
     }
+    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    loop->accept_stalled = 0;
+    
+    // Register the listener with the event loop
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        printf("epoll creation failed\n");
+        return -1;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        printf("epoll registration failed\n");
+        return -1;
+    }
+    
+    // Posting a message signals this eventfd to wake parked clients
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&loop->rooms_mutex, NULL);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->wake_fd;
+    if (loop->wake_fd < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        printf("eventfd setup failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Multishot recv needs Linux 6.0; older kernels keep the epoll loop
+int uring_kernel_supported() {
+    struct utsname name;
+    int major = 0;
+    if (uname(&name) < 0 || sscanf(name.release, "%d.", &major) != 1) {
+        return 0;
+    }
+    return major >= 6;
+}
+
+// Create the loop's io_uring and its provided buffer ring; returns -1 to fall back to epoll
+int init_uring(event_loop_t *loop) {
+    if (!uring_kernel_supported()) {
+        return -1;
+    }
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (ring == NULL) {
+        return -1;
+    }
+    
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return -1;
+    }
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+        close(ring->fd);
+        free(ring);
+        return -1;
+    }
+    
+    // One mapping covers both rings; the SQE array is mapped separately
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring->fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring->fd);
+        free(ring);
+        return -1;
+    }
+    ring->sq_head = (unsigned*)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(rings + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sqes = sqes;
+    ring->cq_head = (unsigned*)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    
+    // Receive buffers come from a ring the kernel picks from, so idle sockets pin no memory
+    ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ring->buffers = malloc((size_t)URING_BUFFERS * BUFFER_SIZE);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL ||
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        close(ring->fd);
+        free(ring->buffers);
+        free(ring);
+        return -1;
+    }
+    for (int bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_recycle_buffer(ring, bid);
+    }
+    
+    loop->ring = ring;
+    return 0;
+}
+
+// Pin the calling thread to the index-th CPU this process may run on
+void pin_to_cpu(int index) {
+    cpu_set_t allowed, mask;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    
+    int wanted = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && wanted-- == 0) {
+            CPU_ZERO(&mask);
+            CPU_SET(cpu, &mask);
+            pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+            return;
+        }
+    }
+}
+
+// Exit on Ctrl+C or SIGTERM through exit(), so atexit work such as writing profile data still runs.
+// Posts already acknowledged are in the log's pending batch, so it goes to disk first.
+void *shutdown_thread(void *arg) {
+    sigset_t *signals = arg;
+    int sig;
+    if (sigwait(signals, &sig) == 0) {
+        printf("\nShutting down...\n");
+        drain_chat_log(&chat_log);
+        exit(0);
+    }
+    return NULL;
+}
+
+// Route the stop signals to one thread; every thread started later inherits the blocked mask
+int start_shutdown_thread() {
+    static sigset_t signals;
+    pthread_t tid;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (pthread_create(&tid, NULL, shutdown_thread, &signals) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Worker thread: one pinned event loop with its own listener
+void *event_loop_thread(void *arg) {
+    event_loop_t *loop = (event_loop_t*)arg;
+    pin_to_cpu(loop->index);
+    run_event_loop(loop);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 8080;
+    int capacity = MAX_MESSAGES;
+    int workers = 1;
+    int use_uring = 0;
+    const char *log_dir = NULL;
+    
+    // Parse command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            capacity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            use_uring = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            registry.limit = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-header-bytes") == 0 && i + 1 < argc) {
+            http_limits.max_header_bytes = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-body") == 0 && i + 1 < argc) {
+            http_limits.max_body = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-rooms") == 0 && i + 1 < argc) {
+            max_rooms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-segment") == 0 && i + 1 < argc) {
+            chat_log.segment_limit = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--history-cache") == 0 && i + 1 < argc) {
+            history_cache.limit = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--history <messages>] [--workers <event loops>] [--io-uring] "
+                   "[--max-clients <n>] [--max-header-bytes <bytes>] [--max-body <bytes>] "
+                   "[--max-rooms <n>] [--log-dir <directory>] [--log-segment <bytes>] "
+                   "[--history-cache <pages>]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (capacity <= 0) {
+        printf("History capacity must be positive\n");
+        return -1;
+    }
+    if (max_rooms <= 0) {
+        printf("Max rooms must be positive\n");
+        return -1;
+    }
+    if (history_cache.limit < 0) {
+        printf("History cache size must not be negative\n");
+        return -1;
+    }
+    if (chat_log.segment_limit < 64 * 1024) {
+        printf("Log segments must be at least 65536 bytes\n");
+        return -1;
+    }
+    if (workers <= 0 || workers > MAX_EVENT_LOOPS) {
+        printf("Workers must be between 1 and %d\n", MAX_EVENT_LOOPS);
+        return -1;
+    }
+    if (registry.limit <= 0 || registry.limit > REGISTRY_MAX_SLOTS) {
+        printf("Max clients must be between 1 and %d\n", REGISTRY_MAX_SLOTS);
+        return -1;
+    }
+    // The whole request, chunk framing included, is parsed inside one connection buffer
+    if (http_limits.max_header_bytes < 64 ||
+        http_limits.max_header_bytes + http_limits.max_body + MAX_CHUNK_LINE > BUFFER_SIZE - 1) {
+        printf("Header and body limits must fit in %d bytes together\n",
+               BUFFER_SIZE - 1 - MAX_CHUNK_LINE);
+        return -1;
+    }
+    if (http_limits.max_request_line > http_limits.max_header_bytes) {
+        http_limits.max_request_line = http_limits.max_header_bytes;
+    }
+    
+    printf("Web-Based Chat Server Starting...\n");
+    printf("=====================================\n");
+    raise_fd_limit(registry.limit);
+    if (start_shutdown_thread() < 0) {
+        printf("Could not start the shutdown thread\n");
+        return -1;
+    }
+    
+    // Each room allocates its history ring on its first post
+    history_capacity = capacity;
+    for (int i = 0; i < ROOM_SHARDS; i++) {
+        pthread_mutex_init(&room_shards[i].mutex, NULL);
+    }
+    
+    // Recovery fills the rooms before any loop runs; from then on the writer thread owns the tail segment
+    if (log_dir) {
+        chat_log.valid_room = valid_room_name;
+        chat_log.restore = restore_log_record;
+        chat_log.snapshot = write_log_snapshot;
+        chat_log.room_index = room_log_index;
+        if (open_chat_log(&chat_log, log_dir) < 0) {
+            return -1;
+        }
+        if (start_chat_log(&chat_log) < 0) {
+            printf("Could not start the log writer\n");
+            return -1;
+        }
+    }
+    
+    if (init_static_assets() < 0) {
+        printf("Could not build page assets\n");
+        return -1;
+    }
+    
+    // Every loop is registered before any of them runs, so notify_room_waiters sees a fixed set
+    event_loop_t *loops = calloc(workers, sizeof(event_loop_t));
+    if (loops == NULL) {
+        printf("Could not allocate event loops\n");
+        return -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        loops[i].index = i;
+        if (init_event_loop(&loops[i], port, workers > 1) < 0) {
+            return -1;
+        }
+        if (use_uring && init_uring(&loops[i]) < 0) {
+            printf("io_uring is not available here; event loop %d uses epoll\n", i);
+        }
+        event_loops[event_loop_count++] = &loops[i];
+    }
+    
+    start_worker_pool(WORKER_THREADS);
     
     char *server_ip = get_server_ip();
     printf("Server running successfully!\n\n");
@@ -416,27 +4645,19 @@ int main() {
     printf("Server is ready! Press Ctrl+C to stop.\n");
     printf("=====================================\n\n");
     
-    // Accept connections
-    while (1) {
-        client_len = sizeof(client_addr);
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-        
-        if (client_fd < 0) {
-            continue;
-        }
-        
-        // Create thread to handle client
-        int *client_fd_ptr = malloc(sizeof(int));
-        *client_fd_ptr = client_fd;
-        
-        if (pthread_create(&thread_id, NULL, handle_http_client, client_fd_ptr) != 0) {
-            close(client_fd);
-            free(client_fd_ptr);
-        } else {
-            pthread_detach(thread_id);
+    // The kernel spreads new connections across the SO_REUSEPORT listeners
+    for (int i = 1; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, event_loop_thread, &loops[i]) != 0) {
+            printf("Could not start event loop %d\n", i);
+            return -1;
         }
+        pthread_detach(tid);
+    }
+    if (workers > 1) {
+        pin_to_cpu(0);
     }
+    run_event_loop(&loops[0]);
     
-    close(server_fd);
     return 0;
 }